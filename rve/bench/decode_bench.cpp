@@ -0,0 +1,202 @@
+#include <chrono>
+#include <vector>
+#include "emu.h"
+
+// Decode microbenchmark: per-instruction cost of Emulator::decode (dispatch
+// table) against the cascaded mask/switch decoder insSelect used before it.
+//
+// Usage: decode_bench [elf files...]
+// The code of every ELF is collected and decoded repeatedly by both decoders.
+
+const u32 SCRATCH_SIZE = 1024 * 1024 * 16;
+const int ROUNDS = 2000;
+
+#define legacy(name, data, fmt_t)                    \
+    case data:                                       \
+    {                                                \
+        d->handler = &Emulator::op_##name;           \
+        d->ins_##fmt_t = parse_##fmt_t(ins_word);    \
+        return;                                      \
+    }
+
+// Eight mask/switch stages, in the order insSelect used to apply them
+static void legacyDecode(u32 ins_word, DecodedIns *d)
+{
+    u32 ins_masked;
+    d->ins_word = ins_word;
+
+    ins_masked = ins_word & 0x0000007f;
+    switch (ins_masked)
+    {
+        legacy(auipc, 0x00000017, FormatU)
+        legacy(jal, 0x0000006f, FormatJ)
+        legacy(lui, 0x00000037, FormatU)
+    }
+    ins_masked = ins_word & 0x0000707f;
+    switch (ins_masked)
+    {
+        legacy(addi, 0x00000013, FormatI)
+        legacy(andi, 0x00007013, FormatI)
+        legacy(beq, 0x00000063, FormatB)
+        legacy(bge, 0x00005063, FormatB)
+        legacy(bgeu, 0x00007063, FormatB)
+        legacy(blt, 0x00004063, FormatB)
+        legacy(bltu, 0x00006063, FormatB)
+        legacy(bne, 0x00001063, FormatB)
+        legacy(csrrc, 0x00003073, FormatCSR)
+        legacy(csrrci, 0x00007073, FormatCSR)
+        legacy(csrrs, 0x00002073, FormatCSR)
+        legacy(csrrsi, 0x00006073, FormatCSR)
+        legacy(csrrw, 0x00001073, FormatCSR)
+        legacy(csrrwi, 0x00005073, FormatCSR)
+        legacy(fence, 0x0000000f, FormatEmpty)
+        legacy(fence_i, 0x0000100f, FormatEmpty)
+        legacy(jalr, 0x00000067, FormatI)
+        legacy(lb, 0x00000003, FormatI)
+        legacy(lbu, 0x00004003, FormatI)
+        legacy(lh, 0x00001003, FormatI)
+        legacy(lhu, 0x00005003, FormatI)
+        legacy(lw, 0x00002003, FormatI)
+        legacy(ori, 0x00006013, FormatI)
+        legacy(sb, 0x00000023, FormatS)
+        legacy(sh, 0x00001023, FormatS)
+        legacy(slti, 0x00002013, FormatI)
+        legacy(sltiu, 0x00003013, FormatI)
+        legacy(sw, 0x00002023, FormatS)
+        legacy(xori, 0x00004013, FormatI)
+    }
+    ins_masked = ins_word & 0xf800707f;
+    switch (ins_masked)
+    {
+        legacy(amoswap_w, 0x0800202f, FormatR)
+        legacy(amoadd_w, 0x0000202f, FormatR)
+        legacy(amoxor_w, 0x2000202f, FormatR)
+        legacy(amoand_w, 0x6000202f, FormatR)
+        legacy(amoor_w, 0x4000202f, FormatR)
+        legacy(amomin_w, 0x8000202f, FormatR)
+        legacy(amomax_w, 0xa000202f, FormatR)
+        legacy(amominu_w, 0xc000202f, FormatR)
+        legacy(amomaxu_w, 0xe000202f, FormatR)
+        legacy(sc_w, 0x1800202f, FormatR)
+    }
+    ins_masked = ins_word & 0xf9f0707f;
+    switch (ins_masked)
+    {
+        legacy(lr_w, 0x1000202f, FormatR)
+    }
+    ins_masked = ins_word & 0xfc00707f;
+    switch (ins_masked)
+    {
+        legacy(slli, 0x00001013, FormatR)
+        legacy(srai, 0x40005013, FormatR)
+        legacy(srli, 0x00005013, FormatR)
+    }
+    ins_masked = ins_word & 0xfe00707f;
+    switch (ins_masked)
+    {
+        legacy(add, 0x00000033, FormatR)
+        legacy(and, 0x00007033, FormatR)
+        legacy(div, 0x02004033, FormatR)
+        legacy(divu, 0x02005033, FormatR)
+        legacy(mul, 0x02000033, FormatR)
+        legacy(mulh, 0x02001033, FormatR)
+        legacy(mulhsu, 0x02002033, FormatR)
+        legacy(mulhu, 0x02003033, FormatR)
+        legacy(or, 0x00006033, FormatR)
+        legacy(rem, 0x02006033, FormatR)
+        legacy(remu, 0x02007033, FormatR)
+        legacy(sll, 0x00001033, FormatR)
+        legacy(slt, 0x00002033, FormatR)
+        legacy(sltu, 0x00003033, FormatR)
+        legacy(sra, 0x40005033, FormatR)
+        legacy(srl, 0x00005033, FormatR)
+        legacy(sub, 0x40000033, FormatR)
+        legacy(xor, 0x00004033, FormatR)
+    }
+    ins_masked = ins_word & 0xfe007fff;
+    switch (ins_masked)
+    {
+        legacy(sfence_vma, 0x12000073, FormatEmpty)
+    }
+    ins_masked = ins_word & 0xffffffff;
+    switch (ins_masked)
+    {
+        legacy(ebreak, 0x00100073, FormatEmpty)
+        legacy(ecall, 0x00000073, FormatEmpty)
+        legacy(mret, 0x30200073, FormatEmpty)
+        legacy(sret, 0x10200073, FormatEmpty)
+        legacy(uret, 0x00200073, FormatEmpty)
+        legacy(wfi, 0x10500073, FormatEmpty)
+    }
+
+    d->handler = &Emulator::op_illegal;
+}
+
+template <typename F>
+static double timeDecoder(const std::vector<u32> &words, F decoder)
+{
+    std::vector<DecodedIns> out(words.size());
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        for (size_t i = 0; i < words.size(); i++)
+        {
+            decoder(words[i], &out[i]);
+        }
+        asm volatile("" : : "r"(out.data()) : "memory");
+    }
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    return ns / ((double)ROUNDS * words.size());
+}
+
+int main(int argc, char *argv[])
+{
+    Emulator emu;
+    std::vector<u32> words;
+    u8 *scratch = (u8 *)malloc(SCRATCH_SIZE);
+
+    for (int i = 1; i < argc; i++)
+    {
+        memset(scratch, 0, SCRATCH_SIZE);
+        if (loadElf(argv[i], strlen(argv[i]) + 1, scratch, SCRATCH_SIZE) != 0)
+            continue;
+        for (u32 addr = 0; addr < SCRATCH_SIZE; addr += 4)
+        {
+            u32 word;
+            memcpy(&word, scratch + addr, 4);
+            if (word != 0)
+                words.push_back(word);
+        }
+    }
+    free(scratch);
+
+    if (words.empty())
+    {
+        printf("ERRO: No instructions to decode, pass ELF files\n");
+        return 1;
+    }
+
+    // both decoders have to agree before their timings mean anything
+    for (u32 word : words)
+    {
+        DecodedIns a, b;
+        legacyDecode(word, &a);
+        emu.decode(word, &b);
+        if (a.handler != b.handler)
+        {
+            printf("ERRO: Decoders disagree on %08x\n", word);
+            return 1;
+        }
+    }
+
+    double legacy_ns = timeDecoder(words, legacyDecode);
+    double table_ns = timeDecoder(words, [&emu](u32 word, DecodedIns *d)
+                                  { emu.decode(word, d); });
+
+    printf("INFO: %zu instruction words, %d rounds\n", words.size(), ROUNDS);
+    printf("INFO: cascaded switches: %6.2f ns/ins\n", legacy_ns);
+    printf("INFO: dispatch table:    %6.2f ns/ins\n", table_ns);
+    printf("INFO: speedup:           %6.2fx\n", legacy_ns / table_ns);
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include <chrono>
+#include "emu.h"
+
+// Execution benchmark: guest MIPS of every execution mode on the same image.
+//
+// Usage: exec_bench <elf file> [instructions] [translation]
+// The guest must not exit within the instruction budget (see bench/guest).
+// With a translation of the image from rve-sbt, the block and JIT modes use
+// it. The interpreters run once more with range checked RAM accesses
+// instead of fastmem, to compare the two.
+
+struct BenchMode
+{
+    const char *name;
+    ExecMode mode;
+    bool fastmem;
+};
+
+static const BenchMode modes[] = {
+    {"reference", EXEC_REFERENCE, true},
+    {"threaded", EXEC_THREADED, true},
+    {"block", EXEC_BLOCK, true},
+    {"jit", EXEC_JIT, true},
+    {"ref-nofast", EXEC_REFERENCE, false},
+    {"thr-nofast", EXEC_THREADED, false},
+};
+
+// Successor predictions for blocks ending in a jalr
+struct BranchStat
+{
+    const char *name;
+    u64 BlockCache::*hits;
+    u64 BlockCache::*misses;
+};
+
+static const BranchStat branch_stats[] = {
+    {"return", &BlockCache::ras_hits, &BlockCache::ras_misses},
+    {"indirect", &BlockCache::indirect_hits, &BlockCache::indirect_misses},
+};
+
+#define fused_name(name, first) #name,
+static const char *const fused_names[FUSED_COUNT] = {RV32_FUSIONS(fused_name)};
+#undef fused_name
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: %s <elf file> [instructions] [translation]\n", argv[0]);
+        return 1;
+    }
+    u32 count = argc > 2 ? strtoul(argv[2], NULL, 0) : 50000000;
+
+    Emulator emu;
+    emu.time_locked = true; // the same guest time in every mode
+    if (argc > 3 && !emu.loadTranslation(argv[3]))
+        return 1;
+    double reference_mips = 0;
+    for (const BenchMode &mode : modes)
+    {
+        emu.use_fastmem = mode.fastmem;
+        emu.initializeElf(argv[1]);
+        if (!emu.ready_to_run)
+            return 1;
+        emu.exec_mode = mode.mode;
+
+        auto start = std::chrono::steady_clock::now();
+        emu.run(count);
+        auto end = std::chrono::steady_clock::now();
+
+        double sec = std::chrono::duration<double>(end - start).count();
+        double mips = count / sec / 1e6;
+        if (reference_mips == 0)
+            reference_mips = mips;
+        printf("INFO: %-10s %10u ins %8.3f s %8.2f MIPS (%.2fx)\n", mode.name, count, sec, mips, mips / reference_mips);
+        if (mode.mode == EXEC_BLOCK)
+            printf("INFO: %-10s %10llu built %10llu chained %4llu flushes\n", "", (unsigned long long)emu.blocks.built,
+                   (unsigned long long)emu.blocks.chained, (unsigned long long)emu.blocks.flushes);
+        for (u32 i = 0; mode.mode == EXEC_BLOCK && i < FUSED_COUNT; i++)
+        {
+            // each fused pair covers two instructions
+            if (emu.blocks.fused[i] != 0)
+                printf("INFO: %-10s %10llu fused %-12s %5.1f%% of instructions\n", "", (unsigned long long)emu.blocks.fused[i],
+                       fused_names[i], 200.0 * emu.blocks.fused[i] / count);
+        }
+        for (const BranchStat &stat : branch_stats)
+        {
+            u64 hits = emu.blocks.*stat.hits, misses = emu.blocks.*stat.misses;
+            if (mode.mode >= EXEC_BLOCK && hits + misses != 0)
+                printf("INFO: %-10s %10llu %-8s hits %5.1f%% of %llu\n", "", (unsigned long long)hits, stat.name,
+                       100.0 * hits / (hits + misses), (unsigned long long)(hits + misses));
+        }
+        if (mode.mode >= EXEC_BLOCK && emu.blocks.spin_skipped != 0)
+            printf("INFO: %-10s %10llu polling %5.1f%% of instructions\n", "", (unsigned long long)emu.blocks.spin_skipped,
+                   100.0 * emu.blocks.spin_skipped / count);
+        u64 tlb_lookups = emu.cpu.tlb.hits + emu.cpu.tlb.misses;
+        if (tlb_lookups != 0)
+            printf("INFO: %-10s %10llu tlb      hits %5.1f%% of %llu\n", "", (unsigned long long)emu.cpu.tlb.hits,
+                   100.0 * emu.cpu.tlb.hits / tlb_lookups, (unsigned long long)tlb_lookups);
+        if (mode.mode == EXEC_JIT)
+            printf("INFO: %-10s %10llu translated %7llu resets\n", "", (unsigned long long)emu.jit.translated,
+                   (unsigned long long)emu.jit.resets);
+    }
+    printf("INFO: host RSS %.1f MiB after all modes\n", emu.hostRss() / 1048576.0);
+    return 0;
+}
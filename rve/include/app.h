@@ -45,6 +45,9 @@ struct AppSettings
 
 static MemoryEditor mem_editor;
 
+// Instructions per frame when the clock is unlimited (-1)
+const u32 UI_FRAME_BATCH = 1000000;
+
 class App
 {
     bool running;
@@ -60,6 +63,7 @@ class App
 
     // Emulator
     Emulator emu;
+    StopConditions stop_conditions;
     ImGui::FileBrowser elfFileDialog;
     ImGui::FileBrowser linuxFileDialog;
 
@@ -71,6 +75,7 @@ public:
     int destroyUI();
     int initializeEmu(int argc, char *argv[]);
     void stepEmu();
+    void runEmu(u64 count);
     // Rendering
     void beginRender();
     void endRender();
@@ -0,0 +1,170 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include <cstdint>
+#include <cstdlib>
+
+#include "instructions.h"
+
+using u32 = uint32_t;
+using u64 = uint64_t;
+using u8 = uint8_t;
+
+// Basic-block translation cache.
+//
+// A block is a run of predecoded instructions starting in one 4KiB page that
+// ends at a branch, jump, CSR access or SYSTEM instruction (or at the page
+// end, where its last instruction may reach into the next page).
+// Blocks remember their static successors (the taken target and the fall
+// through pc) and link to those blocks the first time they are followed, so
+// hot loops move from block to block without going through the lookup table.
+//
+// Blocks are carved out of one arena. Stores into a page drop every block
+// that starts in it; a full flush (fence.i or a full arena) resets the arena
+// and bumps `generation`, which invalidates all chain links held by the
+// executor.
+//
+// Blocks are found by their (virtual) start pc and the translation regime
+// they were built in (RV32::vm_space), and filed under the physical page
+// they start in. While fetches are translated, the executor checks a block
+// against the TLB before entering it, so blocks outlive sfence.vma and only
+// ever run where their start still maps; a block stops in front of a 32-bit
+// instruction that would reach into the next virtual page.
+//
+// Blocks ending in a jalr have no static successor. Returns are predicted
+// with a host side return stack: a block ending in a call (jal or jalr that
+// links ra or t0) is pushed when it retires, and a return (jalr x0, 0(ra)
+// or 0(t0)) pops it and continues at the block its `returned` link holds.
+// Other indirect jumps, and returns the stack got wrong, try the block the
+// same jalr went to last time (`indirect`) before the lookup table.
+//
+// Blocks of an image translated ahead of time (see sbt.h) carry their
+// translation, which runs in place of the interpreter up to where the JIT
+// would stop.
+//
+// A block that starts a short polling loop (see Emulator::spinLength) is
+// marked with the loop's length. Entering it fast-forwards the clock over
+// the iterations that fit before the next device event, as long as there
+// are at least SPIN_MIN_ITERATIONS of them.
+const u32 BCACHE_TABLE_BITS = 16;
+const u32 BCACHE_ARENA_SIZE = 1024 * 1024 * 32; // 32MiB
+const u32 BLOCK_MAX_OPS = 64;
+const u32 NO_SUCCESSOR = 0xFFFFFFFF;
+const u32 BCACHE_RAS_SIZE = 32; // return stack entries, a power of two
+const u32 SPIN_MAX_OPS = 8;
+const u32 SPIN_MIN_ITERATIONS = 64;
+// Clock ticks one skip may cover; under 2^31, so the 32-bit counter a loop
+// compares wraps or crosses its sign bit at most once in a skip
+const u64 SPIN_MAX_WINDOW = 1 << 30;
+
+struct DecodedIns;
+struct SbtBlock;
+
+struct BasicBlock
+{
+    u32 start_pc;
+    u32 phys;              // physical address of start_pc
+    u32 space;             // RV32::vm_space it was built in
+    u32 len;               // number of instructions
+    u32 taken_pc;          // static successors, NO_SUCCESSOR if unknown
+    u32 fall_pc;
+    u32 return_pc;         // pc after the ending call, NO_SUCCESSOR if it is not one
+    BasicBlock *taken;     // chained successors, linked on first use
+    BasicBlock *fall;
+    BasicBlock *returned;  // block at return_pc, linked on the first return to it
+    BasicBlock *indirect;  // last target of the ending jalr
+    bool ends_jalr;
+    bool ends_return;
+    BasicBlock *page_next; // other blocks starting in the same page
+    bool valid;
+    u32 execs;             // times entered from the dispatcher, for the JIT
+    u32 native_len;        // leading instructions covered by `native`
+    void *native;          // JIT translation, NULL if not translated
+    u32 spin_len;          // instructions in the polling loop starting here, 0 if none
+    const SbtBlock *aot;   // ahead-of-time translation, NULL if none
+    DecodedIns *ops;
+};
+
+class BlockCache
+{
+public:
+    BasicBlock **table;       // direct mapped on start pc
+    BasicBlock **page_blocks; // per RAM page list of blocks
+    u32 num_pages;
+    u8 *arena;
+    u32 arena_used;
+    u32 generation;
+
+    // Stats
+    u64 built;
+    u64 chained;
+    u64 flushes;
+    u64 spin_skipped; // instructions retired by fast-forwarding polling loops
+    u64 ras_hits;        // returns that went where the return stack predicted
+    u64 ras_misses;
+    u64 indirect_hits;   // jalr exits that found their successor linked
+    u64 indirect_misses;
+
+    // Return stack, wraps around when full
+    BasicBlock *ras[BCACHE_RAS_SIZE];
+    u32 ras_top;
+    u64 fused[FUSED_COUNT]; // executions of each fused pair, by FUSED_* - FUSED_FIRST
+
+    BlockCache();
+    ~BlockCache();
+    // Arena and tables are owned per instance; copies start out empty
+    BlockCache(const BlockCache &other);
+    BlockCache &operator=(const BlockCache &other);
+
+    void init(u32 mem_size);
+    void flush();
+    void invalidatePage(u32 page);
+
+    // Returns a block with room for BLOCK_MAX_OPS instructions, flushing
+    // the cache if the arena is full. insert() trims it to its real length.
+    BasicBlock *alloc();
+    void insert(BasicBlock *b);
+
+    inline void pushReturn(BasicBlock *caller)
+    {
+        ras[ras_top++ & (BCACHE_RAS_SIZE - 1)] = caller;
+    }
+
+    // Returns the caller of the innermost call, NULL if not known
+    inline BasicBlock *popReturn()
+    {
+        BasicBlock **entry = &ras[--ras_top & (BCACHE_RAS_SIZE - 1)];
+        BasicBlock *caller = *entry;
+        *entry = NULL;
+        return caller;
+    }
+
+    // Chain slot for the successor at `pc` of `b`, which ends in a jalr: the
+    // one after the caller for a return the stack predicts, else the last
+    // target. The caller checks the linked block's start pc.
+    inline BasicBlock **indirectLink(BasicBlock *b, u32 pc)
+    {
+        if (b->ends_return)
+        {
+            BasicBlock *caller = popReturn();
+            if (caller != NULL && caller->return_pc == pc && caller->space == b->space)
+            {
+                ras_hits++;
+                return &caller->returned;
+            }
+            ras_misses++;
+        }
+        return &b->indirect;
+    }
+
+    inline BasicBlock *find(u32 pc, u32 space)
+    {
+        BasicBlock *b = table[(pc >> 1) & ((1 << BCACHE_TABLE_BITS) - 1)];
+        return (b != NULL && b->start_pc == pc && b->space == space) ? b : NULL;
+    }
+
+private:
+    void release();
+};
+
+#endif
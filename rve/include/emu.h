@@ -3,8 +3,13 @@
 
 #include <cstdint>
 #include <cstdlib>
+#include <vector>
 #include <sys/mman.h>
 #include "rv32.h"
+#include "icache.h"
+#include "bcache.h"
+#include "jit.h"
+#include "sbt.h"
 #include "loader.h"
 #include "disasm.h"
 
@@ -84,20 +89,151 @@ typedef struct
 
 FormatEmpty parse_FormatEmpty(u32 word);
 
+// Returns the 32-bit instruction a compressed (RVC) one stands for, or 0
+// (an illegal instruction) for reserved and unsupported encodings
+u32 expandCompressed(u32 half);
+
+// Predecoded instruction, as stored in the InsCache. Only the operand
+// format of the resolved handler is parsed, so the formats share storage.
+// Compressed instructions are stored expanded, `len` tells them apart.
+class Emulator;
+// The counter operand of a polling loop's closing branch, see
+// Emulator::spinReadsSafe()
+struct SpinCounter
+{
+    u32 reg;
+    bool is_signed; // compared by blt/bge
+    bool falling;   // the counter was subtracted from something
+};
+
+struct DecodedIns;
+typedef void (Emulator::*ins_handler)(const DecodedIns *d, ins_ret *ret);
+
+struct DecodedIns
+{
+    ins_handler handler; // NULL if the slot has not been decoded yet
+    u16 op;              // INS_* index, selects the threaded interpreter label
+    u16 len;             // 2 for compressed instructions, 4 otherwise
+    u32 ins_word;        // expanded to 32 bits for compressed instructions
+    union
+    {
+        FormatR ins_FormatR;
+        FormatI ins_FormatI;
+        FormatS ins_FormatS;
+        FormatU ins_FormatU;
+        FormatJ ins_FormatJ;
+        FormatB ins_FormatB;
+        FormatCSR ins_FormatCSR;
+        FormatEmpty ins_FormatEmpty;
+    };
+};
+
+inline DecodedIns *InsCache::lookup(u32 addr)
+{
+    u32 page = (addr & 0x7FFFFFFF) >> ICACHE_PAGE_SHIFT;
+    if ((addr & 0x80000000) == 0 || page >= num_pages)
+        return NULL;
+    if (pages[page] == NULL)
+        allocPage(page);
+    return &pages[page][icacheSlot(addr)];
+}
 
 
 // Emulator
-#define def(name, fmt_t) \
-    void emu_##name(u32 ins_word, ins_ret *ret, fmt_t ins)
+#define def(name, fmt_t)                                   \
+    void emu_##name(u32 ins_word, ins_ret *ret, fmt_t ins); \
+    void op_##name(const DecodedIns *d, ins_ret *ret)
+
+
+// Execution modes, selectable at runtime
+enum ExecMode
+{
+    EXEC_REFERENCE, // emulate(), one call per instruction
+    EXEC_THREADED,  // computed-goto threaded interpreter
+    EXEC_BLOCK,     // threaded interpreter over chained basic blocks
+    EXEC_JIT,       // blocks, hot ones translated to host code
+    EXEC_MODE_COUNT
+};
+
+const char *const exec_mode_names[EXEC_MODE_COUNT] = {"Reference", "Threaded", "Block", "JIT"};
+
+// Per-instruction debug output, selectable at runtime. Anything but
+// DEBUG_OFF runs through emulate() regardless of the exec mode.
+enum DebugMode
+{
+    DEBUG_OFF,   // no output, the exec mode's fast paths
+    DEBUG_PRINT, // handler name and disassembly, reference decode
+    DEBUG_TRACE, // disassembly only, predecoded instructions as in DEBUG_OFF
+    DEBUG_STEP,  // DEBUG_PRINT plus the full processor state
+    DEBUG_MODE_COUNT
+};
 
+const char *const debug_mode_names[DEBUG_MODE_COUNT] = {"Off", "Print", "Trace", "Single-Step"};
+
+// What emulate() does besides running the instruction. Each DebugMode is
+// its own instantiation, so the DEBUG_OFF one has no debug branches.
+template <bool decode_always, bool print_names, bool print_disasm, bool dump_state>
+struct ExecPolicy
+{
+    static const bool DECODE_ALWAYS = decode_always; // skip the InsCache
+    static const bool PRINT_NAMES = print_names;
+    static const bool PRINT_DISASM = print_disasm;
+    static const bool DUMP_STATE = dump_state;
+};
+
+typedef ExecPolicy<false, false, false, false> ThroughputPolicy;
+typedef ExecPolicy<true, true, true, false> PrintPolicy;
+typedef ExecPolicy<false, false, true, false> TracePolicy;
+typedef ExecPolicy<true, true, true, true> StepPolicy;
+
+// Why Emulator::run() returned
+enum StopReason
+{
+    STOP_BUDGET,     // max_instructions retired
+    STOP_BREAKPOINT, // pc reached a breakpoint, which has not run yet
+    STOP_TRAP,       // an exception was taken, pc is at the handler
+    STOP_WFI,        // a wfi retired
+    STOP_EXIT,       // the guest asked to exit, see exit_code
+    STOP_REASON_COUNT
+};
+
+const char *const stop_reason_names[STOP_REASON_COUNT] = {"Budget", "Breakpoint", "Trap", "WFI", "Exit"};
+
+// Stop conditions for run() besides the budget; exits always stop
+struct StopConditions
+{
+    std::vector<u32> breakpoints; // not checked for the first instruction
+    bool on_trap = false;
+    bool on_wfi = false;
+};
+
+// Guest RAM starts at RAM_BASE and may reach the top of the address space
+const u32 DEFAULT_MEM_SIZE = 128 * 1024 * 1024;
+const u32 MAX_MEM_SIZE = 0x80000000;
+
+// Parses a RAM amount in bytes with an optional k, m or g suffix, e.g. 512m.
+// False unless it is a whole number of pages up to MAX_MEM_SIZE.
+bool parseMemSize(const char *text, u32 *size);
 
 class Emulator
 {
 public:
-    int MEM_SIZE = 1024 * 1024 * 128; // 128MiB
+    // Bytes of guest RAM, taking effect at initialize(). RAM is mapped
+    // anonymously, so pages the guest never touches cost no host memory.
+    u32 MEM_SIZE = DEFAULT_MEM_SIZE;
 
-    uint8_t *memory;
+    uint8_t *memory = NULL;
+    u32 memory_mapped = 0; // bytes mapped at memory outside fastmem
     RV32 cpu;
+    // Guest RAM lives in here unless use_fastmem is off or the host lacks it
+    FastMem fastmem;
+    InsCache icache;
+    BlockCache blocks;
+    Jit jit;
+
+    // Ahead-of-time translation from loadTranslation(), NULL if none
+    const SbtImage *sbt = NULL;
+    SbtContext sbt_ctx;
 
     // Filenames
     std::string elf_file_path = "no elf selected";
@@ -105,8 +241,16 @@ public:
     std::string bin_file_path = "no image selected";
 
     // debugging
-    bool debugMode = false;
+    DebugMode debugMode = DEBUG_OFF;
+    ExecMode exec_mode = EXEC_JIT;
     bool running = false;
+    bool wfi_sleep = true; // wfi skips ahead to the next device event
+    // mtime follows host time unless locked to the instruction count; both
+    // are divided by time_divisor, see RV32::timeBase()
+    bool time_locked = false;
+    u32 time_divisor = 1;
+    bool use_fastmem = true; // see fastmem.h, takes effect at initialize()
+    bool huge_pages = false; // transparent huge pages for guest RAM
 
     // Control
     bool ready_to_run = false;
@@ -117,15 +261,65 @@ public:
     float time_sum = 0;
     float sec_per_cycle = 1.0 / clk_freq_sel;
 
+    // run() state, read by the execution loops
+    bool stop_pending = false;
+    bool stop_on_trap = false;
+    bool stop_on_wfi = false;
+    StopReason stop_reason = STOP_BUDGET;
+    u32 exit_code = 0;
+    u64 retired = 0; // instructions retired by the last run()
+
+    u32 npc = 0; // next pc of the instruction emulate() is running
+
     Emulator(/* args */);
     ~Emulator();
 
     void initialize();
+    bool mapRam();
+    void unmapRam();
+    // Host memory in use: the whole process, and the guest RAM pages in it
+    u64 hostRss();
+    u64 residentRam();
     void initializeBin(const char *path);
     void initializeElf(const char *path);
     void initializeElfDts(const char *elf_file, const char *dts_file);
-    void emulate(); // formerly cpu_tick
-    ins_ret insSelect(u32 ins_word);
+    // Loads a shared object made by rve-sbt, which stays loaded for good
+    bool loadTranslation(const char *path);
+    const SbtBlock *findTranslation(BasicBlock *b);
+    void emulate(); // formerly cpu_tick, runs one instruction in debugMode
+    template <typename Policy>
+    void emulateWith();
+    template <typename Policy>
+    u64 emulateStepped(u64 count, const StopConditions &stop);
+    u32 emulateThreaded(u32 count);
+    u32 emulateBlocks(u32 count);
+    BasicBlock *buildBlock(u32 pc, u32 phys);
+    bool blockMapped(BasicBlock *b);
+    u32 spinLength(u32 pc);
+    bool spinReadsSafe(u32 pc, u32 len, SpinCounter *counter);
+    u32 spinIteration(u32 pc, u32 phys, u32 len);
+    u32 skipSpin(BasicBlock *b, u32 count);
+    // Runs up to `max_instructions` with the selected exec mode
+    StopReason run(u64 max_instructions, const StopConditions &stop = StopConditions());
+    inline void stopRun(StopReason reason)
+    {
+        if (!stop_pending)
+        {
+            stop_pending = true;
+            stop_reason = reason;
+        }
+    }
+    // Runs the device events that came due by the current clock; the only
+    // device work on the execution fast paths
+    inline void tickDevices()
+    {
+        if (cpu.events.due(cpu.clock))
+            cpu.runEvents();
+    }
+    template <typename Policy>
+    void insSelect(u32 ins_word, ins_ret *ret);
+    void decode(u32 ins_word, DecodedIns *d);
+    void fetchDecode(u32 pc, DecodedIns *d);
 
     // File utilities
     u8 getMmapPtr(const char *path);
@@ -164,6 +358,7 @@ public:
     def(ecall, FormatEmpty);  // system
     def(fence, FormatEmpty); // rv32i
     def(fence_i, FormatEmpty);  // rv32i
+    def(illegal, FormatEmpty); // invalid encoding
     def(jal, FormatJ);  // rv32i
     def(jalr, FormatI);  // rv32i
     def(lb, FormatI);  // rv32i
@@ -0,0 +1,93 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <cstdint>
+
+using u32 = uint32_t;
+using u64 = uint64_t;
+
+// Device event queue.
+//
+// Devices do not run after every instruction. Each one registers the clock
+// value (retired instruction count) at which it next has work to do, and the
+// execution loops only compare the clock against the earliest of those,
+// `next`. There are only a few event sources, so the queue is a fixed array
+// indexed by DeviceEvent and `next` is found by a scan when events run.
+//
+// Events with nothing to do come back after at most EVENT_MAX_DELAY.
+enum DeviceEvent
+{
+    EVENT_CLINT,   // msip and the mtimecmp match
+    EVENT_UART_TX, // THR drains to stdout
+    EVENT_UART_RX, // RBR is polled for input
+    EVENT_COUNT
+};
+
+const u32 EVENT_MAX_DELAY = 0x40000000;
+
+class EventQueue
+{
+public:
+    u64 deadline[EVENT_COUNT];
+    bool armed[EVENT_COUNT];
+    u64 next; // earliest armed deadline, may be early but never late
+
+    void init(u64 now)
+    {
+        for (u32 i = 0; i < EVENT_COUNT; i++)
+        {
+            armed[i] = false;
+        }
+        next = now + EVENT_MAX_DELAY;
+    }
+
+    inline bool due(u64 now)
+    {
+        return now >= next;
+    }
+
+    // Runs `e` once the clock reaches `at`, replacing its previous deadline
+    inline void schedule(DeviceEvent e, u64 at)
+    {
+        deadline[e] = at;
+        armed[e] = true;
+        if (at < next)
+            next = at;
+    }
+
+    // Earliest armed deadline other than that of `skip`, `now` plus
+    // EVENT_MAX_DELAY if there is none
+    u64 nextExcept(DeviceEvent skip, u64 now)
+    {
+        u64 nearest = now + EVENT_MAX_DELAY;
+        for (u32 i = 0; i < EVENT_COUNT; i++)
+        {
+            if (armed[i] && i != (u32)skip && deadline[i] < nearest)
+                nearest = deadline[i];
+        }
+        return nearest;
+    }
+
+    // Disarms and returns an event that is due at `now`. Returns EVENT_COUNT
+    // once none are left, with `next` set to the earliest remaining deadline.
+    DeviceEvent pop(u64 now)
+    {
+        u64 nearest = now + EVENT_MAX_DELAY;
+        for (u32 i = 0; i < EVENT_COUNT; i++)
+        {
+            if (!armed[i])
+                continue;
+            if (deadline[i] <= now)
+            {
+                armed[i] = false;
+                return (DeviceEvent)i;
+            }
+            if (deadline[i] < nearest)
+                nearest = deadline[i];
+        }
+        next = nearest;
+        return EVENT_COUNT;
+    }
+};
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef FASTMEM_H
+#define FASTMEM_H
+
+#include <cstdint>
+#include <cstring>
+
+using u32 = uint32_t;
+using u64 = uint64_t;
+using u16 = uint16_t;
+using u8 = uint8_t;
+
+class RV32;
+
+// Host mirror of the guest physical address space.
+//
+// A 4GiB region of host address space stands for the guest's, with guest RAM
+// mapped at its physical address and everything else left inaccessible. A
+// load or store is then a single host access at base + address. Accesses
+// that hit anything but RAM (devices, the DTB, nothing) fault; a SIGSEGV
+// handler decodes the faulting instruction, performs the access through the
+// hart's memory map and resumes after it.
+//
+// Only the accessors below are expected to fault, so the handler knows the
+// handful of instructions they compile to. The faults are synchronous and
+// come from emulator code between two guest instructions, so the device
+// models may run from the handler as they would from a call.
+//
+// Linux on x86-64 only; elsewhere mapRam() fails and the hart keeps its
+// range checked accessors.
+#if defined(__x86_64__) && defined(__linux__)
+#define FASTMEM_X86_64
+#endif
+
+// The guest space plus a page for accesses that start at its last bytes
+const u64 FASTMEM_SPAN = (1ull << 32) + 4096;
+const u32 FASTMEM_MAX_ARENAS = 8;
+
+class FastMem
+{
+public:
+    u8 *base;   // guest physical address 0, NULL until mapRam()
+    RV32 *hart; // whose memory map handles the faults
+    u64 faults; // accesses the fault handler performed
+    u32 ram_base;
+    u32 ram_size; // 0 if no RAM is mapped
+
+    FastMem();
+    ~FastMem();
+    // The region is owned per instance; copies start out without one
+    FastMem(const FastMem &other);
+    FastMem &operator=(const FastMem &other);
+
+    // Maps `ram_size` bytes of zeroed RAM at guest address `ram_base`,
+    // reserving the region and installing the handler the first time.
+    // Returns the RAM, NULL if fastmem is not available.
+    u8 *mapRam(RV32 *hart, u32 ram_base, u32 ram_size);
+    void release();
+
+    // Performs the access of the instruction that faulted with the context
+    // `uc`, false if it is not one of the accessors' or not in this region
+    bool handleFault(void *uc);
+};
+
+// The accessors, zero extended. Each is exactly one mov, see above.
+#ifdef FASTMEM_X86_64
+inline u32 fastLoad8(const u8 *p)
+{
+    u32 val;
+    asm volatile("movzbl %1, %0" : "=r"(val) : "m"(*p));
+    return val;
+}
+
+inline u32 fastLoad16(const u8 *p)
+{
+    u32 val;
+    asm volatile("movzwl %1, %0" : "=r"(val) : "m"(*(const u16 *)p));
+    return val;
+}
+
+inline u32 fastLoad32(const u8 *p)
+{
+    u32 val;
+    asm volatile("movl %1, %0" : "=r"(val) : "m"(*(const u32 *)p));
+    return val;
+}
+
+inline void fastStore8(u8 *p, u32 val)
+{
+    asm volatile("movb %b1, %0" : "=m"(*p) : "q"(val));
+}
+
+inline void fastStore16(u8 *p, u32 val)
+{
+    asm volatile("movw %w1, %0" : "=m"(*(u16 *)p) : "r"(val));
+}
+
+inline void fastStore32(u8 *p, u32 val)
+{
+    asm volatile("movl %1, %0" : "=m"(*(u32 *)p) : "r"(val));
+}
+#else
+// never reached without a region, see mapRam()
+inline u32 fastLoad8(const u8 *p)
+{
+    return *p;
+}
+
+inline u32 fastLoad16(const u8 *p)
+{
+    u16 val;
+    memcpy(&val, p, 2);
+    return val;
+}
+
+inline u32 fastLoad32(const u8 *p)
+{
+    u32 val;
+    memcpy(&val, p, 4);
+    return val;
+}
+
+inline void fastStore8(u8 *p, u32 val)
+{
+    *p = val;
+}
+
+inline void fastStore16(u8 *p, u32 val)
+{
+    u16 half = val;
+    memcpy(p, &half, 2);
+}
+
+inline void fastStore32(u8 *p, u32 val)
+{
+    memcpy(p, &val, 4);
+}
+#endif
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef ICACHE_H
+#define ICACHE_H
+
+#include <cstdint>
+#include <cstdlib>
+
+using u32 = uint32_t;
+using u8 = uint8_t;
+
+// Predecoded instruction cache.
+//
+// Guest RAM is split into 4KiB physical pages. The first time an instruction
+// is fetched from a page, a table of DecodedIns slots (one per 16-bit parcel,
+// as compressed instructions can start at any of them) is allocated for it.
+// Each slot holds the resolved handler and pre-extracted operands so later
+// executions skip both fetch and decode. Any store into a page that has a
+// table drops the slots it hits, and fence.i flushes everything.
+//
+// Slots of word aligned parcels come first and the others after them, so
+// code without compressed instructions keeps its slots back to back.
+//
+// A 32-bit instruction in the last parcel of a page ends in the next one.
+// Fetching it allocates the next page's table too, so stores to its upper
+// half take the slow path and drop it.
+const u32 ICACHE_PAGE_SHIFT = 12;
+const u32 ICACHE_PAGE_SIZE = 1 << ICACHE_PAGE_SHIFT;
+const u32 ICACHE_PAGE_SLOTS = ICACHE_PAGE_SIZE >> 1;
+
+// Index of the slot for `addr` in its page's table
+inline u32 icacheSlot(u32 addr)
+{
+    return ((addr >> 2) & (ICACHE_PAGE_SLOTS / 2 - 1)) | ((addr & 0x2) << (ICACHE_PAGE_SHIFT - 3));
+}
+
+struct DecodedIns;
+class BlockCache;
+
+class InsCache
+{
+public:
+    DecodedIns **pages; // One slot table per RAM page, NULL until code is fetched from it
+    u32 num_pages;
+    BlockCache *bcache; // Blocks built from these slots, dropped with their page
+
+    InsCache();
+    ~InsCache();
+    // Slot tables are owned per instance; copies start out empty
+    InsCache(const InsCache &other);
+    InsCache &operator=(const InsCache &other);
+
+    void init(u32 mem_size);
+    void flush();
+    void invalidateSlot(u32 addr);
+
+    // Returns the slot for the instruction at physical address `addr`, or NULL
+    // if the address is not cacheable RAM. A slot with a NULL handler still
+    // needs to be decoded. Defined in emu.h once DecodedIns is complete.
+    inline DecodedIns *lookup(u32 addr);
+
+    // Called for every RAM store; only pages holding code pay for more than a
+    // load. Addresses below RAM wrap past its last page, so device stores
+    // that reach here are ignored.
+    inline void notifyWrite(u32 addr)
+    {
+        u32 page = (addr - 0x80000000) >> ICACHE_PAGE_SHIFT;
+        if (page < num_pages && pages[page] != NULL)
+            invalidateSlot(addr);
+    }
+
+    // The same for a naturally aligned store of 1, 2 or 4 bytes, which stays
+    // within one page but may cover two parcels
+    inline void notifyAlignedWrite(u32 addr, u32 size)
+    {
+        u32 page = (addr - 0x80000000) >> ICACHE_PAGE_SHIFT;
+        if (page < num_pages && pages[page] != NULL)
+        {
+            invalidateSlot(addr);
+            if (size == 4)
+                invalidateSlot(addr + 2);
+        }
+    }
+
+private:
+    void allocPage(u32 page);
+    void freePages();
+};
+
+#endif
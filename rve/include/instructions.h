@@ -0,0 +1,119 @@
+#ifndef INSTRUCTIONS_H
+#define INSTRUCTIONS_H
+
+// RV32IMA + privileged instruction encodings.
+//
+// X(name, mask, match, format): an instruction word `w` encodes `name` when
+// (w & mask) == match. The handler is Emulator::emu_##name, which takes its
+// operands as `format`. The decoder's dispatch table is generated from this
+// list at compile time.
+#define RV32_INSTRUCTIONS(X) \
+    X(add, 0xfe00707f, 0x00000033, FormatR) \
+    X(addi, 0x0000707f, 0x00000013, FormatI) \
+    X(amoadd_w, 0xf800707f, 0x0000202f, FormatR) \
+    X(amoand_w, 0xf800707f, 0x6000202f, FormatR) \
+    X(amomax_w, 0xf800707f, 0xa000202f, FormatR) \
+    X(amomaxu_w, 0xf800707f, 0xe000202f, FormatR) \
+    X(amomin_w, 0xf800707f, 0x8000202f, FormatR) \
+    X(amominu_w, 0xf800707f, 0xc000202f, FormatR) \
+    X(amoor_w, 0xf800707f, 0x4000202f, FormatR) \
+    X(amoswap_w, 0xf800707f, 0x0800202f, FormatR) \
+    X(amoxor_w, 0xf800707f, 0x2000202f, FormatR) \
+    X(and, 0xfe00707f, 0x00007033, FormatR) \
+    X(andi, 0x0000707f, 0x00007013, FormatI) \
+    X(auipc, 0x0000007f, 0x00000017, FormatU) \
+    X(beq, 0x0000707f, 0x00000063, FormatB) \
+    X(bge, 0x0000707f, 0x00005063, FormatB) \
+    X(bgeu, 0x0000707f, 0x00007063, FormatB) \
+    X(blt, 0x0000707f, 0x00004063, FormatB) \
+    X(bltu, 0x0000707f, 0x00006063, FormatB) \
+    X(bne, 0x0000707f, 0x00001063, FormatB) \
+    X(csrrc, 0x0000707f, 0x00003073, FormatCSR) \
+    X(csrrci, 0x0000707f, 0x00007073, FormatCSR) \
+    X(csrrs, 0x0000707f, 0x00002073, FormatCSR) \
+    X(csrrsi, 0x0000707f, 0x00006073, FormatCSR) \
+    X(csrrw, 0x0000707f, 0x00001073, FormatCSR) \
+    X(csrrwi, 0x0000707f, 0x00005073, FormatCSR) \
+    X(div, 0xfe00707f, 0x02004033, FormatR) \
+    X(divu, 0xfe00707f, 0x02005033, FormatR) \
+    X(ebreak, 0xffffffff, 0x00100073, FormatEmpty) \
+    X(ecall, 0xffffffff, 0x00000073, FormatEmpty) \
+    X(fence, 0x0000707f, 0x0000000f, FormatEmpty) \
+    X(fence_i, 0x0000707f, 0x0000100f, FormatEmpty) \
+    X(jal, 0x0000007f, 0x0000006f, FormatJ) \
+    X(jalr, 0x0000707f, 0x00000067, FormatI) \
+    X(lb, 0x0000707f, 0x00000003, FormatI) \
+    X(lbu, 0x0000707f, 0x00004003, FormatI) \
+    X(lh, 0x0000707f, 0x00001003, FormatI) \
+    X(lhu, 0x0000707f, 0x00005003, FormatI) \
+    X(lr_w, 0xf9f0707f, 0x1000202f, FormatR) \
+    X(lui, 0x0000007f, 0x00000037, FormatU) \
+    X(lw, 0x0000707f, 0x00002003, FormatI) \
+    X(mret, 0xffffffff, 0x30200073, FormatEmpty) \
+    X(mul, 0xfe00707f, 0x02000033, FormatR) \
+    X(mulh, 0xfe00707f, 0x02001033, FormatR) \
+    X(mulhsu, 0xfe00707f, 0x02002033, FormatR) \
+    X(mulhu, 0xfe00707f, 0x02003033, FormatR) \
+    X(or, 0xfe00707f, 0x00006033, FormatR) \
+    X(ori, 0x0000707f, 0x00006013, FormatI) \
+    X(rem, 0xfe00707f, 0x02006033, FormatR) \
+    X(remu, 0xfe00707f, 0x02007033, FormatR) \
+    X(sb, 0x0000707f, 0x00000023, FormatS) \
+    X(sc_w, 0xf800707f, 0x1800202f, FormatR) \
+    X(sfence_vma, 0xfe007fff, 0x12000073, FormatEmpty) \
+    X(sh, 0x0000707f, 0x00001023, FormatS) \
+    X(sll, 0xfe00707f, 0x00001033, FormatR) \
+    X(slli, 0xfc00707f, 0x00001013, FormatR) \
+    X(slt, 0xfe00707f, 0x00002033, FormatR) \
+    X(slti, 0x0000707f, 0x00002013, FormatI) \
+    X(sltiu, 0x0000707f, 0x00003013, FormatI) \
+    X(sltu, 0xfe00707f, 0x00003033, FormatR) \
+    X(sra, 0xfe00707f, 0x40005033, FormatR) \
+    X(srai, 0xfc00707f, 0x40005013, FormatR) \
+    X(sret, 0xffffffff, 0x10200073, FormatEmpty) \
+    X(srl, 0xfe00707f, 0x00005033, FormatR) \
+    X(srli, 0xfc00707f, 0x00005013, FormatR) \
+    X(sub, 0xfe00707f, 0x40000033, FormatR) \
+    X(sw, 0x0000707f, 0x00002023, FormatS) \
+    X(uret, 0xffffffff, 0x00200073, FormatEmpty) \
+    X(wfi, 0xffffffff, 0x10500073, FormatEmpty) \
+    X(xor, 0xfe00707f, 0x00004033, FormatR) \
+    X(xori, 0x0000707f, 0x00004013, FormatI)
+
+// Every instruction gets an index (DecodedIns::op), INS_illegal comes last
+#define RV32_INS_ENUM(name, mask, match, fmt_t) INS_##name,
+enum
+{
+    RV32_INSTRUCTIONS(RV32_INS_ENUM)
+    INS_illegal
+};
+#undef RV32_INS_ENUM
+
+// Instruction pairs the block builder fuses into one op.
+//
+// X(name, first): the fused op replaces the first instruction (`first`) of the
+// pair in a block; the second keeps its slot, so block lengths, retire counts
+// and trap pcs are unchanged. Fused ops are numbered after INS_illegal.
+#define RV32_FUSIONS(X)        \
+    X(lui_addi, lui)           \
+    X(auipc_jalr, auipc)       \
+    X(auipc_lw, auipc)         \
+    X(slt_branch, slt)         \
+    X(sltu_branch, sltu)       \
+    X(slti_branch, slti)       \
+    X(sltiu_branch, sltiu)     \
+    X(slli_srli, slli)
+
+#define RV32_FUSED_ENUM(name, first) FUSED_##name,
+enum
+{
+    FUSED_BEFORE_FIRST = INS_illegal,
+    RV32_FUSIONS(RV32_FUSED_ENUM)
+    FUSED_END
+};
+#undef RV32_FUSED_ENUM
+
+const unsigned FUSED_FIRST = INS_illegal + 1;
+const unsigned FUSED_COUNT = FUSED_END - FUSED_FIRST;
+
+#endif
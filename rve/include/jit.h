@@ -0,0 +1,99 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <cstdint>
+#include <cstdlib>
+
+#include "bcache.h"
+
+using u32 = uint32_t;
+using u64 = uint64_t;
+using u8 = uint8_t;
+
+// x86-64 translator for hot basic blocks.
+//
+// Once a block has been entered JIT_HOT_THRESHOLD times, its leading run of
+// RV32IM instructions (ALU, loads/stores, branches and jumps, compressed ones
+// included as blocks hold them expanded) is translated to native code. CSR
+// accesses, AMOs and SYSTEM instructions are never translated: the native
+// code stops in front of them and the block interpreter runs the rest of the
+// block, which also takes every trap.
+//
+// Guest registers stay in RV32::xreg, which translated code addresses as
+// [rbx + 4 * reg] so every register is a one byte displacement off one base.
+// Loads and stores to RAM are done inline; anything else (MMIO, stores into
+// pages holding code) calls into RV32::memGet*/memSet*. Blocks built while
+// loads and stores are translated call those for every access, and one that
+// page faults returns to the dispatcher at that instruction with
+// RV32::fault set.
+//
+// Translated blocks jump straight to the translation of a chained successor
+// while the instruction budget lasts, so devices are only ticked every
+// JIT_SLICE instructions or so. The code buffer is reset when the block
+// cache is flushed, as blocks own the pointers into it.
+const u32 JIT_HOT_THRESHOLD = 16;
+const u32 JIT_CODE_SIZE = 1024 * 1024 * 16; // 16MiB
+const u32 JIT_SLICE = 1024;
+
+class RV32;
+class InsCache;
+
+// Last block run natively and the instruction budget it left
+struct JitResult
+{
+    BasicBlock *block;
+    u64 budget;
+};
+
+typedef JitResult (*jit_entry)(void *native, u64 budget);
+
+class Jit
+{
+public:
+    u8 *code;
+    u32 code_used;
+    u32 code_start;  // translations start after the entry and exit stubs
+    u32 generation;  // BlockCache generation the translations belong to
+    jit_entry enter;
+
+    RV32 *cpu;
+    InsCache *icache;
+    u32 mem_size;
+
+    // Stats
+    u64 translated;
+    u64 resets;
+
+    Jit();
+    ~Jit();
+    // The code buffer is owned per instance; copies start out empty
+    Jit(const Jit &other);
+    Jit &operator=(const Jit &other);
+
+    // False if this host or build has no translator
+    bool available();
+    void init(RV32 *cpu, InsCache *icache, u32 mem_size);
+
+    // Translates `b`, setting b->native and b->native_len. Returns false if
+    // the code buffer is full; the caller flushes the block cache, which
+    // lets the next translation start over with an empty buffer.
+    bool translate(BasicBlock *b, u32 generation);
+
+    // Runs the translation of `b` (which must fit into `budget`) and its
+    // chained successors
+    inline JitResult execute(BasicBlock *b, u32 budget)
+    {
+        return enter(b->native, budget);
+    }
+
+private:
+    u8 *p;         // emit cursor
+    u8 *exit_stub; // returns to the caller of enter()
+
+    void release();
+    void reset(u32 generation);
+    void emitStubs();
+    void emitBlock(BasicBlock *b);
+};
+
+#endif
@@ -39,6 +39,19 @@ int loadLinuxImage(const char *path, uint64_t path_len, uint8_t *data, uint64_t
 // https : // stackoverflow.com/questions/13908276/loading-elf-file-in-c-in-user-space
 int loadElf(const char *path, uint64_t path_len, uint8_t *data, uint64_t data_len);
 
+// Code held by an ELF file, as guest physical addresses (see loadElf)
+struct ElfCode
+{
+    std::vector<std::pair<uint32_t, uint32_t>> ranges; // executable SHT_PROGBITS sections, [start, end)
+    std::vector<uint32_t> entries;                     // entry point and symbols within them
+};
+
+// Function to find the code of an ELF file for ahead-of-time translation.
+// Parameters:
+// - path: A pointer to a constant character array that specifies the file path of the ELF file.
+// - code: Filled with the executable sections and the addresses code is entered at.
+int scanElfCode(const char *path, ElfCode *code);
+
 // Function to load a binary file from the specified file path into the provided memory buffer.
 // Parameters:
 // - path: A pointer to a constant character array indicating the file path of the binary file.
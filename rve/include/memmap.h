@@ -0,0 +1,84 @@
+#ifndef MEMMAP_H
+#define MEMMAP_H
+
+#include <cstdint>
+#include <cstdlib>
+
+using u32 = uint32_t;
+using u8 = uint8_t;
+
+// Physical memory map.
+//
+// The 32-bit physical address space is split into 4KiB pages and a table
+// holds the region of every page, so finding what backs an address is one
+// table load whatever is mapped. A region is RAM or ROM with a host pointer,
+// or an MMIO device with read and write callbacks that get the access width.
+// Regions start and end on 8 byte boundaries so a naturally aligned access
+// is never split between two of them, and do not share pages; one smaller
+// than a page owns the rest of it, unmapped.
+//
+// Pages without a region, and the parts of pages beyond their region, read
+// as zero and ignore writes.
+const u32 MEMMAP_PAGE_SHIFT = 12;
+const u32 MEMMAP_PAGES = 1 << (32 - MEMMAP_PAGE_SHIFT);
+const u32 MEMMAP_MAX_REGIONS = 16;
+
+enum MemRegionType
+{
+    REGION_UNMAPPED,
+    REGION_RAM,
+    REGION_ROM,
+    REGION_MMIO,
+};
+
+// Device callbacks, `offset` is from the start of the region and aligned to
+// `size` (1, 2 or 4 bytes)
+typedef u32 (*mmio_read_fn)(void *device, u32 offset, u32 size);
+typedef void (*mmio_write_fn)(void *device, u32 offset, u32 val, u32 size);
+
+struct MemRegion
+{
+    MemRegionType type;
+    u32 base;
+    u32 size;
+    const char *name;
+    u8 *host; // RAM and ROM contents
+    void *device;
+    mmio_read_fn read;
+    mmio_write_fn write;
+};
+
+class MemoryMap
+{
+public:
+    MemRegion regions[MEMMAP_MAX_REGIONS]; // regions[0] is the unmapped region
+    u32 count;
+    u8 *page_region; // index into regions per page
+
+    MemoryMap();
+    ~MemoryMap();
+    // The page table is owned per instance; copies start out empty
+    MemoryMap(const MemoryMap &other);
+    MemoryMap &operator=(const MemoryMap &other);
+
+    // Drops all regions, allocating the page table the first time
+    void init();
+
+    bool addRam(const char *name, u32 base, u32 size, u8 *host);
+    bool addRom(const char *name, u32 base, u32 size, const u8 *host);
+    bool addMmio(const char *name, u32 base, u32 size, void *device, mmio_read_fn read, mmio_write_fn write);
+
+    // Region holding `addr`, the unmapped one if there is none
+    inline const MemRegion *find(u32 addr)
+    {
+        const MemRegion *r = &regions[page_region[addr >> MEMMAP_PAGE_SHIFT]];
+        if (addr - r->base >= r->size)
+            return &regions[0];
+        return r;
+    }
+
+private:
+    bool add(const MemRegion &region);
+};
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef MMU_H
+#define MMU_H
+
+#include <cstdint>
+#include <cstring>
+
+using u32 = uint32_t;
+using u64 = uint64_t;
+using u8 = uint8_t;
+
+// Sv32 address translation.
+//
+// Translations are cached in a direct-mapped software TLB indexed by the
+// virtual page number. An entry keeps one tag per kind of access (fetch,
+// load, store), so checking a hit and the permission is a single compare
+// against a key made of the page, the ASID and the translation context (U
+// or S-mode, SUM and MXR for loads and stores). An access the entry does
+// not allow has a tag no key matches, so it walks the page table and gets
+// its fault from there. Stores only hit pages whose PTE is already dirty.
+//
+// Entries stay valid across satp writes and privilege changes, as those
+// change the key; sfence.vma drops them.
+const u32 SATP_MODE_SV32 = 0x80000000;
+const u32 SATP_ASID_SHIFT = 22;
+const u32 SATP_ASID_MASK = 0x1FF;
+const u32 SATP_PPN_MASK = 0x003FFFFF;
+
+// mstatus bits translation depends on
+const u32 MSTATUS_MPRV = 1 << 17;
+const u32 MSTATUS_SUM = 1 << 18;
+const u32 MSTATUS_MXR = 1 << 19;
+
+// Page table entry bits
+const u32 PTE_V = 1 << 0;
+const u32 PTE_R = 1 << 1;
+const u32 PTE_W = 1 << 2;
+const u32 PTE_X = 1 << 3;
+const u32 PTE_U = 1 << 4;
+const u32 PTE_G = 1 << 5;
+const u32 PTE_A = 1 << 6;
+const u32 PTE_D = 1 << 7;
+
+const u32 MMU_PAGE_SHIFT = 12;
+const u32 MMU_PAGE_SIZE = 1 << MMU_PAGE_SHIFT;
+const u32 MMU_PAGE_MASK = ~(MMU_PAGE_SIZE - 1);
+const u32 MMU_MEGAPAGE_MASK = ~((1 << 22) - 1);
+
+const u32 TLB_ENTRIES = 256; // power of two
+
+// Key bits below the page number, see tlbKey()
+const u32 TLB_KEY_MXR = 1 << 0;
+const u32 TLB_KEY_SUM = 1 << 1;
+const u32 TLB_KEY_USER = 1 << 2;
+const u32 TLB_KEY_ASID_SHIFT = 3;
+// Matches no key: U-mode keys never have SUM set
+const u32 TLB_NO_MATCH = 0xFFFFFFFF;
+
+// Translation regime bits of RV32::vm_space, above the fetch context
+const u32 VM_SPACE_DATA = 1 << 30;
+const u32 VM_SPACE_FETCH = 1 << 31;
+
+enum MemAccess
+{
+    ACCESS_FETCH,
+    ACCESS_LOAD,
+    ACCESS_STORE,
+    ACCESS_COUNT
+};
+
+struct TlbEntry
+{
+    u32 tag[ACCESS_COUNT]; // key that hits for each kind of access
+    u32 vaddr;             // virtual page
+    u32 span;              // mask of the mapping's page, 4MiB for megapages
+    u32 paddr;             // physical page
+    u32 asid;
+    bool global;           // PTE_G, kept by sfence.vma for one ASID
+    u8 *host;              // the page in host memory, NULL if it is not RAM
+};
+
+// Key of an access to `vaddr` in context `context` (ASID and mode bits)
+inline u32 tlbKey(u32 vaddr, u32 context)
+{
+    return (vaddr & MMU_PAGE_MASK) | context;
+}
+
+class Tlb
+{
+public:
+    TlbEntry entries[TLB_ENTRIES];
+    u64 hits;
+    u64 misses;
+
+    void init()
+    {
+        flush();
+        hits = 0;
+        misses = 0;
+    }
+
+    inline TlbEntry *slot(u32 vaddr)
+    {
+        return &entries[(vaddr >> MMU_PAGE_SHIFT) & (TLB_ENTRIES - 1)];
+    }
+
+    void flush()
+    {
+        for (u32 i = 0; i < TLB_ENTRIES; i++)
+        {
+            drop(&entries[i]);
+        }
+    }
+
+    // sfence.vma: entries for `vaddr` if `by_addr`, of ASID `asid` (global
+    // ones excepted) if `by_asid`
+    void flush(bool by_addr, u32 vaddr, bool by_asid, u32 asid)
+    {
+        for (u32 i = 0; i < TLB_ENTRIES; i++)
+        {
+            TlbEntry *e = &entries[i];
+            if (by_addr && ((e->vaddr ^ vaddr) & e->span) != 0)
+                continue;
+            if (by_asid && (e->global || e->asid != asid))
+                continue;
+            drop(e);
+        }
+    }
+
+private:
+    static void drop(TlbEntry *e)
+    {
+        e->tag[ACCESS_FETCH] = TLB_NO_MATCH;
+        e->tag[ACCESS_LOAD] = TLB_NO_MATCH;
+        e->tag[ACCESS_STORE] = TLB_NO_MATCH;
+    }
+};
+
+#endif
@@ -2,10 +2,16 @@
 #define RV32IMA_H
 
 #include <cstdint>
+#include <cstring>
 #include <stdio.h>
 #include <assert.h>
 
 #include "types.h"
+#include "icache.h"
+#include "events.h"
+#include "memmap.h"
+#include "mmu.h"
+#include "fastmem.h"
 
 using u32   = uint32_t;
 using uint16 = uint16_t;
@@ -28,7 +34,8 @@ const u32 CSR_SEDELEG = 0x102;     // Exception delegation register
 const u32 CSR_SIDELEG = 0x103;     // Interrupt delegation register
 const u32 CSR_SIE = 0x104;         // Supervisor interrupt-enable register
 const u32 CSR_STVEC = 0x105;       // Supervisor trap handler base address
-const u32 _CSR_SSCRATCH = 0x140;   // Supervisor scratch register (reserved)
+const u32 CSR_SCOUNTEREN = 0x106;  // Counters U-mode may read
+const u32 CSR_SSCRATCH = 0x140;    // Supervisor scratch register
 const u32 CSR_SEPC = 0x141;        // Supervisor exception program counter
 const u32 CSR_SCAUSE = 0x142;      // Supervisor trap cause
 const u32 CSR_STVAL = 0x143;       // Supervisor bad address or instruction
@@ -42,19 +49,38 @@ const u32 CSR_MEDELEG = 0x302;     // Machine exception delegation register
 const u32 CSR_MIDELEG = 0x303;     // Machine interrupt delegation register
 const u32 CSR_MIE = 0x304;         // Machine interrupt-enable register
 const u32 CSR_MTVEC = 0x305;       // Machine trap handler base address
-const u32 _CSR_MSCRATCH = 0x340;   // Machine scratch register (reserved)
+const u32 CSR_MCOUNTEREN = 0x306;  // Counters S-mode may read
+const u32 CSR_MCOUNTINHIBIT = 0x320; // Counters that stop counting
+const u32 CSR_MHPMEVENT3 = 0x323;  // Events of mhpmcounter3 to 31
+const u32 CSR_MSCRATCH = 0x340;    // Machine scratch register
 const u32 CSR_MEPC = 0x341;        // Machine exception program counter
 const u32 CSR_MCAUSE = 0x342;      // Machine trap cause
 const u32 CSR_MTVAL = 0x343;       // Machine bad address or instruction
 const u32 CSR_MIP = 0x344;         // Machine interrupt pending
-const u32 _CSR_PMPCFG0 = 0x3a0;    // Physical memory protection config (reserved)
-const u32 _CSR_PMPADDR0 = 0x3b0;   // Physical memory protection address (reserved)
-const u32 _CSR_MCYCLE = 0xb00;     // Cycle counter for machines (reserved)
+const u32 CSR_PMPCFG0 = 0x3a0;     // Physical memory protection config
+const u32 CSR_PMPADDR0 = 0x3b0;    // Physical memory protection address
+const u32 CSR_MCYCLE = 0xb00;      // Machine cycle counter
+const u32 CSR_MINSTRET = 0xb02;    // Machine instructions-retired counter
+const u32 CSR_MHPMCOUNTER3 = 0xb03; // Machine performance counters 3 to 31
+const u32 CSR_MCYCLEH = 0xb80;     // Upper 32 bits of mcycle
+const u32 CSR_MINSTRETH = 0xb82;   // Upper 32 bits of minstret
+const u32 CSR_MHPMCOUNTER3H = 0xb83; // Upper 32 bits of mhpmcounter3 to 31
 const u32 CSR_CYCLE = 0xc00;       // User mode cycle counter
 const u32 CSR_TIME = 0xc01;        // Timer register for user mode
-const u32 _CSR_INSERT = 0xc02;     // Insert reserved CSR (reserved)
+const u32 CSR_INSTRET = 0xc02;     // User mode instructions-retired counter
+const u32 CSR_HPMCOUNTER3 = 0xc03; // User mode views of mhpmcounter3 to 31
+const u32 CSR_CYCLEH = 0xc80;      // Upper 32 bits of cycle
+const u32 CSR_TIMEH = 0xc81;       // Upper 32 bits of time
+const u32 CSR_INSTRETH = 0xc82;    // Upper 32 bits of instret
+const u32 CSR_HPMCOUNTER3H = 0xc83; // Upper 32 bits of hpmcounter3 to 31
+const u32 CSR_MVENDORID = 0xf11;   // Vendor ID
+const u32 CSR_MARCHID = 0xf12;     // Architecture ID
+const u32 CSR_MIMPID = 0xf13;      // Implementation ID
 const u32 CSR_MHARTID = 0xf14;     // Hardware thread ID
 
+// RV32ACIMSU, read only
+const u32 RV32_MISA = 0b01000000000101000001000100000101;
+
 // Trap and interrupt constants with privilege levels for RISC-V architecture.
 #define PRIV_USER 0                // Privilege level for User mode
 #define PRIV_SUPERVISOR 1          // Privilege level for Supervisor mode
@@ -103,6 +129,20 @@ const u32 MIP_SSIP = 0x002;  // Supervisor Software Interrupt Pending
 const u32 MIP_ALL = MIP_MEIP | MIP_MTIP | MIP_MSIP | MIP_SEIP | MIP_STIP | MIP_SSIP;
 
 
+// Physical memory map, see RV32::initMemoryMap()
+const u32 RAM_BASE = 0x80000000;
+const u32 DTB_BASE = 0x00001020; // device tree blob, read only
+const u32 DTB_SIZE = 0x00000fe0;
+const u32 CLINT_BASE = 0x02000000;
+const u32 CLINT_SIZE = 0x00010000;
+const u32 UART_BASE = 0x10000000;
+const u32 UART_SIZE = 0x00000008;
+
+// CLINT register offsets
+const u32 CLINT_MSIP = 0x0000;
+const u32 CLINT_MTIMECMP = 0x4000;
+const u32 CLINT_MTIME = 0xbff8;
+
 // UART
 // Constants defining bit shifts for different UART registers
 const u32 SHIFT_RBR = 0;  // Receiver Buffer Register
@@ -130,6 +170,21 @@ const u32 IIR_NO_INTERRUPT = 0x7;     // Indicates no pending interrupts
 const u32 LSR_DATA_AVAILABLE = 0x1;   // Data available in receiver buffer
 const u32 LSR_THR_EMPTY = 0x20;       // Transmitter holding register is empty
 
+// Clock ticks between two polls of the receiver
+const u32 UART_RX_POLL = 0x38400;
+
+// mtime frequency in real-time mode, the timebase-frequency a device tree
+// for this machine declares
+const u64 RV32_TIMEBASE_HZ = 1000000;
+
+// Clock ticks between two checks of the mtimecmp deadline in real-time
+// mode, where mtime does not follow the clock
+const u32 CLINT_REALTIME_POLL = 0x4000;
+
+// Longest a wfi waits for host input when no timer interrupt can wake the
+// hart, so the UI keeps drawing
+const int WFI_HOST_SLEEP_MS = 10;
+
 
 // Macros to extract 8-bit data from specific bit positions in UART registers.
 //
@@ -156,29 +211,89 @@ const u32 LSR_THR_EMPTY = 0x20;       // Transmitter holding register is empty
 
 
 
-class RV32
+// Harts are cache line aligned so neighbours in an array never share one
+const u32 RV32_ALIGN = 64;
+
+class alignas(RV32_ALIGN) RV32
 {
 public:
-    u32 clock;
+    // Hot state, read or written by nearly every instruction or interrupt
+    // check. It leads the object so it spans the first cache lines only.
+
     // Registers
     u32 xreg[32];
     // Program counter
     u32 pc;
+
+    // An enabled interrupt may be deliverable, see updateIrqPending(). The
+    // execution loops only call handleIrqAndTrap when this or a trap is set.
+    bool irq_pending;
+
+    bool reservation_en;
+    u32 reservation_addr;
+
+    // Retired instructions. The cycle and instret counters are this plus an
+    // offset, computed when they are read; writes only move the offset. The
+    // CLINT's mtime works the same way on top of timeBase().
+    u64 clock;
+    u64 cycle_offset;
+    u64 instret_offset;
     u8 *mem;
-    u8 *dtb;
+    u32 mem_size; // bytes of RAM at mem, a multiple of the page size
+    // Bytes of RAM the inline accessors reach directly: mem_size, or 0 while
+    // loads and stores are translated, which sends them to memRead/memWrite
+    u32 direct_size;
+    // With fastmem, the region the inline accessors use instead, see
+    // fastmem.h; NULL while loads and stores are translated
+    u8 *fast_base;
+    // Sv32 translation is on for fetches / loads and stores, see updateVm();
+    // the contexts are their TLB key bits. vm_data is set whenever vm_fetch
+    // is.
+    bool vm_fetch;
+    bool vm_data;
+    u32 fetch_context;
+    u32 data_context;
+    // The regime blocks are built and run in: 0 while nothing is translated,
+    // else VM_SPACE_DATA, plus VM_SPACE_FETCH and the fetch context while
+    // fetches are translated too
+    u32 vm_space;
+    // Page fault of the last load or store, see takeFault()
+    Trap fault;
+    // Predecoded instructions to invalidate on stores, owned by the Emulator
+    InsCache *icache;
+    // Compared against the clock between blocks
+    EventQueue events;
     csr_state csr;
+
+    // Cold state, only touched by device events and rarely used CSRs
     clint_state clint;
     uart_state uart;
-
-    bool reservation_en;
-    u32 reservation_addr;
+    csr_cold csr_other;
+    u8 *dtb;
+    // Everything the slow memory path reaches: RAM, the DTB and the devices
+    MemoryMap map;
+    Tlb tlb;
+    // Guest physical address 0 in the host if RAM lives in a FastMem region,
+    // set before init(), else NULL
+    u8 *fastmem;
+
+    // mtime follows the clock divided by time_divisor if time_locked, else
+    // host time at RV32_TIMEBASE_HZ divided by it, see timeBase()
+    bool time_locked;
+    u32 time_divisor;
+    u64 host_time_start; // host time at setTimeBase(), RV32_TIMEBASE_HZ ticks
+
+    // stdin reached EOF, the UART receiver stops reading it
+    bool host_input_eof;
 
     bool debug_single_step;
 
     RV32();
     ~RV32();
 
-    bool init(u8 *memory, u8 *dtb, bool debug_mode);
+    bool init(u8 *memory, u32 memory_size, u8 *dtb_image, bool debug_mode);
+    void initMemoryMap();
+    void setTimeBase(bool locked, u32 divisor);
     void dump();
     void tick();
 
@@ -187,6 +302,8 @@ public:
 
     // CSR Functions
     bool hasCsrAccessPrivilege(u32 addr);
+    bool csrExists(u32 address);
+    u32 *csrSlot(u32 address);
     u32 readCsrRaw(u32 address);
     void writeCsrRaw(u32 address, u32 value);
     u32 getCsr(u32 address, ins_ret *ret);
@@ -196,19 +313,175 @@ public:
     // Trap Functions
     bool handleTrap(ins_ret *ret, bool isInterrupt);
     void handleIrqAndTrap(ins_ret *ret);
+    void updateIrqPending();
+    void raiseInterrupt(u32 mip);
 
     // Memory Functions
+    // With fastmem every load and aligned store is one host access into the
+    // region, which faults into the memory map for anything but RAM.
+    // Otherwise naturally aligned accesses to RAM are one host load or store.
+    // Anything else (devices, the DTB, misaligned accesses) goes through
+    // memRead and memWrite, as do all accesses while they are translated. A
+    // load or store that page faults sets `fault`, see takeFault().
     // Getters
-    u32 memGetByte(u32 addr);
-    u32 memGetHalfWord(u32 addr);
-    u32 memGetWord(u32 addr);
+    inline u32 memGetByte(u32 addr)
+    {
+        if (fast_base != NULL)
+            return fastLoad8(fast_base + addr);
+        u32 off = addr - RAM_BASE;
+        if (off < direct_size)
+            return mem[off];
+        return memRead(addr, 1);
+    }
+    inline u32 memGetHalfWord(u32 addr)
+    {
+        if (fast_base != NULL)
+            return fastLoad16(fast_base + addr);
+        u32 off = addr - RAM_BASE;
+        if ((off & 0x1) == 0 && off < direct_size)
+        {
+            u16 val;
+            memcpy(&val, mem + off, 2);
+            return val;
+        }
+        return memRead(addr, 2);
+    }
+    inline u32 memGetWord(u32 addr)
+    {
+        if (fast_base != NULL)
+            return fastLoad32(fast_base + addr);
+        u32 off = addr - RAM_BASE;
+        if ((off & 0x3) == 0 && off < direct_size)
+        {
+            u32 val;
+            memcpy(&val, mem + off, 4);
+            return val;
+        }
+        return memRead(addr, 4);
+    }
     // Setters
-    void memSetByte(u32 addr, u32 val);
-    void memSetHalfWord(u32 addr, u32 val);
-    void memSetWord(u32 addr, u32 val);
-    // UART Functions
+    inline void memSetByte(u32 addr, u32 val)
+    {
+        if (fast_base != NULL)
+        {
+            if (icache != NULL)
+                icache->notifyWrite(addr);
+            fastStore8(fast_base + addr, val);
+            return;
+        }
+        u32 off = addr - RAM_BASE;
+        if (off < direct_size)
+        {
+            if (icache != NULL)
+                icache->notifyWrite(addr);
+            mem[off] = val;
+            return;
+        }
+        memWrite(addr, val, 1);
+    }
+    inline void memSetHalfWord(u32 addr, u32 val)
+    {
+        if (fast_base != NULL && (addr & 0x1) == 0)
+        {
+            if (icache != NULL)
+                icache->notifyAlignedWrite(addr, 2);
+            fastStore16(fast_base + addr, val);
+            return;
+        }
+        u32 off = addr - RAM_BASE;
+        if ((off & 0x1) == 0 && off < direct_size)
+        {
+            if (icache != NULL)
+                icache->notifyAlignedWrite(addr, 2);
+            u16 half = val;
+            memcpy(mem + off, &half, 2);
+            return;
+        }
+        memWrite(addr, val, 2);
+    }
+    inline void memSetWord(u32 addr, u32 val)
+    {
+        if (fast_base != NULL && (addr & 0x3) == 0)
+        {
+            if (icache != NULL)
+                icache->notifyAlignedWrite(addr, 4);
+            fastStore32(fast_base + addr, val);
+            return;
+        }
+        u32 off = addr - RAM_BASE;
+        if ((off & 0x3) == 0 && off < direct_size)
+        {
+            if (icache != NULL)
+                icache->notifyAlignedWrite(addr, 4);
+            memcpy(mem + off, &val, 4);
+            return;
+        }
+        memWrite(addr, val, 4);
+    }
+    // Any load or store of 1, 2 or 4 bytes, zero extended
+    u32 memRead(u32 addr, u32 size);
+    void memWrite(u32 addr, u32 val, u32 size);
+    // The same at a physical address, through the memory map
+    u32 physRead(u32 addr, u32 size);
+    void physWrite(u32 addr, u32 val, u32 size);
+
+    // Sv32
+    void updateVm();
+    TlbEntry *translate(u32 vaddr, MemAccess access);
+    bool walk(u32 vaddr, MemAccess access, TlbEntry *e);
+    void pageFault(u32 vaddr, MemAccess access);
+    u32 vmRead(u32 vaddr, u32 size);
+    void vmWrite(u32 vaddr, u32 val, u32 size);
+    // Physical address of the instruction at `vaddr`, false and `fault` set
+    // if fetching it faults
+    inline bool fetchAddr(u32 vaddr, u32 *paddr)
+    {
+        if (!vm_fetch)
+        {
+            *paddr = vaddr;
+            return true;
+        }
+        TlbEntry *e = translate(vaddr, ACCESS_FETCH);
+        if (e == NULL)
+            return false;
+        *paddr = e->paddr | (vaddr & ~MMU_PAGE_MASK);
+        return true;
+    }
+    // Moves a page fault of the instruction's loads and stores to `ret`.
+    // Instructions check this before writing rd, so a faulting one leaves
+    // the registers alone.
+    inline bool takeFault(ins_ret *ret)
+    {
+        if (!fault.en)
+            return false;
+        ret->trap = fault;
+        fault.en = false;
+        return true;
+    }
+    // Device Functions
+    void runEvents();
+    u64 hostTime();
+    inline u64 timeBase()
+    {
+        return time_locked ? clock / time_divisor : (hostTime() - host_time_start) / time_divisor;
+    }
+    inline u64 mtime()
+    {
+        return timeBase() + clint.mtime_offset;
+    }
+    u32 clintRead(u32 offset, u32 size);
+    void clintWrite(u32 offset, u32 val, u32 size);
+    void clintEvent();
+    u32 uartRead(u32 offset, u32 size);
+    void uartWrite(u32 offset, u32 val, u32 size);
+    u32 uartReadByte(u32 offset);
+    void uartWriteByte(u32 offset, u32 val);
     void uartUpdateIir();
-    void uartTick();
+    void uartInterrupt();
+    void uartTxEvent();
+    void uartRxEvent();
+    bool hostInputWait(int timeout_ms);
+    void waitForInterrupt();
 };
 
 #endif
\ No newline at end of file
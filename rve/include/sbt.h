@@ -0,0 +1,134 @@
+#ifndef SBT_H
+#define SBT_H
+
+#include <cstdint>
+#include <cstring>
+
+#include "icache.h"
+
+using u32 = uint32_t;
+using u64 = uint64_t;
+using u8 = uint8_t;
+using s8 = int8_t;
+using s16 = int16_t;
+using s32 = int32_t;
+using s64 = int64_t;
+
+// Ahead-of-time translation of bare-metal images.
+//
+// rve-sbt loads an ELF image the way the emulator does, finds its code
+// (executable SHT_PROGBITS sections, entered at the ELF entry point and at
+// its symbols, then followed along static successors) and builds every
+// reachable basic block with the same block builder the block interpreter
+// uses. For each one it writes a C++ function that runs the block's leading
+// run of instructions the JIT would translate too; built as a shared object
+// (make aot), that is loaded with -a and used by the block and JIT modes.
+//
+// A translation only stands for the block it was made from: the runtime
+// attaches it when a block with the same start pc, length and instruction
+// words (see sbtHash) is built, so code that was not translated, or that
+// the guest modified, goes through the interpreter as before. Translated
+// code runs without a budget and returns to the dispatcher after every
+// block, which retires it and runs whatever instructions were left.
+//
+// This header is all the generated code includes.
+const u32 SBT_ABI_VERSION = 1;
+#define SBT_IMAGE_SYMBOL "rve_sbt_image"
+
+// The hart as translated code sees it, filled in by the Emulator
+struct SbtContext
+{
+    u32 *xreg;
+    u32 *pc;
+    u8 *ram;                // guest RAM, physical 0x80000000
+    u32 ram_size;
+    void *const *code_pages; // InsCache::pages, stores to pages with code take the slow path
+    void *cpu;
+    u32 (*load)(void *cpu, u32 addr, u32 size);
+    void (*store)(void *cpu, u32 addr, u32 val, u32 size);
+};
+
+typedef void (*sbt_fn)(SbtContext *ctx);
+
+struct SbtBlock
+{
+    u32 pc;
+    u32 len;        // instructions in the block
+    u32 translated; // leading instructions `fn` runs, it leaves pc at the next one
+    u32 hash;       // sbtHash of the block's instructions
+    sbt_fn fn;
+};
+
+// Exported by every translation as SBT_IMAGE_SYMBOL, with C linkage
+struct SbtImage
+{
+    u32 abi_version;
+    u32 count;
+    const SbtBlock *blocks; // sorted by pc
+};
+
+// FNV-1a over the instruction words and lengths of a block
+inline u32 sbtHash(u32 hash, u32 ins_word, u32 len)
+{
+    const u32 words[2] = {ins_word, len};
+    const u8 *bytes = (const u8 *)words;
+    for (u32 i = 0; i < sizeof(words); i++)
+    {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+const u32 SBT_HASH_SEED = 2166136261u;
+
+// Memory accesses of translated code, inline for RAM as in the JIT
+inline u32 sbtLoad(SbtContext *c, u32 addr, u32 size)
+{
+    u32 off = addr - 0x80000000;
+    if (off > c->ram_size - size)
+        return c->load(c->cpu, addr, size);
+    u32 val = 0;
+    memcpy(&val, c->ram + off, size);
+    return val;
+}
+
+inline void sbtStore(SbtContext *c, u32 addr, u32 val, u32 size)
+{
+    u32 off = addr - 0x80000000;
+    if (off > c->ram_size - size || (off & (size - 1)) != 0 || c->code_pages[off >> ICACHE_PAGE_SHIFT] != NULL)
+    {
+        c->store(c->cpu, addr, val, size);
+        return;
+    }
+    memcpy(c->ram + off, &val, size);
+}
+
+inline u32 sbtDiv(u32 a, u32 b)
+{
+    if (b == 0)
+        return 0xFFFFFFFF;
+    if (a == 0x80000000 && b == 0xFFFFFFFF)
+        return a;
+    return (u32)((s32)a / (s32)b);
+}
+
+inline u32 sbtRem(u32 a, u32 b)
+{
+    if (b == 0)
+        return a;
+    if (a == 0x80000000 && b == 0xFFFFFFFF)
+        return 0;
+    return (u32)((s32)a % (s32)b);
+}
+
+inline u32 sbtDivu(u32 a, u32 b)
+{
+    return b == 0 ? 0xFFFFFFFF : a / b;
+}
+
+inline u32 sbtRemu(u32 a, u32 b)
+{
+    return b == 0 ? a : a % b;
+}
+
+#endif
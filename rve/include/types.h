@@ -6,6 +6,7 @@
 #include <string.h>
 
 // Integer Data types
+using u64 = uint64_t;
 using u32 = uint32_t;
 using u16 = uint16_t;
 using u8  = uint8_t;
@@ -33,28 +34,56 @@ typedef struct {
     u32 value;     // Holds additional information related to the trap.
 } Trap;
 
-// Structure representing the result of an instruction execution.
+// Structure carrying a trap out of an instruction. Results are committed by
+// the instruction itself; this is only looked at when trap.en is set.
 typedef struct {
-    u32 write_reg; // Register identifier where the result is written.
-    u32 write_val; // Value to write into the specified register.
     u32 pc_val;    // Program counter value after instruction execution.
-    u32 csr_write; // CSR (Control and Status Register) index to write into.
-    u32 csr_val;   // Value to write into the specified CSR.
     Trap trap;      // Contains any trap that occurred during execution.
 } ins_ret;
 
 // Structure representing the state of Control and Status Registers (CSRs).
+// Only the registers used by traps and interrupt checks have a field; the
+// counters are derived from the clock and the other CSRs live in csr_cold.
 typedef struct {
-    u32 data[4096]; // Array holding all CSR values indexed by their IDs.
     u32 privilege;  // Current privilege level of the processor.
+    u32 mstatus;    // sstatus is a view of it
+    u32 mie;        // sie is a view of it
+    u32 mip;        // sip is a view of it
+    u32 mideleg;
+    u32 satp;
+    u32 medeleg;
+    u32 mtvec;
+    u32 mepc;
+    u32 mcause;
+    u32 mtval;
+    u32 sedeleg;
+    u32 sideleg;
+    u32 stvec;
+    u32 sepc;
+    u32 scause;
+    u32 stval;
 } csr_state;
 
+// Number of pmpcfg and pmpaddr registers.
+const u32 PMP_CFG_REGS = 4;
+const u32 PMP_ADDR_REGS = 16;
+
+// The other CSRs with state, which only the guest reads. CSRs that are not
+// implemented raise an illegal instruction exception, see RV32::csrExists().
+typedef struct {
+    u32 mscratch;
+    u32 sscratch;
+    u32 mcounteren;
+    u32 scounteren;
+    u32 mcountinhibit;
+    u32 pmpcfg[PMP_CFG_REGS];
+    u32 pmpaddr[PMP_ADDR_REGS];
+} csr_cold;
+
 // Structure defining the current state of a UART device's registers and flags.
 typedef struct {
     u32 rbr_thr_ier_iir;   // Combined register for receive buffer, THR, IER, and IIR.
     u32 lcr_mcr_lsr_scr;   // Combined register for LCR, MCR, LSR, and SCR.
-    bool thre_ip;           // Flag indicating whether the Transmit Holding Register is empty.
-    bool interrupting;      // Indicates if an interrupt is currently being triggered.
 } uart_state;
 
 // Structure representing the CLINT (Core Local Interrupter) state.
@@ -62,8 +91,7 @@ typedef struct {
     bool msip;          // Machine software interrupt pending flag.
     u32 mtimecmp_lo;   // Lower 32 bits of machine timer compare value.
     u32 mtimecmp_hi;   // Upper 32 bits of machine timer compare value.
-    u32 mtime_lo;      // Lower 32 bits of machine timer current count.
-    u32 mtime_hi;      // Upper 32 bits of machine timer current count.
+    u64 mtime_offset;  // mtime minus RV32::timeBase().
 } clint_state;
 
 const char rv_regs[32][5] = {
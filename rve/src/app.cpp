@@ -14,7 +14,7 @@ static void HelpMarker(const char *desc)
 
 static void showHelp()
 {
-    printf("./rve [parameters]\n\t-e [elf binary]\n\t-m [ram amount]\n\t-f [running image]\n\t-k [kernel command line]\n\t-b [dtb file, or 'disable']\n\t-c instruction count\n\t-s single step with full processor state\n\t-t time division base\n\t-l lock time base to instruction count\n\t-p disable sleep when wfi\n\t-d fail out immediately on all faults\n");
+    printf("./rve [parameters]\n\t-e [elf binary]\n\t-a [translation from rve-sbt]\n\t-m [ram amount, e.g. 512m, up to 2g]\n\t-g back RAM with huge pages\n\t-f [running image]\n\t-k [kernel command line]\n\t-b [dtb file, or 'disable']\n\t-c instruction count\n\t-s single step with full processor state\n\t-t time division base\n\t-l lock time base to instruction count\n\t-p disable sleep when wfi\n\t-d fail out immediately on all faults\n");
 }
 
 App::App(/* args */)
@@ -131,9 +131,8 @@ int App::initializeUI()
 int App::initializeEmu(int argc, char *argv[])
 {
 
-    // Start emulator
+    // Start emulator, initialized once the RAM size is known
     emu = Emulator();
-    emu.initialize();
 
     int i;
     int show_help = 0;
@@ -154,6 +153,10 @@ int App::initializeEmu(int argc, char *argv[])
             {
                 switch (param[1])
                 {
+                case 'a':
+                    if (++i >= argc || !emu.loadTranslation(argv[i]))
+                        show_help = 1;
+                    break;
                 case 'b':
                     bin_file_name = (++i < argc) ? argv[i] : 0;
                     break;
@@ -165,12 +168,33 @@ int App::initializeEmu(int argc, char *argv[])
                     break;
                 case 's':
                     param_continue = 1;
-                    emu.debugMode = true;
+                    emu.debugMode = DEBUG_STEP;
                     break;
                 case 'r':
                     param_continue = 1;
                     emu.running = true;
                     break;
+                case 'g':
+                    param_continue = 1;
+                    emu.huge_pages = true;
+                    break;
+                case 'l':
+                    param_continue = 1;
+                    emu.time_locked = true;
+                    break;
+                case 'm':
+                    if (++i >= argc || !parseMemSize(argv[i], &emu.MEM_SIZE))
+                        show_help = 1;
+                    break;
+                case 'p':
+                    param_continue = 1;
+                    emu.wfi_sleep = false;
+                    break;
+                case 't':
+                    emu.time_divisor = (++i < argc) ? strtoul(argv[i], NULL, 0) : 0;
+                    if (emu.time_divisor == 0)
+                        show_help = 1;
+                    break;
                 default:
                     if (param_continue)
                         param_continue = 0;
@@ -201,6 +225,10 @@ int App::initializeEmu(int argc, char *argv[])
         printf("INFO: ELF File: %s\n", elf_file_name);
         emu.initializeElf(elf_file_name);
     }
+    else
+    {
+        emu.initialize();
+    }
     if (bin_file_name)
     {
         printf("INFO: Binary File: %s\n", bin_file_name);
@@ -420,7 +448,28 @@ void App::createCpuState()
         if (ImGui::BeginMenu("Settings"))
         {
             // Menu Items
-            ImGui::MenuItem("Debug-Mode", NULL, &emu.debugMode);
+            if (ImGui::BeginMenu("Debug-Mode"))
+            {
+                for (int i = 0; i < DEBUG_MODE_COUNT; i++)
+                {
+                    if (ImGui::MenuItem(debug_mode_names[i], NULL, emu.debugMode == i))
+                    {
+                        emu.debugMode = (DebugMode)i;
+                    }
+                }
+                ImGui::EndMenu();
+            }
+            if (ImGui::BeginMenu("Exec-Mode"))
+            {
+                for (int i = 0; i < EXEC_MODE_COUNT; i++)
+                {
+                    if (ImGui::MenuItem(exec_mode_names[i], NULL, emu.exec_mode == i))
+                    {
+                        emu.exec_mode = (ExecMode)i;
+                    }
+                }
+                ImGui::EndMenu();
+            }
 
             ImGui::EndMenu();
         }
@@ -484,6 +533,10 @@ void App::createCpuState()
     ImGui::SameLine();
     if (ImGui::Button("Step"))
     {
+        if (emu.ready_to_run && !emu.running)
+        {
+            runEmu(1);
+        }
     }
     ImGui::SameLine();
     if (ImGui::Button("Reset"))
@@ -513,9 +566,9 @@ void App::createCpuState()
             ImGui::TableNextColumn();
             ImGui::Text("PC: 0x%04X", emu.cpu.pc);
             ImGui::TableNextColumn();
-            ImGui::Text("Clock: 0x%04X", emu.cpu.clock);
+            ImGui::Text("Clock: 0x%04llX", (unsigned long long)emu.cpu.clock);
             ImGui::TableNextColumn();
-            ImGui::Text("DebugMode: %s", emu.debugMode ? "Enabled" : "Disabled");
+            ImGui::Text("DebugMode: %s", debug_mode_names[emu.debugMode]);
             ImGui::TableNextColumn();
             ImGui::Text("Rsrv en: 0x%04X", emu.cpu.reservation_en);
             ImGui::TableNextColumn();
@@ -553,8 +606,11 @@ void App::createDisasm()
             std::memcpy(buf[i], buf[i + 1], sizeof(buf[i]));
         }
 
-        // Append the new data at the end
-        disasm_inst(buf[buffer_size - 1], sizeof(buf[buffer_size - 1]), rv32, emu.cpu.pc, emu.cpu.memGetWord(emu.cpu.pc));
+        // Append the new data at the end; a page fault here is not the guest's
+        u32 paddr;
+        u32 ins_word = emu.cpu.fetchAddr(emu.cpu.pc, &paddr) ? emu.cpu.physRead(paddr, 4) : 0;
+        emu.cpu.fault.en = false;
+        disasm_inst(buf[buffer_size - 1], sizeof(buf[buffer_size - 1]), rv32, emu.cpu.pc, ins_word);
         prev_pc = emu.cpu.pc;
         pc[buffer_size - 1] = prev_pc;
     }
@@ -579,18 +635,38 @@ void App::stepEmu()
 
         if (emu.clk_freq_sel != -1)
         {
-            if (emu.time_sum >= emu.sec_per_cycle)
+            // instructions due since the last frame
+            emu.sec_per_cycle = 1.0 / std::max(1, emu.clk_freq_sel);
+            u32 count = emu.time_sum / emu.sec_per_cycle;
+            if (count != 0)
             {
-                emu.time_sum = 0; // reset timer
-
-                emu.emulate();
-
-                emu.sec_per_cycle = 1.0 / std::max(1, emu.clk_freq_sel);
+                emu.time_sum -= count * emu.sec_per_cycle;
+                runEmu(count);
             }
         }
         else
         {
-            emu.emulate();
+            emu.time_sum = 0;
+            runEmu(UI_FRAME_BATCH);
         }
     }
+}
+
+void App::runEmu(u64 count)
+{
+    StopReason reason = emu.run(count, stop_conditions);
+    switch (reason)
+    {
+    case STOP_BUDGET:
+        break;
+    case STOP_EXIT:
+        printf("ecall EXIT = %d (0x%x)\n", emu.exit_code, emu.exit_code);
+        emu.running = false;
+        emu.ready_to_run = false;
+        break;
+    default:
+        printf("INFO: Stopped (%s) at pc %08x\n", stop_reason_names[reason], emu.cpu.pc);
+        emu.running = false;
+        break;
+    }
 }
\ No newline at end of file
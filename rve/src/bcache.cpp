@@ -0,0 +1,138 @@
+#include "bcache.h"
+#include "emu.h"
+
+BlockCache::BlockCache()
+{
+    table = NULL;
+    page_blocks = NULL;
+    num_pages = 0;
+    arena = NULL;
+    arena_used = 0;
+    generation = 0;
+    built = 0;
+    chained = 0;
+    flushes = 0;
+    spin_skipped = 0;
+    ras_hits = 0;
+    ras_misses = 0;
+    indirect_hits = 0;
+    indirect_misses = 0;
+    memset(fused, 0, sizeof(fused));
+    memset(ras, 0, sizeof(ras));
+    ras_top = 0;
+}
+
+BlockCache::~BlockCache()
+{
+    release();
+}
+
+BlockCache::BlockCache(const BlockCache &other) : BlockCache()
+{
+}
+
+BlockCache &BlockCache::operator=(const BlockCache &other)
+{
+    if (this != &other)
+    {
+        release();
+    }
+    return *this;
+}
+
+void BlockCache::release()
+{
+    free(table);
+    free(page_blocks);
+    free(arena);
+    table = NULL;
+    page_blocks = NULL;
+    arena = NULL;
+    num_pages = 0;
+    arena_used = 0;
+}
+
+void BlockCache::init(u32 mem_size)
+{
+    release();
+    num_pages = mem_size >> ICACHE_PAGE_SHIFT;
+    table = (BasicBlock **)calloc(1 << BCACHE_TABLE_BITS, sizeof(BasicBlock *));
+    page_blocks = (BasicBlock **)calloc(num_pages, sizeof(BasicBlock *));
+    arena = (u8 *)malloc(BCACHE_ARENA_SIZE);
+    built = chained = flushes = spin_skipped = 0;
+    ras_hits = ras_misses = 0;
+    indirect_hits = indirect_misses = 0;
+    memset(fused, 0, sizeof(fused));
+    memset(ras, 0, sizeof(ras));
+    ras_top = 0;
+    generation++;
+}
+
+void BlockCache::flush()
+{
+    if (table == NULL)
+        return;
+    memset(table, 0, (1 << BCACHE_TABLE_BITS) * sizeof(BasicBlock *));
+    memset(page_blocks, 0, num_pages * sizeof(BasicBlock *));
+    memset(ras, 0, sizeof(ras)); // the blocks it points to are gone
+    arena_used = 0;
+    generation++;
+    flushes++;
+}
+
+void BlockCache::invalidatePage(u32 page)
+{
+    if (page >= num_pages)
+        return;
+    for (BasicBlock *b = page_blocks[page]; b != NULL; b = b->page_next)
+    {
+        b->valid = false;
+        BasicBlock **slot = &table[(b->start_pc >> 1) & ((1 << BCACHE_TABLE_BITS) - 1)];
+        if (*slot == b)
+            *slot = NULL;
+    }
+    page_blocks[page] = NULL;
+}
+
+BasicBlock *BlockCache::alloc()
+{
+    const u32 max_size = sizeof(BasicBlock) + BLOCK_MAX_OPS * sizeof(DecodedIns);
+    if (arena_used + max_size > BCACHE_ARENA_SIZE)
+        flush();
+
+    BasicBlock *b = (BasicBlock *)(arena + arena_used);
+    b->start_pc = 0;
+    b->phys = 0;
+    b->space = 0;
+    b->len = 0;
+    b->taken_pc = NO_SUCCESSOR;
+    b->fall_pc = NO_SUCCESSOR;
+    b->return_pc = NO_SUCCESSOR;
+    b->taken = NULL;
+    b->fall = NULL;
+    b->returned = NULL;
+    b->indirect = NULL;
+    b->ends_jalr = false;
+    b->ends_return = false;
+    b->page_next = NULL;
+    b->valid = true;
+    b->execs = 0;
+    b->native_len = 0;
+    b->native = NULL;
+    b->spin_len = 0;
+    b->aot = NULL;
+    b->ops = (DecodedIns *)(b + 1);
+    return b;
+}
+
+void BlockCache::insert(BasicBlock *b)
+{
+    u32 size = sizeof(BasicBlock) + b->len * sizeof(DecodedIns);
+    arena_used += (size + 15) & ~15;
+
+    u32 page = (b->phys & 0x7FFFFFFF) >> ICACHE_PAGE_SHIFT;
+    b->page_next = page_blocks[page];
+    page_blocks[page] = b;
+    table[(b->start_pc >> 1) & ((1 << BCACHE_TABLE_BITS) - 1)] = b;
+    built++;
+}
@@ -0,0 +1,182 @@
+#include "stdio.h"
+#include <strings.h>
+#include "emu.h"
+
+// Headless front end: runs an ELF image without the UI, e.g. for the ISA
+// tests. The exit status is the guest's exit code.
+
+// Instructions per run() call when no limit is given
+const u64 CLI_BATCH = 100000000;
+
+static void showHelp()
+{
+    printf("./rve-cli [parameters]\n\t-e [elf binary]\n\t-a [translation from rve-sbt]\n\t-m [ram amount, e.g. 512m, up to 2g]\n\t-g back RAM with huge pages\n\t-c instruction count\n\t-s single step with full processor state\n\t-v debug mode (off, print, trace, single-step)\n\t-x exec mode (reference, threaded, block, jit)\n\t-t time division base\n\t-l lock time base to instruction count\n\t-p disable sleep when wfi\n\t-d fail out immediately on all faults\n\t-n range check RAM accesses instead of fastmem\n\t-r run (default, accepted for compatibility)\n");
+}
+
+static bool parseExecMode(const char *name, ExecMode *mode)
+{
+    for (int i = 0; i < EXEC_MODE_COUNT; i++)
+    {
+        if (strcasecmp(name, exec_mode_names[i]) == 0)
+        {
+            *mode = (ExecMode)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parseDebugMode(const char *name, DebugMode *mode)
+{
+    for (int i = 0; i < DEBUG_MODE_COUNT; i++)
+    {
+        if (strcasecmp(name, debug_mode_names[i]) == 0)
+        {
+            *mode = (DebugMode)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+int main(int argc, char *argv[])
+{
+    Emulator emu;
+    StopConditions stop;
+
+    int i;
+    int show_help = 0;
+    const char *elf_file_name = 0;
+    const char *sbt_file_name = 0;
+    u64 instruction_count = 0; // 0 = no limit
+    DebugMode debug_mode = DEBUG_OFF;
+    ExecMode exec_mode = emu.exec_mode;
+
+    for (i = 1; i < argc; i++)
+    {
+        const char *param = argv[i];
+        int param_continue = 0;
+
+        do
+        {
+            if (param[0] == '-' || param_continue)
+            {
+                switch (param[1])
+                {
+                case 'a':
+                    sbt_file_name = (++i < argc) ? argv[i] : 0;
+                    break;
+                case 'c':
+                    instruction_count = (++i < argc) ? strtoull(argv[i], NULL, 0) : 0;
+                    break;
+                case 'd':
+                    param_continue = 1;
+                    stop.on_trap = true;
+                    break;
+                case 'e':
+                    elf_file_name = (++i < argc) ? argv[i] : 0;
+                    break;
+                case 'm':
+                    if (++i >= argc || !parseMemSize(argv[i], &emu.MEM_SIZE))
+                        show_help = 1;
+                    break;
+                case 'n':
+                    param_continue = 1;
+                    emu.use_fastmem = false;
+                    break;
+                case 'g':
+                    param_continue = 1;
+                    emu.huge_pages = true;
+                    break;
+                case 'l':
+                    param_continue = 1;
+                    emu.time_locked = true;
+                    break;
+                case 'p':
+                    param_continue = 1;
+                    emu.wfi_sleep = false;
+                    break;
+                case 'r':
+                    param_continue = 1;
+                    break;
+                case 's':
+                    param_continue = 1;
+                    debug_mode = DEBUG_STEP;
+                    break;
+                case 't':
+                    emu.time_divisor = (++i < argc) ? strtoul(argv[i], NULL, 0) : 0;
+                    if (emu.time_divisor == 0)
+                        show_help = 1;
+                    break;
+                case 'v':
+                    if (++i >= argc || !parseDebugMode(argv[i], &debug_mode))
+                        show_help = 1;
+                    break;
+                case 'x':
+                    if (++i >= argc || !parseExecMode(argv[i], &exec_mode))
+                        show_help = 1;
+                    break;
+                default:
+                    if (param_continue)
+                        param_continue = 0;
+                    else
+                        show_help = 1;
+                    break;
+                }
+            }
+            else
+            {
+                show_help = 1;
+                break;
+            }
+            param++;
+        } while (param_continue);
+    }
+
+    if (show_help || elf_file_name == 0)
+    {
+        showHelp();
+        return 1;
+    }
+
+    emu.debugMode = debug_mode;
+    emu.exec_mode = exec_mode;
+    if (sbt_file_name && !emu.loadTranslation(sbt_file_name))
+        return 1;
+    emu.initializeElf(elf_file_name);
+    if (!emu.ready_to_run)
+    {
+        printf("ERRO: Could not load %s\n", elf_file_name);
+        return 1;
+    }
+
+    u64 total = 0;
+    StopReason reason = STOP_BUDGET;
+    while (reason == STOP_BUDGET && (instruction_count == 0 || total < instruction_count))
+    {
+        u64 batch = CLI_BATCH;
+        if (instruction_count != 0 && instruction_count - total < batch)
+            batch = instruction_count - total;
+        reason = emu.run(batch, stop);
+        total += emu.retired;
+    }
+
+    // what an instance costs the host, most of it guest RAM it touched
+    printf("INFO: Host RSS %.1f MiB, %.2f of %.0f MiB guest RAM resident\n", emu.hostRss() / 1048576.0,
+           emu.residentRam() / 1048576.0, emu.MEM_SIZE / 1048576.0);
+
+    switch (reason)
+    {
+    case STOP_EXIT:
+        printf("ecall EXIT = %d (0x%x)\n", emu.exit_code, emu.exit_code);
+        return emu.exit_code;
+    case STOP_BUDGET:
+        printf("INFO: Instruction limit reached after %llu instructions\n", (unsigned long long)total);
+        return 0;
+    default:
+        printf("ERRO: Stopped (%s) at pc %08x after %llu instructions\n", stop_reason_names[reason], emu.cpu.pc,
+               (unsigned long long)total);
+        emu.cpu.dump();
+        return 1;
+    }
+}
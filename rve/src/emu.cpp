@@ -1,4 +1,9 @@
 #include "emu.h"
+#include "instructions.h"
+#include <algorithm>
+#include <dlfcn.h>
+#include <type_traits>
+#include <unistd.h>
 
 
 ////////////////////////////////////////////////////////////////
@@ -97,6 +102,146 @@ FormatEmpty parse_FormatEmpty(u32 word)
     return ret;
 }
 
+////////////////////////////////////////////////////////////////
+// Compressed Instructions
+////////////////////////////////////////////////////////////////
+// Bits [hi:lo] of `x`, shifted down to bit 0
+static inline u32 bits(u32 x, u32 hi, u32 lo)
+{
+    return (x >> lo) & ((1 << (hi - lo + 1)) - 1);
+}
+
+static inline u32 encodeR(u32 opcode, u32 funct3, u32 funct7, u32 rd, u32 rs1, u32 rs2)
+{
+    return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+static inline u32 encodeI(u32 opcode, u32 funct3, u32 rd, u32 rs1, u32 imm)
+{
+    return ((imm & 0xfff) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opcode;
+}
+
+static inline u32 encodeS(u32 funct3, u32 rs1, u32 rs2, u32 imm)
+{
+    return (bits(imm, 11, 5) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (bits(imm, 4, 0) << 7) | 0x23;
+}
+
+static inline u32 encodeB(u32 funct3, u32 rs1, u32 rs2, u32 imm)
+{
+    return (bits(imm, 12, 12) << 31) | (bits(imm, 10, 5) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) |
+           (bits(imm, 4, 1) << 8) | (bits(imm, 11, 11) << 7) | 0x63;
+}
+
+static inline u32 encodeJ(u32 rd, u32 imm)
+{
+    return (bits(imm, 20, 20) << 31) | (bits(imm, 10, 1) << 21) | (bits(imm, 11, 11) << 20) |
+           (bits(imm, 19, 12) << 12) | (rd << 7) | 0x6f;
+}
+
+// Quadrant (bits [1:0]) and funct3 of a compressed instruction
+#define CQ(quadrant, funct3) (((quadrant) << 3) | (funct3))
+
+u32 expandCompressed(u32 half)
+{
+    u32 rd = bits(half, 11, 7); // also rs1
+    u32 rs2 = bits(half, 6, 2);
+    u32 rs1p = 8 + bits(half, 9, 7); // 3-bit register fields are x8-x15
+    u32 rs2p = 8 + bits(half, 4, 2);
+    u32 imm6 = signExtend((bits(half, 12, 12) << 5) | bits(half, 6, 2), 6);
+    u32 imm;
+
+    switch (CQ(half & 0x3, bits(half, 15, 13)))
+    {
+    case CQ(0, 0): // c.addi4spn
+        imm = (bits(half, 12, 11) << 4) | (bits(half, 10, 7) << 6) | (bits(half, 6, 6) << 2) | (bits(half, 5, 5) << 3);
+        if (imm == 0)
+            return 0; // also the all zero instruction
+        return encodeI(0x13, 0, rs2p, 2, imm);
+    case CQ(0, 2): // c.lw
+        imm = (bits(half, 12, 10) << 3) | (bits(half, 6, 6) << 2) | (bits(half, 5, 5) << 6);
+        return encodeI(0x03, 2, rs2p, rs1p, imm);
+    case CQ(0, 6): // c.sw
+        imm = (bits(half, 12, 10) << 3) | (bits(half, 6, 6) << 2) | (bits(half, 5, 5) << 6);
+        return encodeS(2, rs1p, rs2p, imm);
+
+    case CQ(1, 0): // c.addi, c.nop
+        return encodeI(0x13, 0, rd, rd, imm6);
+    case CQ(1, 1): // c.jal
+    case CQ(1, 5): // c.j
+        imm = (bits(half, 12, 12) << 11) | (bits(half, 11, 11) << 4) | (bits(half, 10, 9) << 8) |
+              (bits(half, 8, 8) << 10) | (bits(half, 7, 7) << 6) | (bits(half, 6, 6) << 7) |
+              (bits(half, 5, 3) << 1) | (bits(half, 2, 2) << 5);
+        return encodeJ(bits(half, 15, 13) == 1 ? 1 : 0, signExtend(imm, 12));
+    case CQ(1, 2): // c.li
+        return encodeI(0x13, 0, rd, 0, imm6);
+    case CQ(1, 3):
+        if (rd == 2)
+        {
+            // c.addi16sp
+            imm = (bits(half, 12, 12) << 9) | (bits(half, 6, 6) << 4) | (bits(half, 5, 5) << 6) |
+                  (bits(half, 4, 3) << 7) | (bits(half, 2, 2) << 5);
+            if (imm == 0)
+                return 0;
+            return encodeI(0x13, 0, 2, 2, signExtend(imm, 10));
+        }
+        // c.lui
+        if (imm6 == 0)
+            return 0;
+        return (imm6 << 12) | (rd << 7) | 0x37;
+    case CQ(1, 4):
+        switch (bits(half, 11, 10))
+        {
+        case 0: // c.srli, shamt[5] is reserved on RV32
+            return bits(half, 12, 12) ? 0 : encodeI(0x13, 5, rs1p, rs1p, rs2);
+        case 1: // c.srai
+            return bits(half, 12, 12) ? 0 : encodeI(0x13, 5, rs1p, rs1p, 0x400 | rs2);
+        case 2: // c.andi
+            return encodeI(0x13, 7, rs1p, rs1p, imm6);
+        default:
+        {
+            // c.sub, c.xor, c.or, c.and; the others are RV64 only
+            static const u32 funct3[4] = {0, 4, 6, 7};
+            u32 op = bits(half, 6, 5);
+            if (bits(half, 12, 12))
+                return 0;
+            return encodeR(0x33, funct3[op], op == 0 ? 0x20 : 0, rs1p, rs1p, rs2p);
+        }
+        }
+    case CQ(1, 6): // c.beqz
+    case CQ(1, 7): // c.bnez
+        imm = (bits(half, 12, 12) << 8) | (bits(half, 11, 10) << 3) | (bits(half, 6, 5) << 6) |
+              (bits(half, 4, 3) << 1) | (bits(half, 2, 2) << 5);
+        return encodeB(bits(half, 13, 13), rs1p, 0, signExtend(imm, 9));
+
+    case CQ(2, 0): // c.slli
+        return bits(half, 12, 12) ? 0 : encodeI(0x13, 1, rd, rd, rs2);
+    case CQ(2, 2): // c.lwsp
+        if (rd == 0)
+            return 0;
+        imm = (bits(half, 12, 12) << 5) | (bits(half, 6, 4) << 2) | (bits(half, 3, 2) << 6);
+        return encodeI(0x03, 2, rd, 2, imm);
+    case CQ(2, 4):
+        if (bits(half, 12, 12) == 0)
+        {
+            if (rs2 != 0)
+                return encodeR(0x33, 0, 0, rd, 0, rs2); // c.mv
+            return rd == 0 ? 0 : encodeI(0x67, 0, 0, rd, 0); // c.jr
+        }
+        if (rs2 != 0)
+            return encodeR(0x33, 0, 0, rd, rd, rs2); // c.add
+        return rd == 0 ? 0x00100073 : encodeI(0x67, 0, 1, rd, 0); // c.ebreak, c.jalr
+    case CQ(2, 6): // c.swsp
+        imm = (bits(half, 12, 9) << 2) | (bits(half, 8, 7) << 6);
+        return encodeS(2, 2, rs2, imm);
+
+    default:
+        // floating point loads and stores, reserved encodings
+        return 0;
+    }
+}
+
+#undef CQ
+
 ////////////////////////////////////////////////////////////////
 // Instruction Implement
 ////////////////////////////////////////////////////////////////
@@ -107,519 +252,227 @@ FormatEmpty parse_FormatEmpty(u32 word)
 const u32 ZERO = 0;
 const u32 ONE = 1;
 
-#define imp(name, fmt_t, code) \
-    void Emulator::emu_##name(u32 ins_word, ins_ret *ret, fmt_t ins) { code }
+// Operands of a predecoded instruction. CSR values can change between
+// executions, so they are read when the instruction runs.
+template <typename fmt_t>
+static inline fmt_t operands(RV32 &cpu, fmt_t ins, ins_ret *ret)
+{
+    return ins;
+}
 
-#define run(name, data, insf)                     \
-    case data:                                    \
-    {                                             \
-        if (debugMode)                            \
-            ins_p(name)                           \
-                emu_##name(ins_word, &ret, insf); \
-        return ret;                               \
-    }
+static inline FormatCSR operands(RV32 &cpu, FormatCSR ins, ins_ret *ret)
+{
+    ins.value = cpu.getCsr(ins.csr, ret);
+    return ins;
+}
 
-#define WR_RD(code)                         \
-    {                                       \
-        ret->write_reg = ins.rd;            \
-        ret->write_val = AS_UNSIGNED(code); \
-    }
-#define WR_PC(code)         \
-    {                       \
-        ret->pc_val = code; \
-    }
-#define WR_CSR(code)              \
-    {                             \
-        ret->csr_write = ins.csr; \
-        ret->csr_val = code;      \
-    }
-
-imp(add, FormatR, { // rv32i
-    WR_RD(AS_SIGNED(cpu.xreg[ins.rs1]) + AS_SIGNED(cpu.xreg[ins.rs2]));
-}) imp(addi, FormatI, { // rv32i
-    WR_RD(AS_SIGNED(cpu.xreg[ins.rs1]) + AS_SIGNED(ins.imm));
-}) imp(amoswap_w, FormatR, { // rv32a
-    u32 tmp = cpu.memGetWord(cpu.xreg[ins.rs1]);
-    cpu.memSetWord(cpu.xreg[ins.rs1], cpu.xreg[ins.rs2]);
-    WR_RD(tmp)
-}) imp(amoadd_w, FormatR, { // rv32a
-    u32 tmp = cpu.memGetWord(cpu.xreg[ins.rs1]);
-    cpu.memSetWord(cpu.xreg[ins.rs1], cpu.xreg[ins.rs2] + tmp);
-    WR_RD(tmp)
-}) imp(amoxor_w, FormatR, { // rv32a
-    u32 tmp = cpu.memGetWord(cpu.xreg[ins.rs1]);
-    cpu.memSetWord(cpu.xreg[ins.rs1], cpu.xreg[ins.rs2] ^ tmp);
-    WR_RD(tmp)
-}) imp(amoand_w, FormatR, { // rv32a
-    u32 tmp = cpu.memGetWord(cpu.xreg[ins.rs1]);
-    cpu.memSetWord(cpu.xreg[ins.rs1], cpu.xreg[ins.rs2] & tmp);
-    WR_RD(tmp)
-}) imp(amoor_w, FormatR, { // rv32a
-    u32 tmp = cpu.memGetWord(cpu.xreg[ins.rs1]);
-    cpu.memSetWord(cpu.xreg[ins.rs1], cpu.xreg[ins.rs2] | tmp);
-    WR_RD(tmp)
-}) imp(amomin_w, FormatR, { // rv32a
-    u32 tmp = cpu.memGetWord(cpu.xreg[ins.rs1]);
-    u32 sec = cpu.xreg[ins.rs2];
-    cpu.memSetWord(cpu.xreg[ins.rs1], AS_SIGNED(sec) < AS_SIGNED(tmp) ? sec : tmp);
-    WR_RD(tmp)
-}) imp(amomax_w, FormatR, { // rv32a
-    u32 tmp = cpu.memGetWord(cpu.xreg[ins.rs1]);
-    u32 sec = cpu.xreg[ins.rs2];
-    cpu.memSetWord(cpu.xreg[ins.rs1], AS_SIGNED(sec) > AS_SIGNED(tmp) ? sec : tmp);
-    WR_RD(tmp)
-}) imp(amominu_w, FormatR, { // rv32a
-    u32 tmp = cpu.memGetWord(cpu.xreg[ins.rs1]);
-    u32 sec = cpu.xreg[ins.rs2];
-    cpu.memSetWord(cpu.xreg[ins.rs1], sec < tmp ? sec : tmp);
-    WR_RD(tmp)
-}) imp(amomaxu_w, FormatR, { // rv32a
-    u32 tmp = cpu.memGetWord(cpu.xreg[ins.rs1]);
-    u32 sec = cpu.xreg[ins.rs2];
-    cpu.memSetWord(cpu.xreg[ins.rs1], sec > tmp ? sec : tmp);
-    WR_RD(tmp)
-}) imp(and, FormatR, {                                                                                                                                                                           // rv32i
-                      WR_RD(cpu.xreg[ins.rs1] & cpu.xreg[ins.rs2])}) imp(andi, FormatI, {                                                                                                        // rv32i
-                                                                                         WR_RD(cpu.xreg[ins.rs1] & ins.imm)}) imp(auipc, FormatU, {                                              // rv32i
-                                                                                                                                                   WR_RD(cpu.pc + ins.imm)}) imp(beq, FormatB, { // rv32i
-    if (cpu.xreg[ins.rs1] == cpu.xreg[ins.rs2])
-    {
-        WR_PC(cpu.pc + ins.imm);
-    }
-}) imp(bge, FormatB, { // rv32i
-    if (AS_SIGNED(cpu.xreg[ins.rs1]) >= AS_SIGNED(cpu.xreg[ins.rs2]))
-    {
-        WR_PC(cpu.pc + ins.imm);
-    }
-}) imp(bgeu, FormatB, { // rv32i
-    if (AS_UNSIGNED(cpu.xreg[ins.rs1]) >= AS_UNSIGNED(cpu.xreg[ins.rs2]))
-    {
-        WR_PC(cpu.pc + ins.imm);
-    }
-}) imp(blt, FormatB, { // rv32i
-    if (AS_SIGNED(cpu.xreg[ins.rs1]) < AS_SIGNED(cpu.xreg[ins.rs2]))
-    {
-        WR_PC(cpu.pc + ins.imm);
-    }
-}) imp(bltu, FormatB, { // rv32i
-    if (AS_UNSIGNED(cpu.xreg[ins.rs1]) < AS_UNSIGNED(cpu.xreg[ins.rs2]))
-    {
-        WR_PC(cpu.pc + ins.imm);
-    }
-}) imp(bne, FormatB, { // rv32i
-    if (cpu.xreg[ins.rs1] != cpu.xreg[ins.rs2])
-    {
-        WR_PC(cpu.pc + ins.imm);
-    }
-}) imp(csrrc, FormatCSR, { // system
-    u32 rs = cpu.xreg[ins.rs];
-    if (rs != 0)
-    {
-        WR_CSR(ins.value & ~rs);
-    }
-    WR_RD(ins.value)
-}) imp(csrrci, FormatCSR, { // system
-    if (ins.rs != 0)
-    {
-        WR_CSR(ins.value & (~ins.rs));
-    }
-    WR_RD(ins.value)
-}) imp(csrrs, FormatCSR, { // system
-    u32 rs = cpu.xreg[ins.rs];
-    if (rs != 0)
-    {
-        WR_CSR(ins.value | rs);
-    }
-    WR_RD(ins.value)
-}) imp(csrrsi, FormatCSR, { // system
-    if (ins.rs != 0)
-    {
-        WR_CSR(ins.value | ins.rs);
-    }
-    WR_RD(ins.value)
-}) imp(csrrw, FormatCSR, { // system
-    WR_CSR(cpu.xreg[ins.rs]);
-    WR_RD(ins.value)
-}) imp(csrrwi, FormatCSR, { // system
-    WR_CSR(ins.rs);
-    WR_RD(ins.value)
-}) imp(div, FormatR, { // rv32m
-    u32 dividend = cpu.xreg[ins.rs1];
-    u32 divisor = cpu.xreg[ins.rs2];
-    u32 result;
-    if (divisor == 0)
-    {
-        result = 0xFFFFFFFF;
-    }
-    else if (dividend == 0x80000000 && divisor == 0xFFFFFFFF)
-    {
-        result = dividend;
-    }
-    else
-    {
-        int32_t tmp = AS_SIGNED(dividend) / AS_SIGNED(divisor);
-        result = AS_UNSIGNED(tmp);
-    }
-    WR_RD(result)
-}) imp(divu, FormatR, { // rv32m
-    u32 dividend = cpu.xreg[ins.rs1];
-    u32 divisor = cpu.xreg[ins.rs2];
-    u32 result;
-    if (divisor == 0)
-    {
-        result = 0xFFFFFFFF;
-    }
-    else
-    {
-        result = dividend / divisor;
-    }
-    WR_RD(result)
-}) imp(ebreak, FormatEmpty, {
-                                // system
-                                // unnecessary?
-                            }) imp(ecall, FormatEmpty, { // system
-    if (cpu.xreg[17] == 93)
-    {
-        // EXIT CALL
-        u32 status = cpu.xreg[10] >> 1;
-        printf("ecall EXIT = %d (0x%x)\n", status, status);
-        exit(status);
-    }
+// Handlers commit their results to the hart as they go, `ret` only carries
+// a trap out. A failed CSR access must not write rd or the CSR; no other
+// format can trap before its result is written.
+#define CSR_TRAPPED(fmt_t) (std::is_same<fmt_t, FormatCSR>::value && ret->trap.en)
 
-    ret->trap.en = true;
-    ret->trap.value = cpu.pc;
-    if (cpu.csr.privilege == PRIV_USER)
-    {
-        ret->trap.type = trap_EnvironmentCallFromUMode;
-    }
-    else if (cpu.csr.privilege == PRIV_SUPERVISOR)
-    {
-        ret->trap.type = trap_EnvironmentCallFromSMode;
-    }
-    else
-    { // PRIV_MACHINE
-        ret->trap.type = trap_EnvironmentCallFromMMode;
-    }
-}) imp(fence, FormatEmpty, {
-                               // rv32i
-                               // skip
-                           }) imp(fence_i, FormatEmpty, {
-                                                            // rv32i
-                                                            // skip
-                                                        }) imp(jal, FormatJ, { // rv32i
-    WR_RD(cpu.pc + 4);
-    WR_PC(cpu.pc + ins.imm);
-}) imp(jalr, FormatI, { // rv32i
-    WR_RD(cpu.pc + 4);
-    WR_PC(cpu.xreg[ins.rs1] + ins.imm);
-}) imp(lb, FormatI, { // rv32i
-    u32 tmp = signExtend(cpu.memGetByte(cpu.xreg[ins.rs1] + ins.imm), 8);
-    WR_RD(tmp)
-}) imp(lbu, FormatI, { // rv32i
-    u32 tmp = cpu.memGetByte(cpu.xreg[ins.rs1] + ins.imm);
-    WR_RD(tmp)
-}) imp(lh, FormatI, { // rv32i
-    u32 tmp = signExtend(cpu.memGetHalfWord(cpu.xreg[ins.rs1] + ins.imm), 16);
-    WR_RD(tmp)
-}) imp(lhu, FormatI, { // rv32i
-    u32 tmp = cpu.memGetHalfWord(cpu.xreg[ins.rs1] + ins.imm);
-    WR_RD(tmp)
-}) imp(lr_w, FormatR, { // rv32a
-    u32 addr = cpu.xreg[ins.rs1];
-    u32 tmp = cpu.memGetWord(addr);
-    cpu.reservation_en = true;
-    cpu.reservation_addr = addr;
-    WR_RD(tmp)
-}) imp(lui, FormatU, {                                    // rv32i
-                      WR_RD(ins.imm)}) imp(lw, FormatI, { // rv32i
-    // would need sign extend for xlen > 32
-    u32 tmp = cpu.memGetWord(cpu.xreg[ins.rs1] + ins.imm);
-    WR_RD(tmp)
-}) imp(mret, FormatEmpty, { // system
-    u32 newpc = cpu.getCsr(CSR_MEPC, ret);
-    if (!ret->trap.en)
-    {
-        u32 status = cpu.readCsrRaw(CSR_MSTATUS);
-        u32 mpie = (status >> 7) & 1;
-        u32 mpp = (status >> 11) & 0x3;
-        u32 mprv = mpp == PRIV_MACHINE ? ((status >> 17) & 1) : 0;
-        u32 new_status = (status & ~0x21888) | (mprv << 17) | (mpie << 3) | (1 << 7);
-        cpu.writeCsrRaw(CSR_MSTATUS, new_status);
-        cpu.csr.privilege = mpp;
-        WR_PC(newpc)
-    }
-}) imp(mul, FormatR, { // rv32m
-    u32 tmp = AS_SIGNED(cpu.xreg[ins.rs1]) * AS_SIGNED(cpu.xreg[ins.rs2]);
-    WR_RD(tmp)
-}) imp(mulh, FormatR, { // rv32m
-    u32 tmp = ((int64_t)AS_SIGNED(cpu.xreg[ins.rs1]) * (int64_t)AS_SIGNED(cpu.xreg[ins.rs2])) >> 32;
-    WR_RD(tmp)
-}) imp(mulhsu, FormatR, { // rv32m
-    u32 tmp = ((int64_t)AS_SIGNED(cpu.xreg[ins.rs1]) * (uint64_t)AS_UNSIGNED(cpu.xreg[ins.rs2])) >> 32;
-    WR_RD(tmp)
-}) imp(mulhu, FormatR, { // rv32m
-    u32 tmp = ((uint64_t)AS_UNSIGNED(cpu.xreg[ins.rs1]) * (uint64_t)AS_UNSIGNED(cpu.xreg[ins.rs2])) >> 32;
-    WR_RD(tmp)
-}) imp(or, FormatR, {                                                                                                                           // rv32i
-                     WR_RD(cpu.xreg[ins.rs1] | cpu.xreg[ins.rs2])}) imp(ori, FormatI, {                                                         // rv32i
-                                                                                       WR_RD(cpu.xreg[ins.rs1] | ins.imm)}) imp(rem, FormatR, { // rv32m
-    u32 dividend = cpu.xreg[ins.rs1];
-    u32 divisor = cpu.xreg[ins.rs2];
-    u32 result;
-    if (divisor == 0)
-    {
-        result = dividend;
-    }
-    else if (dividend == 0x80000000 && divisor == 0xFFFFFFFF)
-    {
-        result = 0;
+#define imp(name, fmt_t, code)                                          \
+    void Emulator::emu_##name(u32 ins_word, ins_ret *ret, fmt_t ins)    \
+    {                                                                   \
+        if (!CSR_TRAPPED(fmt_t))                                        \
+            code                                                        \
+    }                                                                   \
+    void Emulator::op_##name(const DecodedIns *d, ins_ret *ret)         \
+    {                                                                   \
+        emu_##name(d->ins_word, ret, operands(cpu, d->ins_##fmt_t, ret)); \
     }
-    else
-    {
-        int32_t tmp = AS_SIGNED(dividend) % AS_SIGNED(divisor);
-        result = AS_UNSIGNED(tmp);
-    }
-    WR_RD(result)
-}) imp(remu, FormatR, { // rv32m
-    u32 dividend = cpu.xreg[ins.rs1];
-    u32 divisor = cpu.xreg[ins.rs2];
-    u32 result;
-    if (divisor == 0)
-    {
-        result = dividend;
+
+// The interpreter loops below keep the next pc in a local `npc`, which the
+// same macros then write to instead of the member
+#define WR_RD(code)                                     \
+    {                                                   \
+        u32 wr_val = AS_UNSIGNED(code);                 \
+        if (ins.rd != 0 && !CSR_TRAPPED(decltype(ins))) \
+            cpu.xreg[ins.rd] = wr_val;                  \
     }
-    else
-    {
-        result = dividend % divisor;
+#define WR_PC(code) \
+    {               \
+        npc = code; \
     }
-    WR_RD(result)
-}) imp(sb, FormatS, { // rv32i
-    cpu.memSetByte(cpu.xreg[ins.rs1] + ins.imm, cpu.xreg[ins.rs2]);
-}) imp(sc_w, FormatR, { // rv32a
-    // I'm pretty sure this is not it chief, but it does the trick for now
-    u32 addr = cpu.xreg[ins.rs1];
-    if (cpu.reservation_en && cpu.reservation_addr == addr)
-    {
-        cpu.memSetWord(addr, cpu.xreg[ins.rs2]);
-        cpu.reservation_en = false;
-        WR_RD(ZERO)
+#define WR_CSR(code)                        \
+    {                                       \
+        if (ins.csr != 0)                   \
+            cpu.setCsr(ins.csr, code, ret); \
     }
-    else
+
+#include "ins_impl.inc"
+
+////////////////////////////////////////////////////////////////
+// Instruction Dispatch
+////////////////////////////////////////////////////////////////
+typedef struct
+{
+    u32 mask;
+    u32 match;
+} InsEncoding;
+
+#define ins_encoding(name, mask, match, fmt_t) {mask, match},
+static constexpr InsEncoding ins_encodings[] = {
+    RV32_INSTRUCTIONS(ins_encoding)
+    {0, 0} // illegal
+};
+#undef ins_encoding
+
+// The primary table is indexed by opcode[6:2] | funct3 << 5 | funct7 << 8.
+// Those bits identify every instruction except the SYSTEM ones with funct3 == 0
+// (ecall, ebreak, mret, ...), which only differ in bits [31:20] and go through
+// a second table indexed by funct12.
+const u32 DISPATCH_PRIMARY_BITS = 15;
+const u32 DISPATCH_SYSTEM_BITS = 12;
+const u8 DISPATCH_SYSTEM = 0xff;
+
+typedef struct
+{
+    u8 primary[1 << DISPATCH_PRIMARY_BITS];
+    u8 system[1 << DISPATCH_SYSTEM_BITS];
+} DispatchTable;
+
+static constexpr u32 dispatchKey(u32 ins_word)
+{
+    return ((ins_word >> 2) & 0x1f) | (((ins_word >> 12) & 0x7) << 5) | ((ins_word >> 25) << 8);
+}
+
+// Instruction word with the fields of a primary table key filled in
+static constexpr u32 dispatchKeyWord(u32 key)
+{
+    return ((key & 0x1f) << 2) | 0x3 | (((key >> 5) & 0x7) << 12) | ((key >> 8) << 25);
+}
+
+static constexpr DispatchTable buildDispatchTable()
+{
+    DispatchTable t = {};
+    const u32 key_mask = dispatchKeyWord((1 << DISPATCH_PRIMARY_BITS) - 1);
+    const u32 system_mask = 0xfff00000;
+
+    for (u32 i = 0; i < (1 << DISPATCH_PRIMARY_BITS); i++)
+        t.primary[i] = INS_illegal;
+    for (u32 i = 0; i < (1 << DISPATCH_SYSTEM_BITS); i++)
+        t.system[i] = INS_illegal;
+
+    for (u32 op = 0; op < INS_illegal; op++)
     {
-        WR_RD(ONE)
+        InsEncoding enc = ins_encodings[op];
+        // opcode is always fully decoded, so only walk the keys of that opcode
+        for (u32 rest = 0; rest < (1 << (DISPATCH_PRIMARY_BITS - 5)); rest++)
+        {
+            u32 key = ((enc.match >> 2) & 0x1f) | (rest << 5);
+            u32 word = dispatchKeyWord(key);
+            if ((word & enc.mask & key_mask) != (enc.match & key_mask))
+                continue;
+            if (t.primary[key] == INS_illegal)
+                t.primary[key] = op;
+            else
+                t.primary[key] = DISPATCH_SYSTEM;
+        }
+        if ((enc.match & 0x707f) == 0x73)
+        {
+            for (u32 funct12 = 0; funct12 < (1 << DISPATCH_SYSTEM_BITS); funct12++)
+            {
+                if (((funct12 << 20) & enc.mask & system_mask) == (enc.match & system_mask))
+                    t.system[funct12] = op;
+            }
+        }
     }
-}) imp(sfence_vma, FormatEmpty, {
-                                    // system
-                                    // skip
-                                }) imp(sh, FormatS, { // rv32i
-    cpu.memSetHalfWord(cpu.xreg[ins.rs1] + ins.imm, cpu.xreg[ins.rs2]);
-}) imp(sll, FormatR, {                                                                     // rv32i
-                      WR_RD(cpu.xreg[ins.rs1] << cpu.xreg[ins.rs2])}) imp(slli, FormatR, { // rv32i
-    u32 shamt = (ins_word >> 20) & 0x1F;
-    WR_RD(cpu.xreg[ins.rs1] << shamt)
-}) imp(slt, FormatR, { // rv32i
-    if (AS_SIGNED(cpu.xreg[ins.rs1]) < AS_SIGNED(cpu.xreg[ins.rs2]))
+    return t;
+}
+
+static constexpr DispatchTable dispatch_table = buildDispatchTable();
+
+// Only SYSTEM funct3 == 0 encodings may share a primary slot
+static constexpr bool checkDispatchTable()
+{
+    for (u32 key = 0; key < (1 << DISPATCH_PRIMARY_BITS); key++)
     {
-        WR_RD(ONE)
+        if (dispatch_table.primary[key] == DISPATCH_SYSTEM && (dispatchKeyWord(key) & 0x707f) != 0x73)
+            return false;
     }
-    else
-    {
-        WR_RD(ZERO)
+    return true;
+}
+static_assert(checkDispatchTable(), "ambiguous instruction encodings outside of SYSTEM");
+
+// Returns the INS_* index of `ins_word`, at most two table lookups
+static inline u32 dispatch(u32 ins_word)
+{
+    u32 op = dispatch_table.primary[dispatchKey(ins_word)];
+    if (op == DISPATCH_SYSTEM)
+        op = dispatch_table.system[ins_word >> 20];
+    // the remaining bits (rs2 of lr.w, rd/rs1 of ecall, ...) still have to match
+    if ((ins_word & ins_encodings[op].mask) != ins_encodings[op].match)
+        return INS_illegal;
+    return op;
+}
+
+// Only the format of the matched instruction is parsed, and only Zicsr
+// instructions read their CSR (see operands())
+#define run(name, mask, match, fmt_t)                                           \
+    case INS_##name:                                                            \
+    {                                                                           \
+        if (Policy::PRINT_NAMES)                                                \
+            ins_p(name)                                                         \
+        emu_##name(ins_word, ret, operands(cpu, parse_##fmt_t(ins_word), ret)); \
+        return;                                                                 \
     }
-}) imp(slti, FormatI, { // rv32i
-    if (AS_SIGNED(cpu.xreg[ins.rs1]) < AS_SIGNED(ins.imm))
+
+template <typename Policy>
+void Emulator::insSelect(u32 ins_word, ins_ret *ret)
+{
+    switch (dispatch(ins_word))
     {
-        WR_RD(ONE)
+        RV32_INSTRUCTIONS(run)
     }
-    else
-    {
-        WR_RD(ZERO)
+
+    emu_illegal(ins_word, ret, parse_FormatEmpty(ins_word));
+}
+
+#undef run
+
+#define dec(name, mask, match, fmt_t)             \
+    case INS_##name:                              \
+    {                                             \
+        d->handler = &Emulator::op_##name;        \
+        d->op = INS_##name;                       \
+        d->ins_##fmt_t = parse_##fmt_t(ins_word); \
+        return;                                   \
     }
-}) imp(sltiu, FormatI, { // rv32i
-    if (AS_UNSIGNED(cpu.xreg[ins.rs1]) < AS_UNSIGNED(ins.imm))
+
+// Resolves the handler of `ins_word` and parses only the operand format it uses
+void Emulator::decode(u32 ins_word, DecodedIns *d)
+{
+    d->ins_word = ins_word;
+    d->len = 4;
+
+    switch (dispatch(ins_word))
     {
-        WR_RD(ONE)
+        RV32_INSTRUCTIONS(dec)
     }
-    else
+    d->handler = &Emulator::op_illegal;
+    d->op = INS_illegal;
+}
+
+#undef dec
+
+// Fetches the instruction at physical address `pc` and decodes it into slot
+// `d`, expanding it if it is compressed
+void Emulator::fetchDecode(u32 pc, DecodedIns *d)
+{
+    u32 half = cpu.physRead(pc, 2);
+    if ((half & 0x3) != 0x3)
     {
-        WR_RD(ZERO)
+        decode(expandCompressed(half), d);
+        d->len = 2;
+        return;
     }
-}) imp(sltu, FormatR, { // rv32i
-    if (AS_UNSIGNED(cpu.xreg[ins.rs1]) < AS_UNSIGNED(cpu.xreg[ins.rs2]))
+    if ((pc & (ICACHE_PAGE_SIZE - 1)) == ICACHE_PAGE_SIZE - 2)
     {
-        WR_RD(ONE)
+        // crosses into the next page, which needs a slot table, see InsCache
+        icache.lookup(pc + 2);
     }
-    else
-    {
-        WR_RD(ZERO)
-    }
-}) imp(sra, FormatR, { // rv32i
-    u32 msr = cpu.xreg[ins.rs1] & 0x80000000;
-    WR_RD(msr ? ~(~cpu.xreg[ins.rs1] >> cpu.xreg[ins.rs2]) : cpu.xreg[ins.rs1] >> cpu.xreg[ins.rs2])
-}) imp(srai, FormatR, { // rv32i
-    u32 msr = cpu.xreg[ins.rs1] & 0x80000000;
-    u32 shamt = (ins_word >> 20) & 0x1F;
-    WR_RD(msr ? ~(~cpu.xreg[ins.rs1] >> shamt) : cpu.xreg[ins.rs1] >> shamt)
-}) imp(sret, FormatEmpty, { // system
-    u32 newpc = cpu.getCsr(CSR_SEPC, ret);
-    if (!ret->trap.en)
-    {
-        u32 status = cpu.readCsrRaw(CSR_SSTATUS);
-        u32 spie = (status >> 5) & 1;
-        u32 spp = (status >> 8) & 1;
-        u32 mprv = spp == PRIV_MACHINE ? ((status >> 17) & 1) : 0;
-        u32 new_status = (status & ~0x20122) | (mprv << 17) | (spie << 1) | (1 << 5);
-        cpu.writeCsrRaw(CSR_SSTATUS, new_status);
-        cpu.csr.privilege = spp;
-        WR_PC(newpc)
-    }
-}) imp(srl, FormatR, {                                                                     // rv32i
-                      WR_RD(cpu.xreg[ins.rs1] >> cpu.xreg[ins.rs2])}) imp(srli, FormatR, { // rv32i
-    u32 shamt = (ins_word >> 20) & 0x1F;
-    WR_RD(cpu.xreg[ins.rs1] >> shamt)
-}) imp(sub, FormatR, { // rv32i
-    WR_RD(AS_SIGNED(cpu.xreg[ins.rs1]) - AS_SIGNED(cpu.xreg[ins.rs2]));
-}) imp(sw, FormatS, { // rv32i
-    cpu.memSetWord(cpu.xreg[ins.rs1] + ins.imm, cpu.xreg[ins.rs2]);
-}) imp(uret, FormatEmpty, {
-                              // system
-                              // unnecessary?
-                          }) imp(wfi, FormatEmpty, {
-                                                       // system
-                                                       // no-op is valid here, so skip
-                                                   }) imp(xor, FormatR, {                                                                   // rv32i
-                                                                         WR_RD(cpu.xreg[ins.rs1] ^ cpu.xreg[ins.rs2])}) imp(xori, FormatI, {// rv32i
-                                                                                                                                            WR_RD(cpu.xreg[ins.rs1] ^ ins.imm)})
-
-    ins_ret Emulator::insSelect(u32 ins_word)
-{
-    u32 ins_masked;
-    ins_ret ret = cpu.insReturnNoop();
-
-    FormatR ins_FormatR = parse_FormatR(ins_word);
-    FormatI ins_FormatI = parse_FormatI(ins_word);
-    FormatS ins_FormatS = parse_FormatS(ins_word);
-    FormatU ins_FormatU = parse_FormatU(ins_word);
-    FormatJ ins_FormatJ = parse_FormatJ(ins_word);
-    FormatB ins_FormatB = parse_FormatB(ins_word);
-    FormatCSR ins_FormatCSR = parse_FormatCSR(ins_word);
-    FormatEmpty ins_FormatEmpty = parse_FormatEmpty(ins_word);
-
-    if ((ins_word & 0x00000073) == 0x00000073)
-    {
-        // could be CSR instruction
-        ins_FormatCSR.value = cpu.getCsr(ins_FormatCSR.csr, &ret);
-    }
-
-    ins_masked = ins_word & 0x0000007f;
-    switch (ins_masked)
-    {
-        run(auipc, 0x00000017, ins_FormatU)
-        run(jal, 0x0000006f, ins_FormatJ)
-        run(lui, 0x00000037, ins_FormatU)
-    }
-    ins_masked = ins_word & 0x0000707f;
-    switch (ins_masked)
-    {
-        run(addi, 0x00000013, ins_FormatI)
-        run(andi, 0x00007013, ins_FormatI)
-        run(beq, 0x00000063, ins_FormatB)
-        run(bge, 0x00005063, ins_FormatB)
-        run(bgeu, 0x00007063, ins_FormatB)
-        run(blt, 0x00004063, ins_FormatB)
-        run(bltu, 0x00006063, ins_FormatB)
-        run(bne, 0x00001063, ins_FormatB)
-        run(csrrc, 0x00003073, ins_FormatCSR)
-        run(csrrci, 0x00007073, ins_FormatCSR)
-        run(csrrs, 0x00002073, ins_FormatCSR)
-        run(csrrsi, 0x00006073, ins_FormatCSR)
-        run(csrrw, 0x00001073, ins_FormatCSR)
-        run(csrrwi, 0x00005073, ins_FormatCSR)
-        run(fence, 0x0000000f, ins_FormatEmpty)
-        run(fence_i, 0x0000100f, ins_FormatEmpty)
-        run(jalr, 0x00000067, ins_FormatI)
-        run(lb, 0x00000003, ins_FormatI)
-        run(lbu, 0x00004003, ins_FormatI)
-        run(lh, 0x00001003, ins_FormatI)
-        run(lhu, 0x00005003, ins_FormatI)
-        run(lw, 0x00002003, ins_FormatI)
-        run(ori, 0x00006013, ins_FormatI)
-        run(sb, 0x00000023, ins_FormatS)
-        run(sh, 0x00001023, ins_FormatS)
-        run(slti, 0x00002013, ins_FormatI)
-        run(sltiu, 0x00003013, ins_FormatI)
-        run(sw, 0x00002023, ins_FormatS)
-        run(xori, 0x00004013, ins_FormatI)
-    }
-    ins_masked = ins_word & 0xf800707f;
-    switch (ins_masked)
-    {
-        run(amoswap_w, 0x0800202f, ins_FormatR)
-        run(amoadd_w, 0x0000202f, ins_FormatR)
-        run(amoxor_w, 0x2000202f, ins_FormatR)
-        run(amoand_w, 0x6000202f, ins_FormatR)
-        run(amoor_w, 0x4000202f, ins_FormatR)
-        run(amomin_w, 0x8000202f, ins_FormatR)
-        run(amomax_w, 0xa000202f, ins_FormatR)
-        run(amominu_w, 0xc000202f, ins_FormatR)
-        run(amomaxu_w, 0xe000202f, ins_FormatR)
-        run(sc_w, 0x1800202f, ins_FormatR)
-    }
-    ins_masked = ins_word & 0xf9f0707f;
-    switch (ins_masked)
-    {
-        run(lr_w, 0x1000202f, ins_FormatR)
-    }
-    ins_masked = ins_word & 0xfc00707f;
-    switch (ins_masked)
-    {
-        run(slli, 0x00001013, ins_FormatR)
-        run(srai, 0x40005013, ins_FormatR)
-        run(srli, 0x00005013, ins_FormatR)
-    }
-    ins_masked = ins_word & 0xfe00707f;
-    switch (ins_masked)
-    {
-        run(add, 0x00000033, ins_FormatR)
-        run(and, 0x00007033, ins_FormatR)
-        run(div, 0x02004033, ins_FormatR)
-        run(divu, 0x02005033, ins_FormatR)
-        run(mul, 0x02000033, ins_FormatR)
-        run(mulh, 0x02001033, ins_FormatR)
-        run(mulhsu, 0x02002033, ins_FormatR)
-        run(mulhu, 0x02003033, ins_FormatR)
-        run(or, 0x00006033, ins_FormatR)
-        run(rem, 0x02006033, ins_FormatR)
-        run(remu, 0x02007033, ins_FormatR)
-        run(sll, 0x00001033, ins_FormatR)
-        run(slt, 0x00002033, ins_FormatR)
-        run(sltu, 0x00003033, ins_FormatR)
-        run(sra, 0x40005033, ins_FormatR)
-        run(srl, 0x00005033, ins_FormatR)
-        run(sub, 0x40000033, ins_FormatR)
-        run(xor, 0x00004033, ins_FormatR)
-    }
-    ins_masked = ins_word & 0xfe007fff;
-    switch (ins_masked)
-    {
-        run(sfence_vma, 0x12000073, ins_FormatEmpty)
-    }
-    ins_masked = ins_word & 0xffffffff;
-    switch (ins_masked)
-    {
-        run(ebreak, 0x00100073, ins_FormatEmpty)
-        run(ecall, 0x00000073, ins_FormatEmpty)
-        run(mret, 0x30200073, ins_FormatEmpty)
-        run(sret, 0x10200073, ins_FormatEmpty)
-        run(uret, 0x00200073, ins_FormatEmpty)
-        run(wfi, 0x10500073, ins_FormatEmpty)
-    }
-
-    printf("Invalid instruction: %08x\n", ins_word);
-    ret.trap.en = true;
-    ret.trap.type = trap_IllegalInstruction;
-    ret.trap.value = ins_word;
-    return ret;
+    decode(half | (cpu.physRead(pc + 2, 2) << 16), d);
 }
 
 ////////////////////////////////////////////////////////////////
@@ -631,6 +484,7 @@ Emulator::Emulator(/* args */)
 
 Emulator::~Emulator()
 {
+    unmapRam();
 }
 
 u8 Emulator::getFileSize(const char *path)
@@ -648,22 +502,155 @@ u8 Emulator::getMmapPtr(const char *path)
     // return mmapped_data;
 }
 
+// Accesses translated code does not do inline
+static u32 sbtMemLoad(void *cpu, u32 addr, u32 size)
+{
+    RV32 *hart = (RV32 *)cpu;
+    return size == 4 ? hart->memGetWord(addr) : size == 2 ? hart->memGetHalfWord(addr) : hart->memGetByte(addr);
+}
+
+static void sbtMemStore(void *cpu, u32 addr, u32 val, u32 size)
+{
+    RV32 *hart = (RV32 *)cpu;
+    if (size == 4)
+        hart->memSetWord(addr, val);
+    else if (size == 2)
+        hart->memSetHalfWord(addr, val);
+    else
+        hart->memSetByte(addr, val);
+}
+
+bool parseMemSize(const char *text, u32 *size)
+{
+    char *end;
+    unsigned long long amount = strtoull(text, &end, 0);
+    switch (*end)
+    {
+    case 'k':
+    case 'K':
+        amount <<= 10;
+        end++;
+        break;
+    case 'm':
+    case 'M':
+        amount <<= 20;
+        end++;
+        break;
+    case 'g':
+    case 'G':
+        amount <<= 30;
+        end++;
+        break;
+    }
+    if (end == text || *end != '\0' || amount == 0 || amount > MAX_MEM_SIZE || (amount & (ICACHE_PAGE_SIZE - 1)) != 0)
+        return false;
+    *size = (u32)amount;
+    return true;
+}
+
+// Fresh, zeroed guest RAM of MEM_SIZE bytes in place of the last one
+bool Emulator::mapRam()
+{
+    unmapRam();
+    if (use_fastmem)
+        memory = fastmem.mapRam(&cpu, RAM_BASE, MEM_SIZE);
+    else
+        fastmem.release();
+
+    if (memory != NULL)
+    {
+        cpu.fastmem = fastmem.base;
+    }
+    else
+    {
+        void *m = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (m == MAP_FAILED)
+        {
+            printf("ERRO: Could not map %u bytes of guest RAM\n", MEM_SIZE);
+            return false;
+        }
+        memory = (uint8_t *)m;
+        memory_mapped = MEM_SIZE;
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge_pages && madvise(memory, MEM_SIZE, MADV_HUGEPAGE) != 0)
+        printf("WARN: No huge pages for guest RAM\n");
+#endif
+    return true;
+}
+
+void Emulator::unmapRam()
+{
+    if (memory_mapped != 0)
+        munmap(memory, memory_mapped);
+    memory = NULL;
+    memory_mapped = 0;
+}
+
+u64 Emulator::hostRss()
+{
+    unsigned long long size, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL)
+        return 0;
+    if (fscanf(f, "%llu %llu", &size, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+u64 Emulator::residentRam()
+{
+    u64 resident = 0;
+#ifdef __linux__
+    if (memory == NULL)
+        return 0;
+    u64 page_size = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> in_core((MEM_SIZE + page_size - 1) / page_size);
+    if (mincore(memory, MEM_SIZE, in_core.data()) != 0)
+        return 0;
+    for (unsigned char page : in_core)
+    {
+        resident += page & 1;
+    }
+    resident *= page_size;
+#endif
+    return resident;
+}
+
 void Emulator::initialize()
 {
     printf("INFO: Emulator started\n");
     cpu = RV32();
-    memory = (uint8_t *)malloc(MEM_SIZE);
-    cpu.init(memory, NULL, debugMode);
+    if (!mapRam())
+        return;
+    icache.init(MEM_SIZE);
+    blocks.init(MEM_SIZE);
+    icache.bcache = &blocks;
+    cpu.icache = &icache;
+    cpu.init(memory, MEM_SIZE, NULL, debugMode != DEBUG_OFF);
+    cpu.setTimeBase(time_locked, time_divisor);
+    jit.init(&cpu, &icache, MEM_SIZE);
+
+    sbt_ctx.xreg = cpu.xreg;
+    sbt_ctx.pc = &cpu.pc;
+    sbt_ctx.ram = memory;
+    sbt_ctx.ram_size = MEM_SIZE;
+    sbt_ctx.code_pages = (void *const *)icache.pages;
+    sbt_ctx.cpu = &cpu;
+    sbt_ctx.load = sbtMemLoad;
+    sbt_ctx.store = sbtMemStore;
 }
 
 void Emulator::initializeElf(const char *path)
 {
     initialize();
     // Load ELF image
-    if (loadElf(path, strlen(path) + 1, memory, MEM_SIZE) != 0)
+    if (memory == NULL || loadElf(path, strlen(path) + 1, memory, MEM_SIZE) != 0)
         return;
 
-    cpu.init(memory, NULL, debugMode);
+    cpu.init(memory, MEM_SIZE, NULL, debugMode != DEBUG_OFF);
+    cpu.setTimeBase(time_locked, time_divisor);
     elf_file_path = path;
     ready_to_run = true;
 }
@@ -672,14 +659,54 @@ void Emulator::initializeElfDts(const char *elf_file, const char *dts_file)
 {
     initialize();
     // Load ELF image
-    if (loadElf(elf_file, strlen(elf_file) + 1, memory, MEM_SIZE) != 0)
+    if (memory == NULL || loadElf(elf_file, strlen(elf_file) + 1, memory, MEM_SIZE) != 0)
         return;
 
-    // cpu.init(memory, dts, debugMode);
+    // cpu.init(memory, MEM_SIZE, dts, debugMode != DEBUG_OFF);
     elf_file_path = elf_file;
     ready_to_run = true;
 }
 
+bool Emulator::loadTranslation(const char *path)
+{
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL)
+    {
+        printf("ERRO: Could not load translation %s: %s\n", path, dlerror());
+        return false;
+    }
+    const SbtImage *image = (const SbtImage *)dlsym(handle, SBT_IMAGE_SYMBOL);
+    if (image == NULL || image->abi_version != SBT_ABI_VERSION)
+    {
+        printf("ERRO: %s is not a translation for this build of the emulator\n", path);
+        dlclose(handle);
+        return false;
+    }
+    sbt = image;
+    blocks.flush(); // blocks built so far have no translation attached
+    printf("INFO: Loaded %u translated blocks from %s\n", image->count, path);
+    return true;
+}
+
+// The translation made from a block like `b`, NULL if there is none or the
+// code it was made from has changed since
+const SbtBlock *Emulator::findTranslation(BasicBlock *b)
+{
+    if (sbt == NULL)
+        return NULL;
+    const SbtBlock *end = sbt->blocks + sbt->count;
+    const SbtBlock *t = std::lower_bound(sbt->blocks, end, b->start_pc,
+                                         [](const SbtBlock &entry, u32 pc) { return entry.pc < pc; });
+    if (t == end || t->pc != b->start_pc || t->len != b->len)
+        return NULL;
+    u32 hash = SBT_HASH_SEED;
+    for (u32 i = 0; i < b->len; i++)
+    {
+        hash = sbtHash(hash, b->ops[i].ins_word, b->ops[i].len);
+    }
+    return hash == t->hash ? t : NULL;
+}
+
 void Emulator::initializeBin(const char *path)
 {
     initialize();
@@ -694,71 +721,1094 @@ void print_inst(uint64_t pc, uint32_t inst)
     printf("%016" PRIx64 ":  %s\n", pc, buf);
 }
 
-void Emulator::emulate()
+// Runs one instruction; everything debug related is fixed by `Policy`
+template <typename Policy>
+void Emulator::emulateWith()
 {
     cpu.tick();
 
     uint32_t ins_word = 0;
     ins_ret ret;
+    ret.trap.en = false;
+    npc = cpu.pc + 4;
 
-    if ((cpu.pc & 0x3) == 0)
+    u32 paddr;
+    if ((cpu.pc & 0x1) != 0)
     {
-        ins_word = cpu.memGetWord(cpu.pc);
-
-        ret = insSelect(ins_word);
-
-        if (ret.csr_write && !ret.trap.en)
+        ret.trap.en = true;
+        ret.trap.type = trap_InstructionAddressMisaligned;
+        ret.trap.value = cpu.pc;
+    }
+    else if (!cpu.fetchAddr(cpu.pc, &paddr))
+    {
+        cpu.takeFault(&ret);
+    }
+    else
+    {
+        // Printing names takes the reference fetch/decode path so every
+        // instruction is traced by name. So do instructions that may cross
+        // into another virtual page, whose upper half is elsewhere.
+        bool split = cpu.vm_fetch && (cpu.pc & ~MMU_PAGE_MASK) == MMU_PAGE_SIZE - 2;
+        DecodedIns *d = Policy::DECODE_ALWAYS || split ? NULL : icache.lookup(paddr);
+        if (d != NULL)
         {
-            cpu.setCsr(ret.csr_write, ret.csr_val, &ret);
+            if (d->handler == NULL)
+            {
+                fetchDecode(paddr, d);
+            }
+            ins_word = d->ins_word;
+            npc = cpu.pc + d->len;
+            (this->*d->handler)(d, &ret);
         }
-
-        if (!ret.trap.en && ret.write_reg < 32 && ret.write_reg > 0)
+        else
         {
-            cpu.xreg[ret.write_reg] = ret.write_val;
+            ins_word = cpu.physRead(paddr, 2);
+            if ((ins_word & 0x3) != 0x3)
+            {
+                ins_word = expandCompressed(ins_word);
+                npc = cpu.pc + 2;
+                insSelect<Policy>(ins_word, &ret);
+            }
+            else if (cpu.fetchAddr(cpu.pc + 2, &paddr))
+            {
+                ins_word |= cpu.physRead(paddr, 2) << 16;
+                insSelect<Policy>(ins_word, &ret);
+            }
+            else
+            {
+                cpu.takeFault(&ret);
+            }
         }
     }
-    else
-    {
-        ret = cpu.insReturnNoop();
-        ret.trap.en = true;
-        ret.trap.type = trap_InstructionAddressMisaligned;
-        ret.trap.value = cpu.pc;
-    }
 
-    if (debugMode)
+    if (Policy::PRINT_DISASM)
         print_inst(cpu.pc, ins_word);
 
+    if (ret.trap.en && stop_on_trap)
+        stopRun(STOP_TRAP);
+
     // if (ret.trap.en)
     // {
     //     cpu.handleTrap(&ret, false);
     // }
 
-    // handle CLINT IRQs
-    if (cpu.clint.msip)
+    tickDevices();
+
+    ret.pc_val = npc;
+    if (ret.trap.en || cpu.irq_pending)
     {
-        cpu.csr.data[CSR_MIP] |= MIP_MSIP;
+        cpu.handleIrqAndTrap(&ret);
     }
+    cpu.pc = ret.pc_val;
 
-    cpu.clint.mtime_lo++;
-    cpu.clint.mtime_hi += cpu.clint.mtime_lo == 0 ? 1 : 0;
+    if (Policy::DUMP_STATE)
+        cpu.dump();
+}
 
-    if (cpu.clint.mtimecmp_lo != 0 && cpu.clint.mtimecmp_hi != 0 && (cpu.clint.mtime_hi > cpu.clint.mtimecmp_hi || (cpu.clint.mtime_hi == cpu.clint.mtimecmp_hi && cpu.clint.mtime_lo >= cpu.clint.mtimecmp_lo)))
+void Emulator::emulate()
+{
+    switch (debugMode)
     {
-        cpu.csr.data[CSR_MIP] |= MIP_MTIP;
+    case DEBUG_PRINT:
+        emulateWith<PrintPolicy>();
+        break;
+    case DEBUG_TRACE:
+        emulateWith<TracePolicy>();
+        break;
+    case DEBUG_STEP:
+        emulateWith<StepPolicy>();
+        break;
+    default:
+        emulateWith<ThroughputPolicy>();
+        break;
     }
+}
 
-    cpu.uartTick();
-    if (cpu.uart.interrupting)
+// One emulateWith() per instruction, checking breakpoints in between.
+// Returns the number of instructions retired.
+template <typename Policy>
+u64 Emulator::emulateStepped(u64 count, const StopConditions &stop)
+{
+    const u32 *bp_begin = stop.breakpoints.data();
+    const u32 *bp_end = bp_begin + stop.breakpoints.size();
+    u64 i;
+    for (i = 0; i < count && !stop_pending; i++)
     {
-        u32 cur_mip = cpu.readCsrRaw(CSR_MIP);
-        cpu.writeCsrRaw(CSR_MIP, cur_mip | MIP_SEIP);
+        if (i != 0 && std::find(bp_begin, bp_end, cpu.pc) != bp_end)
+        {
+            stopRun(STOP_BREAKPOINT);
+            break;
+        }
+        emulateWith<Policy>();
     }
+    return i;
+}
 
-    cpu.handleIrqAndTrap(&ret);
+// The stop conditions are copied to members the execution loops test on
+// their slow paths (traps, block ends), so only breakpoints need a check per
+// instruction; runs with breakpoints or debug output go through
+// emulateStepped(), instantiated for the selected debug mode.
+StopReason Emulator::run(u64 max_instructions, const StopConditions &stop)
+{
+    stop_pending = false;
+    stop_reason = STOP_BUDGET;
+    stop_on_trap = stop.on_trap;
+    stop_on_wfi = stop.on_wfi;
 
-    // ret.pc_val should be set to pc+4 by default
-    cpu.pc = ret.pc_val;
+    u64 left = max_instructions;
+    switch (debugMode)
+    {
+    case DEBUG_PRINT:
+        left -= emulateStepped<PrintPolicy>(left, stop);
+        break;
+    case DEBUG_TRACE:
+        left -= emulateStepped<TracePolicy>(left, stop);
+        break;
+    case DEBUG_STEP:
+        left -= emulateStepped<StepPolicy>(left, stop);
+        break;
+    default:
+        if (exec_mode == EXEC_REFERENCE || !stop.breakpoints.empty())
+        {
+            left -= emulateStepped<ThroughputPolicy>(left, stop);
+            break;
+        }
+        while (left != 0 && !stop_pending)
+        {
+            u32 batch = left > 0x80000000 ? 0x80000000 : (u32)left;
+            left -= exec_mode == EXEC_THREADED ? emulateThreaded(batch) : emulateBlocks(batch);
+        }
+        break;
+    }
+
+    retired = max_instructions - left;
+    return stop_reason;
+}
+
+// Only these instructions can change the pc, touch CSRs or change privilege
+static bool endsBlock(u32 op)
+{
+    switch (op)
+    {
+    case INS_beq:
+    case INS_bne:
+    case INS_blt:
+    case INS_bge:
+    case INS_bltu:
+    case INS_bgeu:
+    case INS_jal:
+    case INS_jalr:
+    case INS_csrrw:
+    case INS_csrrs:
+    case INS_csrrc:
+    case INS_csrrwi:
+    case INS_csrrsi:
+    case INS_csrrci:
+    case INS_ecall:
+    case INS_ebreak:
+    case INS_mret:
+    case INS_sret:
+    case INS_uret:
+    case INS_wfi:
+    case INS_sfence_vma:
+    case INS_fence_i:
+    case INS_illegal:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Returns the fused op for the pair starting at `d`, or 0 if it has none.
+// The second instruction must consume what the first one writes, and that
+// register may not be x0.
+static u32 fusedOp(const DecodedIns *d)
+{
+    const DecodedIns *n = d + 1;
+    u32 rd;
+    switch (d->op)
+    {
+    case INS_lui:
+        rd = d->ins_FormatU.rd;
+        if (rd != 0 && n->op == INS_addi && n->ins_FormatI.rd == rd && n->ins_FormatI.rs1 == rd)
+            return FUSED_lui_addi;
+        return 0;
+    case INS_auipc:
+        rd = d->ins_FormatU.rd;
+        if (rd == 0 || n->ins_FormatI.rs1 != rd)
+            return 0;
+        return n->op == INS_jalr ? FUSED_auipc_jalr : (n->op == INS_lw ? FUSED_auipc_lw : 0);
+    case INS_slt:
+    case INS_sltu:
+    case INS_slti:
+    case INS_sltiu:
+        rd = (d->op == INS_slt || d->op == INS_sltu) ? d->ins_FormatR.rd : d->ins_FormatI.rd;
+        if (rd == 0 || (n->op != INS_beq && n->op != INS_bne) || n->ins_FormatB.rs1 != rd || n->ins_FormatB.rs2 != 0)
+            return 0;
+        switch (d->op)
+        {
+        case INS_slt:
+            return FUSED_slt_branch;
+        case INS_sltu:
+            return FUSED_sltu_branch;
+        case INS_slti:
+            return FUSED_slti_branch;
+        default:
+            return FUSED_sltiu_branch;
+        }
+    case INS_slli:
+        rd = d->ins_FormatR.rd;
+        if (rd != 0 && n->op == INS_srli && n->ins_FormatR.rd == rd && n->ins_FormatR.rs1 == rd &&
+            ((n->ins_word ^ d->ins_word) & 0x01F00000) == 0)
+            return FUSED_slli_srli;
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+// Counters that follow the clock; time only does when locked to it
+static bool isCounterCsr(u32 csr, bool time_locked)
+{
+    switch (csr)
+    {
+    case CSR_TIME:
+    case CSR_TIMEH:
+        return time_locked;
+    case CSR_CYCLE:
+    case CSR_CYCLEH:
+    case CSR_INSTRET:
+    case CSR_INSTRETH:
+    case CSR_MCYCLE:
+    case CSR_MCYCLEH:
+    case CSR_MINSTRET:
+    case CSR_MINSTRETH:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Polling loops: a branch back to `pc` after at most SPIN_MAX_OPS straight
+// line instructions that only compute, load and read the counters, where no
+// register carries a value from one iteration into the next and loads use
+// the same addresses every time. Iterations then only differ in what they
+// read, so any one of them can be run on its own, see skipSpin(). `pc` is
+// physical. Returns the number of instructions in the loop, 0 if `pc` does
+// not start one.
+u32 Emulator::spinLength(u32 pc)
+{
+    u32 written = 0; // registers written so far
+    u32 live_in = 0; // registers read before being written
+    u32 bases = 0;   // load base registers
+    u32 addr = pc;
+    for (u32 n = 1; n <= SPIN_MAX_OPS; n++)
+    {
+        DecodedIns *d = icache.lookup(addr);
+        if (d == NULL)
+            return 0;
+        if (d->handler == NULL)
+        {
+            fetchDecode(addr, d);
+        }
+
+        u32 rd = 0, rs1 = 0, rs2 = 0;
+        switch (d->op)
+        {
+        case INS_lui:
+        case INS_auipc:
+            rd = d->ins_FormatU.rd;
+            break;
+        case INS_lb:
+        case INS_lbu:
+        case INS_lh:
+        case INS_lhu:
+        case INS_lw:
+            bases |= 1 << d->ins_FormatI.rs1;
+            rd = d->ins_FormatI.rd;
+            rs1 = d->ins_FormatI.rs1;
+            break;
+        case INS_addi:
+        case INS_slti:
+        case INS_sltiu:
+        case INS_xori:
+        case INS_ori:
+        case INS_andi:
+            rd = d->ins_FormatI.rd;
+            rs1 = d->ins_FormatI.rs1;
+            break;
+        case INS_slli:
+        case INS_srli:
+        case INS_srai:
+            rd = d->ins_FormatR.rd;
+            rs1 = d->ins_FormatR.rs1;
+            break;
+        case INS_div:
+        case INS_divu:
+            // dividing by x0 gives all ones whatever the dividend, Linux's
+            // cpu_relax() relies on that
+            rd = d->ins_FormatR.rd;
+            rs2 = d->ins_FormatR.rs2;
+            rs1 = rs2 == 0 ? 0 : d->ins_FormatR.rs1;
+            break;
+        case INS_add:
+        case INS_sub:
+        case INS_sll:
+        case INS_slt:
+        case INS_sltu:
+        case INS_xor:
+        case INS_srl:
+        case INS_sra:
+        case INS_or:
+        case INS_and:
+        case INS_mul:
+        case INS_mulh:
+        case INS_mulhsu:
+        case INS_mulhu:
+        case INS_rem:
+        case INS_remu:
+            rd = d->ins_FormatR.rd;
+            rs1 = d->ins_FormatR.rs1;
+            rs2 = d->ins_FormatR.rs2;
+            break;
+        case INS_csrrs:
+        case INS_csrrc:
+            if (d->ins_FormatCSR.rs != 0 || !isCounterCsr(d->ins_FormatCSR.csr, cpu.time_locked))
+                return 0;
+            rd = d->ins_FormatCSR.rd;
+            break;
+        case INS_fence:
+            break;
+        case INS_beq:
+        case INS_bne:
+        case INS_blt:
+        case INS_bge:
+        case INS_bltu:
+        case INS_bgeu:
+            if (addr + d->ins_FormatB.imm != pc)
+                return 0;
+            live_in |= ((1 << d->ins_FormatB.rs1) | (1 << d->ins_FormatB.rs2)) & ~written;
+            return ((live_in | bases) & written) == 0 ? n : 0;
+        default:
+            return 0;
+        }
+        live_in |= ((1 << rs1) | (1 << rs2)) & ~written;
+        written |= (1 << rd) & ~1;
+
+        addr += d->len;
+        if (((addr ^ pc) >> ICACHE_PAGE_SHIFT) != 0)
+            return 0;
+    }
+    return 0;
+}
+
+// Whether the polling loop at `pc` can be skipped: its loads read RAM or
+// device registers that reading leaves alone (not the UART receive buffer)
+// and that only change with the clock (not mtime in real-time mode), and it
+// ends in an ordered compare of a counter, or a counter plus or minus
+// something the loop does not change, against such a value. Until the
+// 32-bit value wraps, once it passes a deadline it stays past it, so the
+// loop is left at most once and skipSpin() can bisect for the iteration
+// that leaves it. `counter` is set to the compared counter operand. `pc` is
+// physical; while loads are translated, loops with loads are not vouched
+// for, as their virtual addresses say nothing about what they read.
+bool Emulator::spinReadsSafe(u32 pc, u32 len, SpinCounter *counter)
+{
+    u32 counters = 0; // registers holding a counter, or an offset from one
+    u32 falling = 0;  // those of them holding something minus a counter
+    u32 addr = pc;
+    for (u32 i = 0; i < len; i++)
+    {
+        DecodedIns *d = icache.lookup(addr);
+        if (d == NULL || d->handler == NULL)
+            return false;
 
-    // cpu.dump();
+        u32 rd = 0;
+        bool is_counter = false;
+        bool is_falling = false;
+        switch (d->op)
+        {
+        case INS_lb:
+        case INS_lbu:
+        case INS_lh:
+        case INS_lhu:
+        case INS_lw:
+        {
+            if (cpu.vm_data)
+                return false;
+            u32 load = cpu.xreg[d->ins_FormatI.rs1] + d->ins_FormatI.imm;
+            bool clint = load >= CLINT_BASE && load < CLINT_BASE + (cpu.time_locked ? CLINT_SIZE : CLINT_MTIME);
+            bool uart_lsr = load == UART_BASE + 5;
+            if ((load & 0x80000000) == 0 && !clint && !uart_lsr)
+                return false;
+            // a whole half of mtime
+            is_counter = d->op == INS_lw && (load == CLINT_BASE + CLINT_MTIME || load == CLINT_BASE + CLINT_MTIME + 4);
+            rd = d->ins_FormatI.rd;
+            break;
+        }
+        case INS_csrrs:
+        case INS_csrrc:
+            // spinLength() lets only the counters through
+            is_counter = true;
+            rd = d->ins_FormatCSR.rd;
+            break;
+        case INS_addi:
+            is_counter = ((counters >> d->ins_FormatI.rs1) & 1) != 0;
+            is_falling = ((falling >> d->ins_FormatI.rs1) & 1) != 0;
+            rd = d->ins_FormatI.rd;
+            break;
+        case INS_add:
+        case INS_sub:
+        {
+            // the difference of two counters is not monotonic
+            u32 rs1 = d->ins_FormatR.rs1;
+            u32 rs2 = d->ins_FormatR.rs2;
+            is_counter = (((counters >> rs1) ^ (counters >> rs2)) & 1) != 0;
+            u32 from = ((counters >> rs1) & 1) != 0 ? rs1 : rs2;
+            is_falling = (((falling >> from) & 1) != 0) != (d->op == INS_sub && from == rs2);
+            rd = d->ins_FormatR.rd;
+            break;
+        }
+        case INS_lui:
+        case INS_auipc:
+            rd = d->ins_FormatU.rd;
+            break;
+        case INS_slti:
+        case INS_sltiu:
+        case INS_xori:
+        case INS_ori:
+        case INS_andi:
+            rd = d->ins_FormatI.rd;
+            break;
+        case INS_blt:
+        case INS_bge:
+        case INS_bltu:
+        case INS_bgeu:
+        {
+            u32 a = (counters >> d->ins_FormatB.rs1) & 1;
+            u32 b = (counters >> d->ins_FormatB.rs2) & 1;
+            counter->reg = a != 0 ? d->ins_FormatB.rs1 : d->ins_FormatB.rs2;
+            counter->is_signed = d->op == INS_blt || d->op == INS_bge;
+            counter->falling = ((falling >> counter->reg) & 1) != 0;
+            return (a ^ b) != 0;
+        }
+        case INS_beq:
+        case INS_bne:
+            return false;
+        case INS_fence:
+            break;
+        default:
+            rd = d->ins_FormatR.rd;
+            break;
+        }
+        if (rd != 0)
+        {
+            counters = is_counter ? counters | (1 << rd) : counters & ~(1 << rd);
+            falling = is_counter && is_falling ? falling | (1 << rd) : falling & ~(1 << rd);
+        }
+        addr += d->len;
+    }
+    return false;
+}
+
+// Runs one iteration of the polling loop at `pc` (physical `phys`), stopping
+// early if it goes anywhere else. Returns the number of instructions
+// retired; cpu.pc is back at `pc` if the loop goes on.
+u32 Emulator::spinIteration(u32 pc, u32 phys, u32 len)
+{
+    for (u32 i = 0; i < len; i++)
+    {
+        u32 next = i + 1 == len ? pc : cpu.pc + icache.lookup(phys + (cpu.pc - pc))->len;
+        emulateWith<ThroughputPolicy>();
+        if (cpu.pc != next)
+            return i + 1;
+    }
+    return len;
+}
+
+// Runs the polling loop block `b` starts up to the next device event. The
+// first iteration runs as usual. Since nothing changes but the clock until
+// the event, any later iteration can be run alone by setting the clock to
+// where it starts: the last one, and if the loop is left earlier, the first
+// one that leaves it, found by bisection. Loops that spinReadsSafe() does
+// not vouch for leaving at most once run as usual, as do those whose
+// compared counter wraps within the skip, which comparing it in the first
+// and the last iteration catches as the skip is shorter than 2^31 ticks.
+// Returns the number of instructions retired, 0 if `b` was not entered.
+u32 Emulator::skipSpin(BasicBlock *b, u32 count)
+{
+    u32 pc = b->start_pc;
+    u32 len = b->spin_len;
+    u64 start = cpu.clock;
+    if (cpu.irq_pending || cpu.events.next <= start)
+        return 0;
+    u64 iterations = (cpu.events.next - start - 1) / len;
+    if (iterations > count / len)
+        iterations = count / len;
+    if (iterations > SPIN_MAX_WINDOW / len)
+        iterations = SPIN_MAX_WINDOW / len;
+    SpinCounter counter;
+    if (iterations < SPIN_MIN_ITERATIONS || !spinReadsSafe(b->phys, len, &counter))
+        return 0;
+
+    u32 first = spinIteration(pc, b->phys, len);
+    if (first != len || cpu.pc != pc)
+        return first;
+    u32 xreg[32];
+    memcpy(xreg, cpu.xreg, sizeof(xreg));
+
+    // runs iteration `k` and returns whether it leaves the loop
+    auto leaves = [&](u64 k) {
+        cpu.clock = start + k * len;
+        cpu.pc = pc;
+        spinIteration(pc, b->phys, len);
+        return cpu.pc != pc;
+    };
+    u64 last = iterations - 1;
+    bool left = leaves(last);
+
+    // the compared value wrapped, or crossed the sign bit, within the skip:
+    // the loop may be left and entered again, so it runs as usual
+    u32 from = xreg[counter.reg];
+    u32 to = cpu.xreg[counter.reg];
+    if (counter.falling)
+        std::swap(from, to);
+    if (counter.is_signed ? (int32_t)to < (int32_t)from : to < from)
+    {
+        memcpy(cpu.xreg, xreg, sizeof(xreg));
+        cpu.clock = start + len;
+        cpu.pc = pc;
+        return len;
+    }
+
+    if (left)
+    {
+        u64 lo = 1;
+        while (lo < last)
+        {
+            u64 mid = lo + (last - lo) / 2;
+            if (leaves(mid))
+                last = mid;
+            else
+                lo = mid + 1;
+        }
+        leaves(last);
+    }
+    u32 retired = (last + 1) * len;
+    blocks.spin_skipped += retired;
+    return retired;
+}
+
+// ra and t0, the link registers of the calling convention
+static bool isLinkReg(u32 reg)
+{
+    return reg == 1 || reg == 5;
+}
+
+// Discovers the block starting at `pc`, whose physical address `phys` must
+// be cacheable RAM. While fetches are translated, `pc` may not be the last
+// parcel of its page.
+BasicBlock *Emulator::buildBlock(u32 pc, u32 phys)
+{
+    BasicBlock *b = blocks.alloc();
+    b->start_pc = pc;
+    b->phys = phys;
+    b->space = cpu.vm_space;
+
+    u32 addr = pc;
+    while (true)
+    {
+        u32 paddr = phys + (addr - pc);
+        if (cpu.vm_fetch && (addr & ~MMU_PAGE_MASK) == MMU_PAGE_SIZE - 2 && (cpu.physRead(paddr, 2) & 0x3) == 0x3)
+        {
+            // the upper half is in the next virtual page, which may map anywhere
+            b->fall_pc = addr;
+            break;
+        }
+        DecodedIns *d = icache.lookup(paddr);
+        if (d->handler == NULL)
+        {
+            fetchDecode(paddr, d);
+        }
+        b->ops[b->len++] = *d;
+
+        if (endsBlock(d->op))
+        {
+            switch (d->op)
+            {
+            case INS_beq:
+            case INS_bne:
+            case INS_blt:
+            case INS_bge:
+            case INS_bltu:
+            case INS_bgeu:
+                b->taken_pc = addr + d->ins_FormatB.imm;
+                b->fall_pc = addr + d->len;
+                break;
+            case INS_jal:
+                b->taken_pc = addr + d->ins_FormatJ.imm;
+                if (isLinkReg(d->ins_FormatJ.rd))
+                    b->return_pc = addr + d->len;
+                break;
+            case INS_jalr:
+                b->ends_jalr = true;
+                if (isLinkReg(d->ins_FormatI.rd))
+                    b->return_pc = addr + d->len;
+                else if (d->ins_FormatI.rd == 0 && isLinkReg(d->ins_FormatI.rs1) && d->ins_FormatI.imm == 0)
+                    b->ends_return = true;
+                break;
+            case INS_mret:
+            case INS_sret:
+            case INS_illegal:
+                break;
+            default:
+                b->fall_pc = addr + d->len;
+                break;
+            }
+            break;
+        }
+
+        addr += d->len;
+        if (b->len == BLOCK_MAX_OPS || ((addr ^ pc) >> ICACHE_PAGE_SHIFT) != 0)
+        {
+            b->fall_pc = addr;
+            break;
+        }
+    }
+
+    for (u32 i = 0; i + 1 < b->len; i++)
+    {
+        u32 op = fusedOp(&b->ops[i]);
+        if (op != 0)
+        {
+            b->ops[i].op = op;
+            i++;
+        }
+    }
+
+    b->spin_len = spinLength(phys);
+    // translations are of the image at its physical addresses
+    b->aot = b->space == 0 ? findTranslation(b) : NULL;
+
+    blocks.insert(b);
+    return b;
+}
+
+// Whether the start of `b` still maps to where it was built from, while
+// fetches are translated. A fetch fault is left for emulate() to take.
+bool Emulator::blockMapped(BasicBlock *b)
+{
+    u32 paddr;
+    if (cpu.fetchAddr(b->start_pc, &paddr))
+        return paddr == b->phys;
+    cpu.fault.en = false;
+    return false;
+}
+
+////////////////////////////////////////////////////////////////
+// Threaded Interpreter
+////////////////////////////////////////////////////////////////
+// Every instruction body from ins_impl.inc is expanded into a label of the
+// interpreter loops below, committing its results straight to the hart. The
+// end of each body (NEXT, defined per loop) retires the instruction and jumps
+// to the label of the next one through a table (GCC/Clang computed goto).
+// Traps and pending interrupts leave the fast path through handleIrqAndTrap.
+#if defined(__GNUC__)
+
+#undef imp
+
+#define imp(name, fmt_t, code)                          \
+    L_##name:                                           \
+    {                                                   \
+        u32 ins_word = d->ins_word;                     \
+        fmt_t ins = operands(cpu, d->ins_##fmt_t, ret); \
+        (void)ins_word;                                 \
+        (void)ins;                                      \
+        if (!CSR_TRAPPED(fmt_t))                        \
+            code                                        \
+    }                                                   \
+    NEXT()
+
+#define ins_label(name, mask, match, fmt_t) &&L_##name,
+#define fused_label(name, first) &&L_fused_##name,
+
+// Runs `count` instructions with the same semantics as calling emulate()
+// `count` times, fetching every instruction from the InsCache. Returns the
+// number retired, less than `count` if the run was stopped.
+u32 Emulator::emulateThreaded(u32 count)
+{
+    const u32 total = count;
+    if (count == 0)
+        return 0;
+
+    static void *const labels[] = {
+        RV32_INSTRUCTIONS(ins_label)
+        &&L_illegal};
+
+    DecodedIns *d;
+    DecodedIns uncached;
+    u32 npc;
+    u32 paddr;
+    ins_ret tr = cpu.insReturnNoop();
+    ins_ret *ret = &tr;
+
+#define FETCH()                                                                                 \
+    {                                                                                           \
+        paddr = cpu.pc;                                                                         \
+        if (cpu.vm_fetch &&                                                                     \
+            ((cpu.pc & ~MMU_PAGE_MASK) == MMU_PAGE_SIZE - 2 || !cpu.fetchAddr(cpu.pc, &paddr))) \
+            goto translated;                                                                    \
+        cpu.tick();                                                                             \
+        tr.trap.en = false;                                                                     \
+        if ((cpu.pc & 0x1) != 0)                                                                \
+        {                                                                                       \
+            npc = cpu.pc;                                                                       \
+            tr.trap.en = true;                                                                  \
+            tr.trap.type = trap_InstructionAddressMisaligned;                                   \
+            tr.trap.value = cpu.pc;                                                             \
+            goto retire;                                                                        \
+        }                                                                                       \
+        d = icache.lookup(paddr);                                                               \
+        if (d == NULL)                                                                          \
+        {                                                                                       \
+            d = &uncached;                                                                      \
+            d->handler = NULL;                                                                  \
+        }                                                                                       \
+        if (d->handler == NULL)                                                                 \
+        {                                                                                       \
+            fetchDecode(paddr, d);                                                              \
+        }                                                                                       \
+        npc = cpu.pc + d->len;                                                                  \
+        goto *labels[d->op];                                                                    \
+    }
+
+// Same checks as the end of emulate()
+#define NEXT()                                                                            \
+    {                                                                                     \
+        tickDevices();                                                                    \
+        if (tr.trap.en || cpu.irq_pending)                                                \
+        {                                                                                 \
+            if (tr.trap.en && stop_on_trap)                                               \
+                stopRun(STOP_TRAP);                                                       \
+            tr.pc_val = npc;                                                              \
+            cpu.handleIrqAndTrap(&tr);                                                    \
+            npc = tr.pc_val;                                                              \
+        }                                                                                 \
+        cpu.pc = npc;                                                                     \
+        if (--count == 0 || stop_pending)                                                 \
+            return total - count;                                                         \
+        FETCH()                                                                           \
+    }
+
+    FETCH()
+
+retire:
+    NEXT()
+
+    // fetches that fault or may be split across pages, which emulate() does
+translated:
+    cpu.fault.en = false;
+    emulateWith<ThroughputPolicy>();
+    if (--count == 0 || stop_pending)
+        return total - count;
+    FETCH()
+
+#include "ins_impl.inc"
+
+#undef FETCH
+#undef NEXT
+}
+
+// Runs about `count` instructions out of the block cache. Within a block,
+// instructions run back to back; clock, devices and pending interrupts are
+// only looked at when the block is left. A block that would overrun `count`
+// is single-stepped through emulate() instead. In EXEC_JIT mode, hot blocks
+// run as host code, which may run a chain of blocks before coming back.
+// Returns the number of instructions retired.
+u32 Emulator::emulateBlocks(u32 count)
+{
+    const u32 total = count;
+    static void *const labels[] = {
+        RV32_INSTRUCTIONS(ins_label)
+        &&L_illegal,
+        RV32_FUSIONS(fused_label)};
+
+    BasicBlock *b = NULL;
+    BasicBlock **link = NULL; // chain slot of the previous block to fill in
+    u32 generation = blocks.generation;
+    DecodedIns *d;
+    DecodedIns *end;
+    u32 npc;
+    u32 retired;
+    bool use_jit = exec_mode == EXEC_JIT && jit.available();
+    ins_ret tr = cpu.insReturnNoop();
+    ins_ret *ret = &tr;
+
+    // After a trapping instruction, or once the block is done
+#define NEXT()                          \
+    {                                   \
+        if (tr.trap.en)                 \
+            goto trapped;               \
+        cpu.pc = npc;                   \
+        if (++d != end)                 \
+        {                               \
+            npc = cpu.pc + d->len;      \
+            goto *labels[d->op];        \
+        }                               \
+        goto block_done;                \
+    }
+
+lookup:
+    if (count == 0 || stop_pending)
+        return total - count;
+    b = (cpu.pc & 0x1) == 0 ? blocks.find(cpu.pc, cpu.vm_space) : NULL;
+    if (b != NULL && cpu.vm_fetch && !blockMapped(b))
+        b = NULL;
+    if (b == NULL)
+    {
+        u32 paddr;
+        bool split = cpu.vm_fetch && (cpu.pc & ~MMU_PAGE_MASK) == MMU_PAGE_SIZE - 2;
+        if ((cpu.pc & 0x1) != 0 || split || !cpu.fetchAddr(cpu.pc, &paddr) || icache.lookup(paddr) == NULL)
+        {
+            // misaligned, faulting, not RAM or maybe split across pages,
+            // leave the trap or MMIO fetch to emulate()
+            cpu.fault.en = false;
+            emulateWith<ThroughputPolicy>();
+            count--;
+            link = NULL;
+            goto lookup;
+        }
+        b = buildBlock(cpu.pc, paddr);
+    }
+    if (link != NULL && generation == blocks.generation)
+    {
+        *link = b;
+    }
+    link = NULL;
+
+enter:
+    if (b->spin_len != 0)
+    {
+        retired = skipSpin(b, count);
+        if (retired != 0)
+        {
+            count -= retired;
+            goto lookup;
+        }
+    }
+    if (b->len > count)
+    {
+        emulateWith<ThroughputPolicy>();
+        count--;
+        goto lookup;
+    }
+    generation = blocks.generation;
+    if (use_jit)
+    {
+        if (b->native == NULL && ++b->execs == JIT_HOT_THRESHOLD && !jit.translate(b, generation))
+        {
+            // code buffer full, start over with an empty cache
+            blocks.flush();
+            goto lookup;
+        }
+        if (b->native != NULL)
+            goto native;
+    }
+    // reads of the cycle CSR, always last in the block, see the whole block
+    cpu.clock += b->len;
+    tr.trap.en = false;
+    d = b->ops;
+    if (b->aot != NULL)
+    {
+        // cpu.pc is left at the first instruction not translated, if any
+        b->aot->fn(&sbt_ctx);
+        d += b->aot->translated;
+        if (b->aot->translated == b->len)
+            goto block_done;
+    }
+    end = b->ops + b->len;
+    npc = cpu.pc + d->len;
+    goto *labels[d->op];
+
+trapped:
+    // cpu.pc still points at the trapping instruction
+    retired = (d - b->ops) + 1;
+    cpu.clock -= b->len - retired;
+    count -= retired;
+    tickDevices();
+    if (stop_on_trap)
+        stopRun(STOP_TRAP);
+    tr.pc_val = npc;
+    cpu.handleIrqAndTrap(&tr);
+    cpu.pc = tr.pc_val;
+    goto lookup;
+
+native:
+    {
+        // the budget also bounds how long devices go without a tick
+        u32 budget = count < JIT_SLICE ? count : JIT_SLICE;
+        JitResult r = jit.execute(b, budget);
+        retired = budget - (u32)r.budget;
+        b = r.block;
+        if (retired != 0)
+        {
+            cpu.clock += retired;
+            count -= retired;
+            tickDevices();
+        }
+        d = b->ops + b->native_len;
+        if (cpu.fault.en)
+        {
+            // a translated load or store faulted, cpu.pc is at it and the
+            // interpreter runs it again to take the trap
+            cpu.fault.en = false;
+            d = b->ops;
+            for (u32 at = b->start_pc; at != cpu.pc && d < b->ops + b->native_len; at += d->len)
+                d++;
+        }
+        if (d != b->ops + b->len)
+        {
+            // cpu.pc is at the first untranslated instruction, the block is
+            // retired as a whole once the interpreter is done with it
+            cpu.clock += b->len;
+            tr.trap.en = false;
+            end = b->ops + b->len;
+            npc = cpu.pc + d->len;
+            goto *labels[d->op];
+        }
+        goto block_exit;
+    }
+
+block_done:
+    count -= b->len;
+    tickDevices();
+    // translated calls push themselves
+    if (b->return_pc != NO_SUCCESSOR)
+        blocks.pushReturn(b);
+block_exit:
+    // translated returns only pop the return stack when they chain
+    if (b->ends_jalr)
+        link = blocks.indirectLink(b, cpu.pc);
+    if (cpu.irq_pending)
+    {
+        // a native exit leaves the trap of whatever ran before it
+        link = NULL;
+        tr.trap.en = false;
+        tr.pc_val = cpu.pc;
+        cpu.handleIrqAndTrap(&tr);
+        cpu.pc = tr.pc_val;
+        goto lookup;
+    }
+    if (count == 0 || stop_pending || generation != blocks.generation || cpu.vm_space != b->space)
+        goto lookup;
+
+    // follow the chain to the successor
+    if (cpu.pc == b->taken_pc)
+        link = &b->taken;
+    else if (cpu.pc == b->fall_pc)
+        link = &b->fall;
+    else if (link == NULL)
+        goto lookup;
+    else if (*link != NULL && (*link)->start_pc == cpu.pc)
+        blocks.indirect_hits++;
+    else
+    {
+        // not linked yet, or the jalr went elsewhere this time
+        blocks.indirect_misses++;
+        goto lookup;
+    }
+    if (*link != NULL && (*link)->valid && (!cpu.vm_fetch || blockMapped(*link)))
+    {
+        b = *link;
+        link = NULL;
+        blocks.chained++;
+        goto enter;
+    }
+    goto lookup;
+
+#include "ins_impl.inc"
+
+    // Fused pairs, see fusedOp(). The first half is retired here and the
+    // second runs from its own slot, so a trap in it is taken as usual.
+#define FUSED_RETIRE_FIRST(name)                    \
+    {                                               \
+        blocks.fused[FUSED_##name - FUSED_FIRST]++; \
+        cpu.pc += d->len;                           \
+        d++;                                        \
+        npc = cpu.pc + d->len;                      \
+    }
+
+    // li: lui rd, hi; addi rd, rd, lo
+L_fused_lui_addi:
+    cpu.xreg[d->ins_FormatU.rd] = d->ins_FormatU.imm + d[1].ins_FormatI.imm;
+    FUSED_RETIRE_FIRST(lui_addi)
+    NEXT()
+
+    // far call and pc relative load: auipc rd, hi; jalr/lw rd2, lo(rd)
+L_fused_auipc_jalr:
+    cpu.xreg[d->ins_FormatU.rd] = cpu.pc + d->ins_FormatU.imm;
+    FUSED_RETIRE_FIRST(auipc_jalr)
+    goto L_jalr;
+L_fused_auipc_lw:
+    cpu.xreg[d->ins_FormatU.rd] = cpu.pc + d->ins_FormatU.imm;
+    FUSED_RETIRE_FIRST(auipc_lw)
+    goto L_lw;
+
+    // compare and branch: slt* rd, ...; beqz/bnez rd, target
+#define FUSED_CMP_BRANCH(name, fmt_t, cond)                      \
+    L_fused_##name:                                              \
+    {                                                            \
+        const fmt_t &ins = d->ins_##fmt_t;                       \
+        u32 set = (cond) ? 1 : 0;                                \
+        cpu.xreg[ins.rd] = set;                                  \
+        FUSED_RETIRE_FIRST(name)                                 \
+        if ((set != 0) == (d->op == INS_bne))                    \
+            npc = cpu.pc + d->ins_FormatB.imm;                   \
+    }                                                            \
+    NEXT()
+
+    FUSED_CMP_BRANCH(slt_branch, FormatR, AS_SIGNED(cpu.xreg[ins.rs1]) < AS_SIGNED(cpu.xreg[ins.rs2]))
+    FUSED_CMP_BRANCH(sltu_branch, FormatR, cpu.xreg[ins.rs1] < cpu.xreg[ins.rs2])
+    FUSED_CMP_BRANCH(slti_branch, FormatI, AS_SIGNED(cpu.xreg[ins.rs1]) < AS_SIGNED(ins.imm))
+    FUSED_CMP_BRANCH(sltiu_branch, FormatI, cpu.xreg[ins.rs1] < ins.imm)
+
+    // zero extension: slli rd, rs, n; srli rd, rd, n
+L_fused_slli_srli:
+    {
+        u32 shamt = (d->ins_word >> 20) & 0x1F;
+        cpu.xreg[d->ins_FormatR.rd] = (cpu.xreg[d->ins_FormatR.rs1] << shamt) >> shamt;
+        FUSED_RETIRE_FIRST(slli_srli)
+    }
+    NEXT()
+
+#undef FUSED_CMP_BRANCH
+#undef FUSED_RETIRE_FIRST
+#undef NEXT
+}
+
+#undef ins_label
+#undef fused_label
+
+#else
+u32 Emulator::emulateThreaded(u32 count)
+{
+    // no computed goto, use the reference path
+    u32 i;
+    for (i = 0; i < count && !stop_pending; i++)
+    {
+        emulateWith<ThroughputPolicy>();
+    }
+    return i;
+}
+
+u32 Emulator::emulateBlocks(u32 count)
+{
+    return emulateThreaded(count);
+}
+#endif
 
-}
\ No newline at end of file
+#undef imp
+#undef WR_RD
+#undef WR_PC
+#undef WR_CSR
+#undef CSR_TRAPPED
@@ -0,0 +1,270 @@
+#include "fastmem.h"
+#include "rv32.h"
+#include <stdio.h>
+
+#ifdef FASTMEM_X86_64
+#include <signal.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+// Regions the handler looks in, one per emulator
+static FastMem *arenas[FASTMEM_MAX_ARENAS];
+static struct sigaction previous_action;
+static bool handler_installed = false;
+
+// gregs index of each x86 register number
+static const int greg_index[16] = {
+    REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+    REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15,
+};
+
+static void onSegv(int sig, siginfo_t *info, void *context)
+{
+    for (u32 i = 0; i < FASTMEM_MAX_ARENAS; i++)
+    {
+        if (arenas[i] != NULL && arenas[i]->handleFault(context))
+            return;
+    }
+
+    // not an access of ours: whoever had the signal before, or the crash
+    if ((previous_action.sa_flags & SA_SIGINFO) != 0)
+        previous_action.sa_sigaction(sig, info, context);
+    else if (previous_action.sa_handler != SIG_DFL && previous_action.sa_handler != SIG_IGN)
+        previous_action.sa_handler(sig);
+    else
+        signal(sig, SIG_DFL); // the access faults again on return
+}
+#endif
+
+FastMem::FastMem()
+{
+    base = NULL;
+    hart = NULL;
+    faults = 0;
+    ram_base = 0;
+    ram_size = 0;
+}
+
+FastMem::~FastMem()
+{
+    release();
+}
+
+FastMem::FastMem(const FastMem &other)
+{
+    base = NULL;
+    hart = NULL;
+    faults = 0;
+    ram_base = 0;
+    ram_size = 0;
+}
+
+FastMem &FastMem::operator=(const FastMem &other)
+{
+    if (this != &other)
+        release();
+    return *this;
+}
+
+u8 *FastMem::mapRam(RV32 *hart, u32 ram_base, u32 ram_size)
+{
+#ifdef FASTMEM_X86_64
+    if (base == NULL)
+    {
+        void *m = mmap(NULL, FASTMEM_SPAN, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (m == MAP_FAILED)
+        {
+            printf("WARN: Could not reserve the fastmem region, RAM accesses are range checked\n");
+            return NULL;
+        }
+
+        u32 slot = 0;
+        while (slot < FASTMEM_MAX_ARENAS && arenas[slot] != NULL)
+        {
+            slot++;
+        }
+        if (slot == FASTMEM_MAX_ARENAS)
+        {
+            munmap(m, FASTMEM_SPAN);
+            return NULL;
+        }
+        if (!handler_installed)
+        {
+            struct sigaction action = {};
+            action.sa_sigaction = onSegv;
+            action.sa_flags = SA_SIGINFO;
+            sigemptyset(&action.sa_mask);
+            if (sigaction(SIGSEGV, &action, &previous_action) != 0)
+            {
+                munmap(m, FASTMEM_SPAN);
+                return NULL;
+            }
+            handler_installed = true;
+        }
+        base = (u8 *)m;
+        arenas[slot] = this;
+    }
+
+    // a fresh mapping each time, which drops the pages of the last run; RAM
+    // the last run had beyond this one's goes back to faulting
+    if (this->ram_size != 0)
+        mmap(base + this->ram_base, this->ram_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    this->ram_size = 0;
+    u8 *ram = base + ram_base;
+    if (mmap(ram, ram_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) ==
+        MAP_FAILED)
+    {
+        printf("WARN: Could not map %u bytes of RAM into the fastmem region\n", ram_size);
+        release();
+        return NULL;
+    }
+    this->hart = hart;
+    this->ram_base = ram_base;
+    this->ram_size = ram_size;
+    faults = 0;
+    return ram;
+#else
+    return NULL;
+#endif
+}
+
+void FastMem::release()
+{
+#ifdef FASTMEM_X86_64
+    if (base == NULL)
+        return;
+    for (u32 i = 0; i < FASTMEM_MAX_ARENAS; i++)
+    {
+        if (arenas[i] == this)
+            arenas[i] = NULL;
+    }
+    munmap(base, FASTMEM_SPAN);
+    base = NULL;
+    hart = NULL;
+    ram_size = 0;
+#endif
+}
+
+// The accessors compile to these, with any register and addressing mode:
+//   0f b6 /r  movzbl m8, r32     88 /r     movb r8, m8
+//   0f b7 /r  movzwl m16, r32    66 89 /r  movw r16, m16
+//   8b /r     movl m32, r32      89 /r     movl r32, m32
+bool FastMem::handleFault(void *uc)
+{
+#ifdef FASTMEM_X86_64
+    greg_t *gregs = ((ucontext_t *)uc)->uc_mcontext.gregs;
+    const u8 *ip = (const u8 *)gregs[REG_RIP];
+
+    bool operand16 = false;
+    u8 rex = 0;
+    if (*ip == 0x66)
+    {
+        operand16 = true;
+        ip++;
+    }
+    if ((*ip & 0xF0) == 0x40)
+        rex = *ip++;
+    if ((rex & 0x08) != 0)
+        return false; // 64-bit operand
+
+    u32 size;
+    bool store;
+    if (ip[0] == 0x0F && (ip[1] == 0xB6 || ip[1] == 0xB7) && !operand16)
+    {
+        size = ip[1] == 0xB6 ? 1 : 2;
+        store = false;
+        ip += 2;
+    }
+    else if (ip[0] == 0x8B && !operand16)
+    {
+        size = 4;
+        store = false;
+        ip++;
+    }
+    else if (ip[0] == 0x88 && !operand16)
+    {
+        size = 1;
+        store = true;
+        ip++;
+    }
+    else if (ip[0] == 0x89)
+    {
+        size = operand16 ? 2 : 4;
+        store = true;
+        ip++;
+    }
+    else
+    {
+        return false;
+    }
+
+    // ModRM and SIB give the register operand and the address
+    u8 modrm = *ip++;
+    u32 mod = modrm >> 6;
+    u32 reg = ((modrm >> 3) & 0x7) | ((rex & 0x04) != 0 ? 8 : 0);
+    u32 rm = modrm & 0x7;
+    if (mod == 3 || (mod == 0 && rm == 5))
+        return false; // register or rip relative, never the region
+
+    u64 ea = 0;
+    if (rm == 4)
+    {
+        u8 sib = *ip++;
+        u32 index = ((sib >> 3) & 0x7) | ((rex & 0x02) != 0 ? 8 : 0);
+        u32 sib_base = (sib & 0x7) | ((rex & 0x01) != 0 ? 8 : 0);
+        if (index != 4)
+            ea += (u64)gregs[greg_index[index]] << (sib >> 6);
+        if ((sib & 0x7) == 5 && mod == 0)
+        {
+            int32_t disp;
+            memcpy(&disp, ip, 4);
+            ea += (int64_t)disp;
+            ip += 4;
+        }
+        else
+        {
+            ea += gregs[greg_index[sib_base]];
+        }
+    }
+    else
+    {
+        ea += gregs[greg_index[rm | ((rex & 0x01) != 0 ? 8 : 0)]];
+    }
+    if (mod == 1)
+    {
+        ea += (int64_t)(int8_t)*ip;
+        ip++;
+    }
+    else if (mod == 2)
+    {
+        int32_t disp;
+        memcpy(&disp, ip, 4);
+        ea += (int64_t)disp;
+        ip += 4;
+    }
+
+    if (base == NULL || ea - (u64)base >= FASTMEM_SPAN)
+        return false;
+    u32 addr = (u32)(ea - (u64)base);
+
+    if (store)
+    {
+        u64 val;
+        if (size == 1 && rex == 0 && reg >= 4)
+            val = gregs[greg_index[reg - 4]] >> 8; // ah, ch, dh, bh
+        else
+            val = gregs[greg_index[reg]];
+        hart->physWrite(addr, (u32)val & (size == 4 ? 0xFFFFFFFF : (1u << (8 * size)) - 1), size);
+    }
+    else
+    {
+        // writing a 32-bit register clears the upper half
+        gregs[greg_index[reg]] = hart->physRead(addr, size);
+    }
+    faults++;
+    gregs[REG_RIP] = (greg_t)ip;
+    return true;
+#else
+    return false;
+#endif
+}
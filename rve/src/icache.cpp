@@ -0,0 +1,99 @@
+#include "icache.h"
+#include "emu.h"
+#include "bcache.h"
+
+InsCache::InsCache()
+{
+    pages = NULL;
+    num_pages = 0;
+    bcache = NULL;
+}
+
+InsCache::~InsCache()
+{
+    freePages();
+}
+
+InsCache::InsCache(const InsCache &other)
+{
+    pages = NULL;
+    num_pages = 0;
+    bcache = NULL;
+}
+
+InsCache &InsCache::operator=(const InsCache &other)
+{
+    if (this != &other)
+    {
+        freePages();
+    }
+    return *this;
+}
+
+void InsCache::init(u32 mem_size)
+{
+    freePages();
+    num_pages = mem_size >> ICACHE_PAGE_SHIFT;
+    pages = (DecodedIns **)calloc(num_pages, sizeof(DecodedIns *));
+}
+
+void InsCache::freePages()
+{
+    if (pages != NULL)
+    {
+        flush();
+        free(pages);
+    }
+    pages = NULL;
+    num_pages = 0;
+}
+
+void InsCache::flush()
+{
+    for (u32 i = 0; i < num_pages; i++)
+    {
+        if (pages[i] != NULL)
+        {
+            free(pages[i]);
+            pages[i] = NULL;
+        }
+    }
+}
+
+void InsCache::allocPage(u32 page)
+{
+    // zeroed slots have a NULL handler, i.e. not decoded yet
+    pages[page] = (DecodedIns *)calloc(ICACHE_PAGE_SLOTS, sizeof(DecodedIns));
+}
+
+// Blocks are built from decoded slots only, so a store that hits no decoded
+// instruction, like one to data sharing a page with code, keeps them.
+void InsCache::invalidateSlot(u32 addr)
+{
+    u32 page = (addr & 0x7FFFFFFF) >> ICACHE_PAGE_SHIFT;
+    DecodedIns *slot = &pages[page][icacheSlot(addr)];
+    bool decoded = slot->handler != NULL;
+    slot->handler = NULL;
+
+    // the byte may also be the upper half of a 32-bit instruction starting
+    // in the parcel before, which can be in the previous page
+    u32 prev = addr - 2;
+    u32 prev_page = (prev & 0x7FFFFFFF) >> ICACHE_PAGE_SHIFT;
+    if ((prev & 0x80000000) != 0 && prev_page < num_pages && pages[prev_page] != NULL)
+    {
+        DecodedIns *prev_slot = &pages[prev_page][icacheSlot(prev)];
+        if (prev_slot->handler != NULL && prev_slot->len == 4)
+        {
+            prev_slot->handler = NULL;
+            if (prev_page == page)
+                decoded = true;
+            else if (bcache != NULL)
+                bcache->invalidatePage(prev_page);
+        }
+    }
+
+    if (decoded && bcache != NULL)
+    {
+        bcache->invalidatePage(page);
+    }
+}
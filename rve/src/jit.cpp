@@ -0,0 +1,1114 @@
+#include "jit.h"
+#include "emu.h"
+#include "instructions.h"
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JIT_X86_64
+#endif
+
+Jit::Jit()
+{
+    code = NULL;
+    code_used = 0;
+    code_start = 0;
+    generation = 0;
+    enter = NULL;
+    exit_stub = NULL;
+    cpu = NULL;
+    icache = NULL;
+    mem_size = 0;
+    translated = 0;
+    resets = 0;
+    p = NULL;
+}
+
+Jit::~Jit()
+{
+    release();
+}
+
+Jit::Jit(const Jit &other) : Jit()
+{
+}
+
+Jit &Jit::operator=(const Jit &other)
+{
+    if (this != &other)
+    {
+        release();
+    }
+    return *this;
+}
+
+void Jit::release()
+{
+    if (code != NULL)
+    {
+        munmap(code, JIT_CODE_SIZE);
+    }
+    code = NULL;
+    code_used = 0;
+    enter = NULL;
+    exit_stub = NULL;
+}
+
+bool Jit::available()
+{
+    return code != NULL;
+}
+
+void Jit::init(RV32 *cpu, InsCache *icache, u32 mem_size)
+{
+    this->cpu = cpu;
+    this->icache = icache;
+    this->mem_size = mem_size;
+    translated = 0;
+    resets = 0;
+#ifdef JIT_X86_64
+    if (code == NULL)
+    {
+        void *m = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (m == MAP_FAILED)
+        {
+            printf("WARN: JIT code buffer could not be mapped, using the block interpreter\n");
+            return;
+        }
+        code = (u8 *)m;
+    }
+    // the stubs hold the addresses of the hart, RAM and slot tables
+    p = code;
+    emitStubs();
+    code_start = code_used = p - code;
+#endif
+}
+
+void Jit::reset(u32 generation)
+{
+    this->generation = generation;
+    if (code_used != code_start)
+        resets++;
+    code_used = code_start;
+}
+
+bool Jit::translate(BasicBlock *b, u32 generation)
+{
+#ifdef JIT_X86_64
+    // worst case for a block, slow paths included
+    const u32 max_size = BLOCK_MAX_OPS * 128 + 256;
+
+    if (generation != this->generation)
+        reset(generation);
+    if (code_used + max_size > JIT_CODE_SIZE)
+        return false;
+
+    p = code + code_used;
+    emitBlock(b);
+    if (b->native_len != 0)
+    {
+        b->native = code + code_used;
+        code_used = p - code;
+        translated++;
+    }
+#endif
+    return true;
+}
+
+#ifdef JIT_X86_64
+
+////////////////////////////////////////////////////////////////
+// x86-64 Code Generation
+////////////////////////////////////////////////////////////////
+// Host registers while translated code runs:
+//   rbx  &cpu->xreg[0]     r12  guest RAM (physical 0x80000000)
+//   r13  InsCache::pages   r14d instruction budget left
+//   r15  cpu
+// rax, rcx, rdx, rsi and rdi are scratch. Nothing guest related lives in a
+// caller saved register, so the memory helpers are plain calls.
+enum
+{
+    RAX,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+};
+
+// Condition codes, as in jcc/setcc
+enum
+{
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_A = 0x7,
+    CC_L = 0xC,
+    CC_GE = 0xD,
+};
+
+// Group 1 opcode extensions (81 /ext)
+enum
+{
+    ALU_ADD = 0,
+    ALU_OR = 1,
+    ALU_AND = 4,
+    ALU_SUB = 5,
+    ALU_XOR = 6,
+    ALU_CMP = 7,
+};
+
+// Group 2 opcode extensions (C1/D3 /ext)
+enum
+{
+    SHIFT_SHL = 4,
+    SHIFT_SHR = 5,
+    SHIFT_SAR = 7,
+};
+
+static_assert(offsetof(BasicBlock, len) < 0x80 && offsetof(BasicBlock, valid) < 0x80 &&
+                  offsetof(BasicBlock, native) < 0x80 && offsetof(BasicBlock, start_pc) < 0x80 &&
+                  offsetof(BasicBlock, return_pc) < 0x80 && offsetof(BasicBlock, returned) < 0x80 &&
+                  offsetof(BasicBlock, phys) < 0x80 && offsetof(BasicBlock, space) < 0x80,
+              "chain checks use 8 bit displacements");
+
+// Memory helpers called from translated code (rdi = cpu, esi = addr, edx = val)
+static u32 jitGetByte(RV32 *cpu, u32 addr) { return cpu->memGetByte(addr); }
+static u32 jitGetHalfWord(RV32 *cpu, u32 addr) { return cpu->memGetHalfWord(addr); }
+static u32 jitGetWord(RV32 *cpu, u32 addr) { return cpu->memGetWord(addr); }
+static void jitSetByte(RV32 *cpu, u32 addr, u32 val) { cpu->memSetByte(addr, val); }
+static void jitSetHalfWord(RV32 *cpu, u32 addr, u32 val) { cpu->memSetHalfWord(addr, val); }
+static void jitSetWord(RV32 *cpu, u32 addr, u32 val) { cpu->memSetWord(addr, val); }
+
+static inline void emit8(u8 *&p, u32 v)
+{
+    *p++ = (u8)v;
+}
+
+static inline void emit32(u8 *&p, u32 v)
+{
+    memcpy(p, &v, 4);
+    p += 4;
+}
+
+static inline void emit64(u8 *&p, u64 v)
+{
+    memcpy(p, &v, 8);
+    p += 8;
+}
+
+// <opcode> r32, [rbx + 4 * reg], for the legacy registers
+static inline void emitGuestOp(u8 *&p, u32 opcode, u32 hreg, u32 reg)
+{
+    emit8(p, opcode);
+    emit8(p, 0x40 | hreg << 3 | RBX);
+    emit8(p, reg * 4);
+}
+
+static inline void emitLoadGuest(u8 *&p, u32 hreg, u32 reg)
+{
+    emitGuestOp(p, 0x8B, hreg, reg);
+}
+
+// Writes to x0 are dropped
+static inline void emitStoreGuest(u8 *&p, u32 reg, u32 hreg)
+{
+    if (reg != 0)
+        emitGuestOp(p, 0x89, hreg, reg);
+}
+
+static inline void emitStoreGuestImm(u8 *&p, u32 reg, u32 imm)
+{
+    if (reg == 0)
+        return;
+    emit8(p, 0xC7);
+    emit8(p, 0x40 | RBX);
+    emit8(p, reg * 4);
+    emit32(p, imm);
+}
+
+// <alu> r32, imm
+static inline void emitAluImm(u8 *&p, u32 ext, u32 hreg, u32 imm)
+{
+    if ((int32_t)imm >= -128 && (int32_t)imm <= 127)
+    {
+        emit8(p, 0x83);
+        emit8(p, 0xC0 | ext << 3 | hreg);
+        emit8(p, imm);
+    }
+    else
+    {
+        emit8(p, 0x81);
+        emit8(p, 0xC0 | ext << 3 | hreg);
+        emit32(p, imm);
+    }
+}
+
+// setcc al; movzx eax, al
+static inline void emitSetcc(u8 *&p, u32 cc)
+{
+    emit8(p, 0x0F);
+    emit8(p, 0x90 | cc);
+    emit8(p, 0xC0);
+    emit8(p, 0x0F);
+    emit8(p, 0xB6);
+    emit8(p, 0xC0);
+}
+
+static inline void emitMovImm64(u8 *&p, u32 hreg, u64 imm)
+{
+    emit8(p, 0x48);
+    emit8(p, 0xB8 | hreg);
+    emit64(p, imm);
+}
+
+// Returns where the rel32 goes, see patchRel32
+static inline u8 *emitJcc(u8 *&p, u32 cc)
+{
+    emit8(p, 0x0F);
+    emit8(p, 0x80 | cc);
+    u8 *at = p;
+    emit32(p, 0);
+    return at;
+}
+
+static inline u8 *emitJmp(u8 *&p)
+{
+    emit8(p, 0xE9);
+    u8 *at = p;
+    emit32(p, 0);
+    return at;
+}
+
+static inline void patchRel32(u8 *at, u8 *target)
+{
+    int32_t rel = (int32_t)(target - (at + 4));
+    memcpy(at, &rel, 4);
+}
+
+// Call to a memory helper: mov rdi, r15; mov rax, fn; call rax
+static inline void emitHelperCall(u8 *&p, const void *fn)
+{
+    emit8(p, 0x4C);
+    emit8(p, 0x89);
+    emit8(p, 0xFF);
+    emitMovImm64(p, RAX, (u64)fn);
+    emit8(p, 0xFF);
+    emit8(p, 0xD0);
+}
+
+// esi = xreg[reg] + imm
+static inline void emitAddress(u8 *&p, u32 reg, u32 imm)
+{
+    emitLoadGuest(p, RSI, reg);
+    if (imm != 0)
+        emitAluImm(p, ALU_ADD, RSI, imm);
+}
+
+// eax = esi - 0x80000000, then leave for the slow path unless
+// [eax, eax + size) lies in RAM
+static inline u8 *emitRamCheck(u8 *&p, u32 mem_size, u32 size)
+{
+    // lea eax, [rsi + 0x80000000]
+    emit8(p, 0x8D);
+    emit8(p, 0x86);
+    emit32(p, 0x80000000);
+    // cmp eax, mem_size - size
+    emit8(p, 0x3D);
+    emit32(p, mem_size - size);
+    return emitJcc(p, CC_A);
+}
+
+// Loads and stores that miss the fast path, completed after the block body
+struct SlowPath
+{
+    u8 *jump;     // rel32 of the jump to the slow path
+    u8 *resume;   // where the fast path continues
+    const void *helper;
+    u32 sign_extend; // load result width to sign extend, 0 for none
+    u32 pc;          // of the instruction, for page faults
+};
+
+void Jit::emitStubs()
+{
+    // enter(native, budget): save the callee saved registers, load the
+    // fixed ones and jump to the translation
+    enter = (jit_entry)p;
+    emit8(p, 0x55); // push rbp
+    emit8(p, 0x53); // push rbx
+    emit8(p, 0x41); // push r12..r15
+    emit8(p, 0x54);
+    emit8(p, 0x41);
+    emit8(p, 0x55);
+    emit8(p, 0x41);
+    emit8(p, 0x56);
+    emit8(p, 0x41);
+    emit8(p, 0x57);
+    emit8(p, 0x48); // sub rsp, 8 (align calls)
+    emit8(p, 0x83);
+    emit8(p, 0xEC);
+    emit8(p, 0x08);
+    emitMovImm64(p, RBX, (u64)cpu->xreg);
+    emit8(p, 0x49); // mov r12, mem
+    emit8(p, 0xBC);
+    emit64(p, (u64)cpu->mem);
+    emit8(p, 0x49); // mov r13, pages
+    emit8(p, 0xBD);
+    emit64(p, (u64)icache->pages);
+    emit8(p, 0x49); // mov r15, cpu
+    emit8(p, 0xBF);
+    emit64(p, (u64)cpu);
+    emit8(p, 0x41); // mov r14d, esi
+    emit8(p, 0x89);
+    emit8(p, 0xF6);
+    emit8(p, 0xFF); // jmp rdi
+    emit8(p, 0xE7);
+
+    // exit: rax holds the last block, return the budget left in rdx
+    exit_stub = p;
+    emit8(p, 0x44); // mov edx, r14d
+    emit8(p, 0x89);
+    emit8(p, 0xF2);
+    emit8(p, 0x48); // add rsp, 8
+    emit8(p, 0x83);
+    emit8(p, 0xC4);
+    emit8(p, 0x08);
+    emit8(p, 0x41); // pop r15..r12
+    emit8(p, 0x5F);
+    emit8(p, 0x41);
+    emit8(p, 0x5E);
+    emit8(p, 0x41);
+    emit8(p, 0x5D);
+    emit8(p, 0x41);
+    emit8(p, 0x5C);
+    emit8(p, 0x5B); // pop rbx
+    emit8(p, 0x5D); // pop rbp
+    emit8(p, 0xC3); // ret
+}
+
+// Retires block `b` and continues at `target_pc`: jumps to the translation
+// of the chained successor if there is one and the budget covers it,
+// returns to the dispatcher otherwise. While fetches are translated, only
+// successors in the same page chain, and only if they were built from the
+// same physical page: `b` was checked against the TLB when entered, so
+// they still map there. The dispatcher checks the others.
+static void emitChainExit(u8 *&p, u8 *exit_stub, u32 pc_off, BasicBlock *b, BasicBlock **link, u32 target_pc)
+{
+    // mov dword [rbx + pc], target_pc
+    emit8(p, 0xC7);
+    emit8(p, 0x83);
+    emit32(p, pc_off);
+    emit32(p, target_pc);
+    // sub r14d, len
+    emit8(p, 0x41);
+    emit8(p, 0x81);
+    emit8(p, 0xEE);
+    emit32(p, b->len);
+    bool translated = (b->space & VM_SPACE_FETCH) != 0;
+    if (translated && ((target_pc ^ b->start_pc) & MMU_PAGE_MASK) != 0)
+    {
+        emitMovImm64(p, RAX, (u64)b);
+        patchRel32(emitJmp(p), exit_stub);
+        return;
+    }
+    // rax = *link
+    emitMovImm64(p, RAX, (u64)link);
+    emit8(p, 0x48);
+    emit8(p, 0x8B);
+    emit8(p, 0x00);
+    // test rax, rax; jz exit
+    emit8(p, 0x48);
+    emit8(p, 0x85);
+    emit8(p, 0xC0);
+    u8 *no_link = emitJcc(p, CC_E);
+    // cmp byte [rax + valid], 0; je exit
+    emit8(p, 0x80);
+    emit8(p, 0x78);
+    emit8(p, offsetof(BasicBlock, valid));
+    emit8(p, 0x00);
+    u8 *invalid = emitJcc(p, CC_E);
+    u8 *moved = NULL;
+    if (translated)
+    {
+        // cmp dword [rax + phys], phys of target_pc; jne exit
+        emit8(p, 0x81);
+        emit8(p, 0x78);
+        emit8(p, offsetof(BasicBlock, phys));
+        emit32(p, b->phys + (target_pc - b->start_pc));
+        moved = emitJcc(p, CC_NE);
+    }
+    // mov rcx, [rax + native]; test rcx, rcx; jz exit
+    emit8(p, 0x48);
+    emit8(p, 0x8B);
+    emit8(p, 0x48);
+    emit8(p, offsetof(BasicBlock, native));
+    emit8(p, 0x48);
+    emit8(p, 0x85);
+    emit8(p, 0xC9);
+    u8 *not_native = emitJcc(p, CC_E);
+    // cmp r14d, [rax + len]; jb exit
+    emit8(p, 0x44);
+    emit8(p, 0x3B);
+    emit8(p, 0x70);
+    emit8(p, offsetof(BasicBlock, len));
+    u8 *no_budget = emitJcc(p, CC_B);
+    // jmp rcx
+    emit8(p, 0xFF);
+    emit8(p, 0xE1);
+
+    patchRel32(no_link, p);
+    patchRel32(invalid, p);
+    if (moved != NULL)
+        patchRel32(moved, p);
+    patchRel32(not_native, p);
+    patchRel32(no_budget, p);
+    emitMovImm64(p, RAX, (u64)b);
+    patchRel32(emitJmp(p), exit_stub);
+}
+
+// inc qword [counter], for the block cache stats
+static void emitCount(u8 *&p, u64 *counter)
+{
+    emitMovImm64(p, RDX, (u64)counter);
+    emit8(p, 0x48);
+    emit8(p, 0xFF);
+    emit8(p, 0x02);
+}
+
+// Pushes `b`, which ends in a call, on the return stack
+static void emitReturnPush(u8 *&p, BlockCache *bcache, BasicBlock *b)
+{
+    // ecx = ras_top++ & mask
+    emitMovImm64(p, RDX, (u64)&bcache->ras_top);
+    emit8(p, 0x8B); // mov ecx, [rdx]
+    emit8(p, 0x0A);
+    emit8(p, 0x8D); // lea esi, [rcx + 1]
+    emit8(p, 0x71);
+    emit8(p, 0x01);
+    emit8(p, 0x89); // mov [rdx], esi
+    emit8(p, 0x32);
+    emitAluImm(p, ALU_AND, RCX, BCACHE_RAS_SIZE - 1);
+    // ras[ecx] = b
+    emitMovImm64(p, RDX, (u64)bcache->ras);
+    emitMovImm64(p, RSI, (u64)b);
+    emit8(p, 0x48); // mov [rdx + rcx * 8], rsi
+    emit8(p, 0x89);
+    emit8(p, 0x34);
+    emit8(p, 0xCA);
+}
+
+// Continues at the translation of the block in rsi if it starts at the pc
+// in eax, was built in `space`, is valid and translated and fits into the
+// budget; falls through otherwise. Returns pop the return stack entry at
+// edi when they chain.
+static void emitIndirectChain(u8 *&p, BlockCache *bcache, u32 space, bool pop)
+{
+    // test rsi, rsi; jz out
+    emit8(p, 0x48);
+    emit8(p, 0x85);
+    emit8(p, 0xF6);
+    u8 *no_link = emitJcc(p, CC_E);
+    // cmp [rsi + start_pc], eax; jne out
+    emit8(p, 0x39);
+    emit8(p, 0x46);
+    emit8(p, offsetof(BasicBlock, start_pc));
+    u8 *elsewhere = emitJcc(p, CC_NE);
+    // cmp dword [rsi + space], space; jne out
+    emit8(p, 0x81);
+    emit8(p, 0x7E);
+    emit8(p, offsetof(BasicBlock, space));
+    emit32(p, space);
+    u8 *other_space = emitJcc(p, CC_NE);
+    // cmp byte [rsi + valid], 0; je out
+    emit8(p, 0x80);
+    emit8(p, 0x7E);
+    emit8(p, offsetof(BasicBlock, valid));
+    emit8(p, 0x00);
+    u8 *invalid = emitJcc(p, CC_E);
+    // mov rcx, [rsi + native]; test rcx, rcx; jz out
+    emit8(p, 0x48);
+    emit8(p, 0x8B);
+    emit8(p, 0x4E);
+    emit8(p, offsetof(BasicBlock, native));
+    emit8(p, 0x48);
+    emit8(p, 0x85);
+    emit8(p, 0xC9);
+    u8 *not_native = emitJcc(p, CC_E);
+    // cmp r14d, [rsi + len]; jb out
+    emit8(p, 0x44);
+    emit8(p, 0x3B);
+    emit8(p, 0x76);
+    emit8(p, offsetof(BasicBlock, len));
+    u8 *no_budget = emitJcc(p, CC_B);
+
+    if (pop)
+    {
+        // ras[edi] = NULL; ras_top--
+        emitMovImm64(p, RDX, (u64)bcache->ras);
+        emit8(p, 0x48); // mov qword [rdx + rdi * 8], 0
+        emit8(p, 0xC7);
+        emit8(p, 0x04);
+        emit8(p, 0xFA);
+        emit32(p, 0);
+        emitMovImm64(p, RDX, (u64)&bcache->ras_top);
+        emit8(p, 0xFF); // dec dword [rdx]
+        emit8(p, 0x0A);
+        emitCount(p, &bcache->ras_hits);
+    }
+    emitCount(p, &bcache->indirect_hits);
+    // jmp rcx
+    emit8(p, 0xFF);
+    emit8(p, 0xE1);
+
+    for (u8 *jump : {no_link, elsewhere, other_space, invalid, not_native, no_budget})
+        patchRel32(jump, p);
+}
+
+// Chains the jalr ending `b` to its target in eax: returns go to the block
+// after the call on top of the return stack, other jumps to their last
+// target. Anything else, a misprediction included, is left to the
+// dispatcher, which pops the return stack itself, as is every target while
+// fetches are translated, since the dispatcher checks those against the TLB.
+static void emitJalrChain(u8 *&p, BlockCache *bcache, BasicBlock *b)
+{
+    if ((b->space & VM_SPACE_FETCH) != 0)
+        return;
+    if (b->ends_return)
+    {
+        // edi = (ras_top - 1) & mask; rsi = ras[edi]
+        emitMovImm64(p, RDX, (u64)&bcache->ras_top);
+        emit8(p, 0x8B); // mov edi, [rdx]
+        emit8(p, 0x3A);
+        emit8(p, 0xFF); // dec edi
+        emit8(p, 0xCF);
+        emitAluImm(p, ALU_AND, RDI, BCACHE_RAS_SIZE - 1);
+        emitMovImm64(p, RDX, (u64)bcache->ras);
+        emit8(p, 0x48); // mov rsi, [rdx + rdi * 8]
+        emit8(p, 0x8B);
+        emit8(p, 0x34);
+        emit8(p, 0xFA);
+        // test rsi, rsi; jz out
+        emit8(p, 0x48);
+        emit8(p, 0x85);
+        emit8(p, 0xF6);
+        u8 *empty = emitJcc(p, CC_E);
+        // cmp [rsi + return_pc], eax; jne out
+        emit8(p, 0x39);
+        emit8(p, 0x46);
+        emit8(p, offsetof(BasicBlock, return_pc));
+        u8 *mispredicted = emitJcc(p, CC_NE);
+        // mov rsi, [rsi + returned]
+        emit8(p, 0x48);
+        emit8(p, 0x8B);
+        emit8(p, 0x76);
+        emit8(p, offsetof(BasicBlock, returned));
+        emitIndirectChain(p, bcache, b->space, true);
+        patchRel32(empty, p);
+        patchRel32(mispredicted, p);
+        return;
+    }
+    emitMovImm64(p, RSI, (u64)&b->indirect);
+    emit8(p, 0x48); // mov rsi, [rsi]
+    emit8(p, 0x8B);
+    emit8(p, 0x36);
+    emitIndirectChain(p, bcache, b->space, false);
+}
+
+// First instruction of each fused pair, which is what gets translated
+#define fused_first(name, first) INS_##first,
+static const u32 fused_first_op[FUSED_COUNT] = {RV32_FUSIONS(fused_first)};
+#undef fused_first
+
+void Jit::emitBlock(BasicBlock *b)
+{
+    const u32 pc_off = (u8 *)&cpu->pc - (u8 *)cpu->xreg;
+    const u32 fault_off = (u8 *)&cpu->fault.en - (u8 *)cpu;
+    // loads and stores go through the TLB, see RV32::memRead
+    const bool translated = (b->space & VM_SPACE_DATA) != 0;
+    SlowPath slow[BLOCK_MAX_OPS * 3];
+    u32 num_slow = 0;
+    u32 pc = b->start_pc;
+    u32 i;
+
+    for (i = 0; i < b->len; pc += b->ops[i].len, i++)
+    {
+        const DecodedIns *d = &b->ops[i];
+        DecodedIns unfused;
+        if (d->op >= FUSED_FIRST)
+        {
+            // the second half keeps its own slot
+            unfused = *d;
+            unfused.op = fused_first_op[d->op - FUSED_FIRST];
+            d = &unfused;
+        }
+        const FormatR &r = d->ins_FormatR;
+        const FormatI &im = d->ins_FormatI;
+        const FormatS &s = d->ins_FormatS;
+        const FormatB &br = d->ins_FormatB;
+        u32 shamt = (d->ins_word >> 20) & 0x1F;
+
+        switch (d->op)
+        {
+        // Upper immediates
+        case INS_lui:
+            emitStoreGuestImm(p, d->ins_FormatU.rd, d->ins_FormatU.imm);
+            break;
+        case INS_auipc:
+            emitStoreGuestImm(p, d->ins_FormatU.rd, pc + d->ins_FormatU.imm);
+            break;
+
+        // Register-immediate
+        case INS_addi:
+        case INS_andi:
+        case INS_ori:
+        case INS_xori:
+        case INS_slti:
+        case INS_sltiu:
+            if (im.rd == 0)
+                break;
+            emitLoadGuest(p, RAX, im.rs1);
+            switch (d->op)
+            {
+            case INS_addi:
+                if (im.imm != 0)
+                    emitAluImm(p, ALU_ADD, RAX, im.imm);
+                break;
+            case INS_andi:
+                emitAluImm(p, ALU_AND, RAX, im.imm);
+                break;
+            case INS_ori:
+                emitAluImm(p, ALU_OR, RAX, im.imm);
+                break;
+            case INS_xori:
+                emitAluImm(p, ALU_XOR, RAX, im.imm);
+                break;
+            case INS_slti:
+                emitAluImm(p, ALU_CMP, RAX, im.imm);
+                emitSetcc(p, CC_L);
+                break;
+            case INS_sltiu:
+                emitAluImm(p, ALU_CMP, RAX, im.imm);
+                emitSetcc(p, CC_B);
+                break;
+            }
+            emitStoreGuest(p, im.rd, RAX);
+            break;
+        case INS_slli:
+        case INS_srli:
+        case INS_srai:
+            if (r.rd == 0)
+                break;
+            emitLoadGuest(p, RAX, r.rs1);
+            emit8(p, 0xC1);
+            emit8(p, 0xC0 | (d->op == INS_slli ? SHIFT_SHL : d->op == INS_srli ? SHIFT_SHR : SHIFT_SAR) << 3);
+            emit8(p, shamt);
+            emitStoreGuest(p, r.rd, RAX);
+            break;
+
+        // Register-register
+        case INS_add:
+        case INS_sub:
+        case INS_and:
+        case INS_or:
+        case INS_xor:
+        case INS_slt:
+        case INS_sltu:
+        case INS_mul:
+            if (r.rd == 0)
+                break;
+            emitLoadGuest(p, RAX, r.rs1);
+            switch (d->op)
+            {
+            case INS_add:
+                emitGuestOp(p, 0x03, RAX, r.rs2);
+                break;
+            case INS_sub:
+                emitGuestOp(p, 0x2B, RAX, r.rs2);
+                break;
+            case INS_and:
+                emitGuestOp(p, 0x23, RAX, r.rs2);
+                break;
+            case INS_or:
+                emitGuestOp(p, 0x0B, RAX, r.rs2);
+                break;
+            case INS_xor:
+                emitGuestOp(p, 0x33, RAX, r.rs2);
+                break;
+            case INS_slt:
+                emitGuestOp(p, 0x3B, RAX, r.rs2);
+                emitSetcc(p, CC_L);
+                break;
+            case INS_sltu:
+                emitGuestOp(p, 0x3B, RAX, r.rs2);
+                emitSetcc(p, CC_B);
+                break;
+            case INS_mul:
+                emit8(p, 0x0F);
+                emitGuestOp(p, 0xAF, RAX, r.rs2);
+                break;
+            }
+            emitStoreGuest(p, r.rd, RAX);
+            break;
+        case INS_sll:
+        case INS_srl:
+        case INS_sra:
+            // x86 masks the count to 5 bits as well
+            if (r.rd == 0)
+                break;
+            emitLoadGuest(p, RAX, r.rs1);
+            emitLoadGuest(p, RCX, r.rs2);
+            emit8(p, 0xD3);
+            emit8(p, 0xC0 | (d->op == INS_sll ? SHIFT_SHL : d->op == INS_srl ? SHIFT_SHR : SHIFT_SAR) << 3);
+            emitStoreGuest(p, r.rd, RAX);
+            break;
+        case INS_mulh:
+        case INS_mulhsu:
+        case INS_mulhu:
+            if (r.rd == 0)
+                break;
+            // 64 bit product of the (sign or zero) extended operands
+            if (d->op == INS_mulhu)
+            {
+                emitLoadGuest(p, RAX, r.rs1);
+            }
+            else
+            {
+                emit8(p, 0x48); // movsxd rax, [rs1]
+                emitGuestOp(p, 0x63, RAX, r.rs1);
+            }
+            if (d->op == INS_mulh)
+            {
+                emit8(p, 0x48); // movsxd rcx, [rs2]
+                emitGuestOp(p, 0x63, RCX, r.rs2);
+            }
+            else
+            {
+                emitLoadGuest(p, RCX, r.rs2);
+            }
+            emit8(p, 0x48); // imul rax, rcx
+            emit8(p, 0x0F);
+            emit8(p, 0xAF);
+            emit8(p, 0xC1);
+            emit8(p, 0x48); // shr rax, 32
+            emit8(p, 0xC1);
+            emit8(p, 0xE8);
+            emit8(p, 0x20);
+            emitStoreGuest(p, r.rd, RAX);
+            break;
+        case INS_div:
+        case INS_rem:
+        {
+            if (r.rd == 0)
+                break;
+            bool rem = d->op == INS_rem;
+            emitLoadGuest(p, RAX, r.rs1);
+            emitLoadGuest(p, RCX, r.rs2);
+            emit8(p, 0x85); // test ecx, ecx
+            emit8(p, 0xC9);
+            u8 *by_zero = emitJcc(p, CC_E);
+            emit8(p, 0x83); // cmp ecx, -1
+            emit8(p, 0xF9);
+            emit8(p, 0xFF);
+            u8 *no_overflow = emitJcc(p, CC_NE);
+            emit8(p, 0x3D); // cmp eax, 0x80000000
+            emit32(p, 0x80000000);
+            u8 *overflow = emitJcc(p, CC_E);
+            patchRel32(no_overflow, p);
+            emit8(p, 0x99); // cdq
+            emit8(p, 0xF7); // idiv ecx
+            emit8(p, 0xF9);
+            if (rem)
+            {
+                emit8(p, 0x89); // mov eax, edx
+                emit8(p, 0xD0);
+            }
+            u8 *done = emitJmp(p);
+            // by zero: quotient -1, remainder the dividend
+            patchRel32(by_zero, p);
+            if (!rem)
+            {
+                emit8(p, 0xB8); // mov eax, -1
+                emit32(p, 0xFFFFFFFF);
+            }
+            u8 *done_zero = emitJmp(p);
+            // overflow: quotient the dividend, remainder 0
+            patchRel32(overflow, p);
+            if (rem)
+            {
+                emit8(p, 0x31); // xor eax, eax
+                emit8(p, 0xC0);
+            }
+            patchRel32(done, p);
+            patchRel32(done_zero, p);
+            emitStoreGuest(p, r.rd, RAX);
+            break;
+        }
+        case INS_divu:
+        case INS_remu:
+        {
+            if (r.rd == 0)
+                break;
+            bool rem = d->op == INS_remu;
+            emitLoadGuest(p, RAX, r.rs1);
+            emitLoadGuest(p, RCX, r.rs2);
+            emit8(p, 0x85); // test ecx, ecx
+            emit8(p, 0xC9);
+            u8 *by_zero = emitJcc(p, CC_E);
+            emit8(p, 0x31); // xor edx, edx
+            emit8(p, 0xD2);
+            emit8(p, 0xF7); // div ecx
+            emit8(p, 0xF1);
+            if (rem)
+            {
+                emit8(p, 0x89); // mov eax, edx
+                emit8(p, 0xD0);
+            }
+            u8 *done = emitJmp(p);
+            patchRel32(by_zero, p);
+            if (!rem)
+            {
+                emit8(p, 0xB8); // mov eax, -1
+                emit32(p, 0xFFFFFFFF);
+            }
+            patchRel32(done, p);
+            emitStoreGuest(p, r.rd, RAX);
+            break;
+        }
+
+        // Loads, the value goes to rd even for rd == 0 reads of MMIO
+        case INS_lb:
+        case INS_lbu:
+        case INS_lh:
+        case INS_lhu:
+        case INS_lw:
+        {
+            u32 size = (d->op == INS_lw) ? 4 : (d->op == INS_lh || d->op == INS_lhu) ? 2 : 1;
+            SlowPath &sp = slow[num_slow++];
+            sp.helper = size == 4 ? (const void *)jitGetWord : size == 2 ? (const void *)jitGetHalfWord : (const void *)jitGetByte;
+            sp.sign_extend = d->op == INS_lb ? 8 : d->op == INS_lh ? 16 : 0;
+            sp.pc = pc;
+            emitAddress(p, im.rs1, im.imm);
+            if (translated)
+            {
+                sp.jump = emitJmp(p);
+                sp.resume = p;
+                emitStoreGuest(p, im.rd, RAX);
+                break;
+            }
+            sp.jump = emitRamCheck(p, mem_size, size);
+            // mov/movzx/movsx eax, [r12 + rax]
+            emit8(p, 0x41);
+            switch (d->op)
+            {
+            case INS_lb:
+                emit8(p, 0x0F);
+                emit8(p, 0xBE);
+                break;
+            case INS_lbu:
+                emit8(p, 0x0F);
+                emit8(p, 0xB6);
+                break;
+            case INS_lh:
+                emit8(p, 0x0F);
+                emit8(p, 0xBF);
+                break;
+            case INS_lhu:
+                emit8(p, 0x0F);
+                emit8(p, 0xB7);
+                break;
+            default:
+                emit8(p, 0x8B);
+                break;
+            }
+            emit8(p, 0x04);
+            emit8(p, 0x04);
+            sp.resume = p;
+            emitStoreGuest(p, im.rd, RAX);
+            break;
+        }
+
+        // Stores, only to RAM pages without predecoded code inline
+        case INS_sb:
+        case INS_sh:
+        case INS_sw:
+        {
+            u32 size = d->op == INS_sw ? 4 : d->op == INS_sh ? 2 : 1;
+            SlowPath &sp = slow[num_slow++];
+            sp.helper = d->op == INS_sw ? (const void *)jitSetWord : d->op == INS_sh ? (const void *)jitSetHalfWord : (const void *)jitSetByte;
+            sp.sign_extend = 0;
+            sp.pc = pc;
+            emitAddress(p, s.rs1, s.imm);
+            emitLoadGuest(p, RDX, s.rs2);
+            if (translated)
+            {
+                sp.jump = emitJmp(p);
+                sp.resume = p;
+                break;
+            }
+            sp.jump = emitRamCheck(p, mem_size, size);
+            u8 *misaligned = NULL;
+            if (size > 1)
+            {
+                // test al, size - 1: a split access could touch a code page
+                emit8(p, 0xA8);
+                emit8(p, size - 1);
+                misaligned = emitJcc(p, CC_NE);
+            }
+            // cmp qword [r13 + (eax >> 12) * 8], 0
+            emit8(p, 0x89); // mov ecx, eax
+            emit8(p, 0xC1);
+            emit8(p, 0xC1); // shr ecx, 12
+            emit8(p, 0xE9);
+            emit8(p, ICACHE_PAGE_SHIFT);
+            emit8(p, 0x49);
+            emit8(p, 0x83);
+            emit8(p, 0x7C);
+            emit8(p, 0xCD);
+            emit8(p, 0x00);
+            emit8(p, 0x00);
+            u8 *has_code = emitJcc(p, CC_NE);
+            // mov [r12 + rax], edx/dx/dl
+            if (size == 2)
+                emit8(p, 0x66);
+            emit8(p, 0x41);
+            emit8(p, size == 1 ? 0x88 : 0x89);
+            emit8(p, 0x14);
+            emit8(p, 0x04);
+            sp.resume = p;
+
+            // the other two exits share the slow path
+            for (u8 *jump : {misaligned, has_code})
+            {
+                if (jump == NULL)
+                    continue;
+                SlowPath &extra = slow[num_slow++];
+                extra = sp;
+                extra.jump = jump;
+            }
+            break;
+        }
+
+        case INS_fence:
+            break;
+
+        // Block terminators
+        case INS_beq:
+        case INS_bne:
+        case INS_blt:
+        case INS_bge:
+        case INS_bltu:
+        case INS_bgeu:
+        {
+            u32 cc = d->op == INS_beq ? CC_E : d->op == INS_bne ? CC_NE : d->op == INS_blt ? CC_L : d->op == INS_bge ? CC_GE : d->op == INS_bltu ? CC_B : CC_AE;
+            emitLoadGuest(p, RAX, br.rs1);
+            emitGuestOp(p, 0x3B, RAX, br.rs2);
+            u8 *taken = emitJcc(p, cc);
+            emitChainExit(p, exit_stub, pc_off, b, &b->fall, b->fall_pc);
+            patchRel32(taken, p);
+            emitChainExit(p, exit_stub, pc_off, b, &b->taken, b->taken_pc);
+            i++;
+            goto slow_paths;
+        }
+        case INS_jal:
+            emitStoreGuestImm(p, d->ins_FormatJ.rd, pc + d->len);
+            if (b->return_pc != NO_SUCCESSOR)
+                emitReturnPush(p, icache->bcache, b);
+            emitChainExit(p, exit_stub, pc_off, b, &b->taken, b->taken_pc);
+            i++;
+            goto slow_paths;
+        case INS_jalr:
+            // target first, rd may be rs1
+            emitLoadGuest(p, RAX, im.rs1);
+            if (im.imm != 0)
+                emitAluImm(p, ALU_ADD, RAX, im.imm);
+            emitAluImm(p, ALU_AND, RAX, ~1u);
+            emitStoreGuestImm(p, im.rd, pc + d->len);
+            if (b->return_pc != NO_SUCCESSOR)
+                emitReturnPush(p, icache->bcache, b);
+            // mov [rbx + pc], eax
+            emit8(p, 0x89);
+            emit8(p, 0x83);
+            emit32(p, pc_off);
+            // sub r14d, len
+            emit8(p, 0x41);
+            emit8(p, 0x81);
+            emit8(p, 0xEE);
+            emit32(p, b->len);
+            emitJalrChain(p, icache->bcache, b);
+            emitMovImm64(p, RAX, (u64)b);
+            patchRel32(emitJmp(p), exit_stub);
+            i++;
+            goto slow_paths;
+
+        default:
+            // not translated, the interpreter takes over from here
+            goto tail;
+        }
+    }
+
+    // block ended at a page boundary or its size limit
+    emitChainExit(p, exit_stub, pc_off, b, &b->fall, b->fall_pc);
+    goto slow_paths;
+
+tail:
+    // mov dword [rbx + pc], pc; the interpreted part is not retired here
+    emit8(p, 0xC7);
+    emit8(p, 0x83);
+    emit32(p, pc_off);
+    emit32(p, pc);
+    emitMovImm64(p, RAX, (u64)b);
+    patchRel32(emitJmp(p), exit_stub);
+
+slow_paths:
+    b->native_len = i;
+    for (u32 n = 0; n < num_slow; n++)
+    {
+        patchRel32(slow[n].jump, p);
+        emitHelperCall(p, slow[n].helper);
+        if (translated)
+        {
+            // cmp byte [r15 + fault.en], 0; je on: a page fault leaves the
+            // instruction to the interpreter, see Emulator::emulateBlocks
+            emit8(p, 0x41);
+            emit8(p, 0x80);
+            emit8(p, 0xBF);
+            emit32(p, fault_off);
+            emit8(p, 0x00);
+            u8 *on = emitJcc(p, CC_E);
+            // mov dword [rbx + pc], pc
+            emit8(p, 0xC7);
+            emit8(p, 0x83);
+            emit32(p, pc_off);
+            emit32(p, slow[n].pc);
+            emitMovImm64(p, RAX, (u64)b);
+            patchRel32(emitJmp(p), exit_stub);
+            patchRel32(on, p);
+        }
+        if (slow[n].sign_extend != 0)
+        {
+            // movsx eax, al/ax
+            emit8(p, 0x0F);
+            emit8(p, slow[n].sign_extend == 8 ? 0xBE : 0xBF);
+            emit8(p, 0xC0);
+        }
+        patchRel32(emitJmp(p), slow[n].resume);
+    }
+}
+
+#else
+void Jit::emitStubs()
+{
+}
+
+// First instruction of each fused pair, which is what gets translated
+#define fused_first(name, first) INS_##first,
+static const u32 fused_first_op[FUSED_COUNT] = {RV32_FUSIONS(fused_first)};
+#undef fused_first
+
+void Jit::emitBlock(BasicBlock *b)
+{
+}
+#endif
@@ -87,6 +87,70 @@ int loadElf(const char *path, uint64_t path_len, uint8_t *data, uint64_t data_le
     return 0;
 }
 
+int scanElfCode(const char *path, ElfCode *code)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("ERRO: Failed to open ELF file\n");
+        return 1;
+    }
+
+    Elf32_Ehdr eh;
+    if (read(fd, &eh, sizeof(eh)) != sizeof(eh) || memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0 ||
+        eh.e_ident[EI_CLASS] != ELFCLASS32)
+    {
+        printf("ERRO: Not an ELF32 file\n");
+        close(fd);
+        return 2;
+    }
+
+    std::vector<Elf32_Shdr> sh_tbl(eh.e_shnum);
+    if (lseek(fd, eh.e_shoff, SEEK_SET) == -1 ||
+        read(fd, sh_tbl.data(), eh.e_shentsize * eh.e_shnum) != eh.e_shentsize * eh.e_shnum)
+    {
+        printf("ERRO: Error reading section headers\n");
+        close(fd);
+        return 4;
+    }
+
+    // sections land at their address masked to RAM, see loadElf
+    auto executable = [&](uint32_t index) {
+        return index < sh_tbl.size() && sh_tbl[index].sh_type == SHT_PROGBITS && (sh_tbl[index].sh_flags & SHF_EXECINSTR) != 0;
+    };
+    auto guest = [](uint32_t addr) { return 0x80000000 | (addr & 0x7FFFFFFF); };
+
+    for (uint32_t i = 0; i < sh_tbl.size(); i++)
+    {
+        if (executable(i))
+            code->ranges.push_back({guest(sh_tbl[i].sh_addr), guest(sh_tbl[i].sh_addr) + sh_tbl[i].sh_size});
+    }
+    code->entries.push_back(guest(eh.e_entry));
+
+    for (const auto &sh : sh_tbl)
+    {
+        if (sh.sh_type != SHT_SYMTAB || sh.sh_entsize != sizeof(Elf32_Sym))
+            continue;
+        std::vector<Elf32_Sym> syms(sh.sh_size / sizeof(Elf32_Sym));
+        if (lseek(fd, sh.sh_offset, SEEK_SET) == -1 ||
+            read(fd, syms.data(), syms.size() * sizeof(Elf32_Sym)) != (ssize_t)(syms.size() * sizeof(Elf32_Sym)))
+        {
+            printf("ERRO: Error reading symbol table\n");
+            close(fd);
+            return 5;
+        }
+        for (const auto &sym : syms)
+        {
+            uint32_t type = ELF32_ST_TYPE(sym.st_info);
+            if ((type == STT_FUNC || type == STT_NOTYPE) && executable(sym.st_shndx))
+                code->entries.push_back(guest(sym.st_value));
+        }
+    }
+
+    close(fd);
+    return 0;
+}
+
 int loadBinary(const char *path, uint64_t path_len, uint8_t *data, uint64_t data_len)
 {
     // Ensure the path is null-terminated
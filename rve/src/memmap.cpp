@@ -0,0 +1,94 @@
+#include "memmap.h"
+#include <stdio.h>
+#include <string.h>
+
+MemoryMap::MemoryMap()
+{
+    page_region = NULL;
+    count = 0;
+}
+
+MemoryMap::~MemoryMap()
+{
+    free(page_region);
+}
+
+MemoryMap::MemoryMap(const MemoryMap &other)
+{
+    page_region = NULL;
+    count = 0;
+}
+
+MemoryMap &MemoryMap::operator=(const MemoryMap &other)
+{
+    if (this != &other)
+    {
+        free(page_region);
+        page_region = NULL;
+        count = 0;
+    }
+    return *this;
+}
+
+void MemoryMap::init()
+{
+    if (page_region == NULL)
+        page_region = (u8 *)calloc(MEMMAP_PAGES, sizeof(u8));
+    else
+        memset(page_region, 0, MEMMAP_PAGES * sizeof(u8));
+
+    // covers the whole address space, so find() needs no other check
+    memset(&regions[0], 0, sizeof(MemRegion));
+    regions[0].type = REGION_UNMAPPED;
+    regions[0].size = 0xFFFFFFFF;
+    regions[0].name = "unmapped";
+    count = 1;
+}
+
+bool MemoryMap::addRam(const char *name, u32 base, u32 size, u8 *host)
+{
+    return add({REGION_RAM, base, size, name, host, NULL, NULL, NULL});
+}
+
+bool MemoryMap::addRom(const char *name, u32 base, u32 size, const u8 *host)
+{
+    return add({REGION_ROM, base, size, name, (u8 *)host, NULL, NULL, NULL});
+}
+
+bool MemoryMap::addMmio(const char *name, u32 base, u32 size, void *device, mmio_read_fn read, mmio_write_fn write)
+{
+    return add({REGION_MMIO, base, size, name, NULL, device, read, write});
+}
+
+bool MemoryMap::add(const MemRegion &region)
+{
+    if (region.size == 0 || ((region.base | region.size) & 0x7) != 0 || region.base + (region.size - 1) < region.base)
+    {
+        printf("ERRO: Memory region %s at %08x+%x is not 8 byte aligned\n", region.name, region.base, region.size);
+        return false;
+    }
+    if (count == MEMMAP_MAX_REGIONS)
+    {
+        printf("ERRO: No room for memory region %s\n", region.name);
+        return false;
+    }
+
+    u32 first = region.base >> MEMMAP_PAGE_SHIFT;
+    u32 last = (region.base + (region.size - 1)) >> MEMMAP_PAGE_SHIFT;
+    for (u32 page = first; page <= last; page++)
+    {
+        if (page_region[page] != 0)
+        {
+            printf("ERRO: Memory region %s overlaps %s\n", region.name, regions[page_region[page]].name);
+            return false;
+        }
+    }
+
+    regions[count] = region;
+    for (u32 page = first; page <= last; page++)
+    {
+        page_region[page] = count;
+    }
+    count++;
+    return true;
+}
@@ -1,18 +1,25 @@
 #include "rv32.h"
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
 
 
 RV32::RV32(/* args */)
 {
+    icache = NULL;
+    fastmem = NULL;
 }
 
 RV32::~RV32()
 {
 }
 
-bool RV32::init(u8 *memory, u8 *dtb, bool debug_mode = false)
+bool RV32::init(u8 *memory, u32 memory_size, u8 *dtb_image, bool debug_mode = false)
 {
     // reset clock
     clock = 0;
+    cycle_offset = 0;
+    instret_offset = 0;
     for (u32 i = 0; i < 32; i++)
     {
         xreg[i] = 0;
@@ -20,43 +27,66 @@ bool RV32::init(u8 *memory, u8 *dtb, bool debug_mode = false)
     xreg[0xb] = 0x1020; // For Linux?
     pc = 0x80000000;
     mem = memory;
+    mem_size = memory_size;
+    fault.en = false;
+    tlb.init();
     reservation_en = false;
+    host_input_eof = false;
 
     initCSRs();
+    updateVm();
 
     debug_single_step = debug_mode;
 
-    dtb = dtb;
+    dtb = dtb_image;
+    initMemoryMap();
 
     clint.msip = false;
     clint.mtimecmp_lo = 0;
     clint.mtimecmp_hi = 0;
-    clint.mtime_lo = 0;
-    clint.mtime_hi = 0;
+    clint.mtime_offset = 0;
+    setTimeBase(true, 1);
 
     uart.rbr_thr_ier_iir = 0;
     uart.lcr_mcr_lsr_scr = 0x00200000; // LSR_THR_EMPTY is set
-    uart.thre_ip = false;
-    uart.interrupting = false;
+
+    events.init(clock);
+    events.schedule(EVENT_CLINT, clock);
+    events.schedule(EVENT_UART_RX, clock + UART_RX_POLL);
 
     return true;
 }
 
 void RV32::initCSRs()
 {
+    memset(&csr, 0, sizeof(csr));
+    memset(&csr_other, 0, sizeof(csr_other));
     csr.privilege = PRIV_MACHINE;
-    for (u32 i = 0; i < 4096; i++)
-    {
-        csr.data[i] = 0;
-    }
-    // RV32AIMSU
-    csr.data[CSR_MISA] = 0b01000000000101000001000100000001;
+    irq_pending = false;
+}
+
+// Restarts mtime from zero, following the clock or host time
+void RV32::setTimeBase(bool locked, u32 divisor)
+{
+    time_locked = locked;
+    time_divisor = divisor != 0 ? divisor : 1;
+    host_time_start = hostTime();
+    clint.mtime_offset = 0;
+    events.schedule(EVENT_CLINT, clock);
+}
+
+// Monotonic host time in RV32_TIMEBASE_HZ ticks
+u64 RV32::hostTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * RV32_TIMEBASE_HZ + (u64)ts.tv_nsec * RV32_TIMEBASE_HZ / 1000000000;
 }
 
 void RV32::dump()
 {
     printf("======================================\n");
-    printf("DUMP: CPU state @%d:\n", clock);
+    printf("DUMP: CPU state @%llu:\n", (unsigned long long)clock);
     for (int i = 0; i < 32; i += 4)
     {
         printf("DUMP: .x%02d = %08x  .x%02d = %08x  .%02d = %08x  .%02d = %08x\n",
@@ -92,25 +122,142 @@ bool RV32::hasCsrAccessPrivilege(u32 addr)
     return privilege <= csr.privilege;
 }
 
+// Whether `address` is a CSR this hart implements; any other raises an
+// illegal instruction exception
+bool RV32::csrExists(u32 address)
+{
+    switch (address)
+    {
+    case CSR_SSTATUS:
+    case CSR_SIE:
+    case CSR_SIP:
+    case CSR_MISA:
+    case CSR_CYCLE:
+    case CSR_MCYCLE:
+    case CSR_CYCLEH:
+    case CSR_MCYCLEH:
+    case CSR_INSTRET:
+    case CSR_MINSTRET:
+    case CSR_INSTRETH:
+    case CSR_MINSTRETH:
+    case CSR_TIME:
+    case CSR_TIMEH:
+    case CSR_MVENDORID:
+    case CSR_MARCHID:
+    case CSR_MIMPID:
+    case CSR_MHARTID:
+        return true;
+    }
+
+    // performance counters and events 3 to 31, hardwired to zero
+    u32 n = address & 0x1F;
+    if (n >= 3)
+    {
+        switch (address - n + 3)
+        {
+        case CSR_MHPMCOUNTER3:
+        case CSR_MHPMCOUNTER3H:
+        case CSR_HPMCOUNTER3:
+        case CSR_HPMCOUNTER3H:
+        case CSR_MHPMEVENT3:
+            return true;
+        }
+    }
+
+    return csrSlot(address) != NULL;
+}
+
+// Storage of a CSR that is neither derived from other state nor a view of
+// another one, NULL if it has none (it reads as zero and ignores writes)
+u32 *RV32::csrSlot(u32 address)
+{
+    switch (address)
+    {
+    case CSR_MSTATUS:
+        return &csr.mstatus;
+    case CSR_MIE:
+        return &csr.mie;
+    case CSR_MIP:
+        return &csr.mip;
+    case CSR_MIDELEG:
+        return &csr.mideleg;
+    case CSR_SATP:
+        return &csr.satp;
+    case CSR_MEDELEG:
+        return &csr.medeleg;
+    case CSR_MTVEC:
+        return &csr.mtvec;
+    case CSR_MEPC:
+        return &csr.mepc;
+    case CSR_MCAUSE:
+        return &csr.mcause;
+    case CSR_MTVAL:
+        return &csr.mtval;
+    case CSR_SEDELEG:
+        return &csr.sedeleg;
+    case CSR_SIDELEG:
+        return &csr.sideleg;
+    case CSR_STVEC:
+        return &csr.stvec;
+    case CSR_SEPC:
+        return &csr.sepc;
+    case CSR_SCAUSE:
+        return &csr.scause;
+    case CSR_STVAL:
+        return &csr.stval;
+    case CSR_MSCRATCH:
+        return &csr_other.mscratch;
+    case CSR_SSCRATCH:
+        return &csr_other.sscratch;
+    case CSR_MCOUNTEREN:
+        return &csr_other.mcounteren;
+    case CSR_SCOUNTEREN:
+        return &csr_other.scounteren;
+    case CSR_MCOUNTINHIBIT:
+        return &csr_other.mcountinhibit;
+    }
+
+    if (address >= CSR_PMPCFG0 && address < CSR_PMPCFG0 + PMP_CFG_REGS)
+        return &csr_other.pmpcfg[address - CSR_PMPCFG0];
+    if (address >= CSR_PMPADDR0 && address < CSR_PMPADDR0 + PMP_ADDR_REGS)
+        return &csr_other.pmpaddr[address - CSR_PMPADDR0];
+    return NULL;
+}
+
 // SSTATUS, SIE, and SIP are subsets of MSTATUS, MIE, and MIP
 u32 RV32::readCsrRaw(u32 address)
 {
     switch (address)
     {
     case CSR_SSTATUS:
-        return csr.data[CSR_MSTATUS] & 0x000de162;
+        return csr.mstatus & 0x000de162;
     case CSR_SIE:
-        return csr.data[CSR_MIE] & 0x222;
+        return csr.mie & 0x222;
     case CSR_SIP:
-        return csr.data[CSR_MIP] & 0x222;
+        return csr.mip & 0x222;
     case CSR_CYCLE:
-        return clock;
+    case CSR_MCYCLE:
+        return clock + cycle_offset;
+    case CSR_CYCLEH:
+    case CSR_MCYCLEH:
+        return (clock + cycle_offset) >> 32;
+    case CSR_INSTRET:
+    case CSR_MINSTRET:
+        return clock + instret_offset;
+    case CSR_INSTRETH:
+    case CSR_MINSTRETH:
+        return (clock + instret_offset) >> 32;
     case CSR_TIME:
-        return clint.mtime_lo;
-    case CSR_MHARTID:
-        return 0;
+        return mtime();
+    case CSR_TIMEH:
+        return mtime() >> 32;
+    case CSR_MISA:
+        return RV32_MISA;
     default:
-        return csr.data[address & 0xffff];
+    {
+        u32 *slot = csrSlot(address);
+        return slot != NULL ? *slot : 0;
+    }
     }
 }
 
@@ -119,37 +266,84 @@ void RV32::writeCsrRaw(u32 address, u32 value)
     switch (address)
     {
     case CSR_SSTATUS:
-        csr.data[CSR_MSTATUS] &= !0x000de162;
-        csr.data[CSR_MSTATUS] |= value & 0x000de162;
+        csr.mstatus &= ~0x000de162;
+        csr.mstatus |= value & 0x000de162;
         /* self.mmu.update_mstatus(self.read_csr_raw(CSR_MSTATUS)); */
         break;
     case CSR_SIE:
-        csr.data[CSR_MIE] &= !0x222;
-        csr.data[CSR_MIE] |= value & 0x222;
+        csr.mie &= ~0x222;
+        csr.mie |= value & 0x222;
         break;
     case CSR_SIP:
-        csr.data[CSR_MIP] &= !0x222;
-        csr.data[CSR_MIP] |= value & 0x222;
+        csr.mip &= ~0x222;
+        csr.mip |= value & 0x222;
         break;
     case CSR_MIDELEG:
-        csr.data[address] = value & 0x666; // from qemu
+        csr.mideleg = value & 0x666; // from qemu
         break;
     /* case CSR_MSTATUS: */
-    /*     csr.data[address] = value; */
+    /*     csr.mstatus = value; */
     /*     self.mmu.update_mstatus(self.read_csr_raw(CSR_MSTATUS)); */
     /*     break; */
     case CSR_TIME:
         // ignore writes
         break;
+    case CSR_SATP:
+        // Bare or Sv32, 9 ASID bits
+        csr.satp = value & (SATP_MODE_SV32 | (SATP_ASID_MASK << SATP_ASID_SHIFT) | SATP_PPN_MASK);
+        break;
+    case CSR_MCYCLE:
+        cycle_offset = (((clock + cycle_offset) & 0xffffffff00000000) | value) - clock;
+        break;
+    case CSR_MCYCLEH:
+        cycle_offset = (((u64)value << 32) | (u32)(clock + cycle_offset)) - clock;
+        break;
+    case CSR_MINSTRET:
+        instret_offset = (((clock + instret_offset) & 0xffffffff00000000) | value) - clock;
+        break;
+    case CSR_MINSTRETH:
+        instret_offset = (((u64)value << 32) | (u32)(clock + instret_offset)) - clock;
+        break;
+    case CSR_MIP:
+        csr.mip = value;
+        // msip and the timer are levels, raise them again if still set
+        events.schedule(EVENT_CLINT, clock);
+        break;
     default:
-        csr.data[address] = value;
+    {
+        u32 *slot = csrSlot(address);
+        if (slot != NULL)
+            *slot = value;
         break;
+    }
     };
+
+    switch (address)
+    {
+    case CSR_MSTATUS:
+    case CSR_SSTATUS:
+    case CSR_MIE:
+    case CSR_SIE:
+    case CSR_MIP:
+    case CSR_SIP:
+    case CSR_MIDELEG:
+        updateIrqPending();
+        break;
+    }
+
+    switch (address)
+    {
+    case CSR_MSTATUS:
+    case CSR_SSTATUS:
+    case CSR_SATP:
+        updateVm();
+        break;
+    }
 }
 
 u32 RV32::getCsr(u32 address, ins_ret *ret)
 {
-    if (hasCsrAccessPrivilege(address))
+    if (hasCsrAccessPrivilege(address) && csrExists(address))
     {
         u32 r = readCsrRaw(address);
 #ifdef VERBOSE
@@ -171,7 +365,7 @@ void RV32::setCsr(u32 address, u32 value, ins_ret *ret)
 #ifdef VERBOSE
     printf("CSR write @%03x = %08x\n", address, value);
 #endif
-    if (hasCsrAccessPrivilege(address))
+    if (hasCsrAccessPrivilege(address) && csrExists(address))
     {
         bool read_only = ((address >> 10) & 0x3) == 0x3;
         if (read_only)
@@ -182,12 +376,6 @@ void RV32::setCsr(u32 address, u32 value, ins_ret *ret)
         }
         else
         {
-            if (address == CSR_SATP)
-            {
-                // TODO: update MMU addressing mode
-                printf("WARN: Ignoring write to CSR_SATP\n");
-                return;
-            }
             writeCsrRaw(address, value);
         }
     }
@@ -293,7 +481,8 @@ bool RV32::handleTrap(ins_ret *ret, bool isInterrupt)
     u32 csr_tval_addr = new_privilege == PRIV_MACHINE ? CSR_MTVAL : (new_privilege == PRIV_SUPERVISOR ? CSR_STVAL : CSR_UTVAL);
     u32 csr_tvec_addr = new_privilege == PRIV_MACHINE ? CSR_MTVEC : (new_privilege == PRIV_SUPERVISOR ? CSR_STVEC : CSR_UTVEC);
 
-    writeCsrRaw(csr_epc_addr, pc);
+    // an interrupt is taken between instructions, so it returns to the next one
+    writeCsrRaw(csr_epc_addr, isInterrupt ? ret->pc_val : pc);
     writeCsrRaw(csr_cause_addr, t.type);
     writeCsrRaw(csr_tval_addr, t.value);
     ret->pc_val = readCsrRaw(csr_tvec_addr);
@@ -308,13 +497,13 @@ bool RV32::handleTrap(ins_ret *ret, bool isInterrupt)
     if (new_privilege == PRIV_MACHINE)
     {
         u32 mie = (mstatus >> 3) & 1;
-        u32 new_status = (mstatus & !0x1888) | (mie << 7) | (current_privilege << 11);
+        u32 new_status = (mstatus & ~0x1888) | (mie << 7) | (current_privilege << 11);
         writeCsrRaw(CSR_MSTATUS, new_status);
     }
     else
     { // PRIV_SUPERVISOR
-        u32 sie = (sstatus >> 3) & 1;
-        u32 new_status = (sstatus & !0x122) | (sie << 5) | ((current_privilege & 1) << 8);
+        u32 sie = (sstatus >> 1) & 1;
+        u32 new_status = (sstatus & ~0x122) | (sie << 5) | ((current_privilege & 1) << 8);
         writeCsrRaw(CSR_SSTATUS, new_status);
     }
 
@@ -326,6 +515,34 @@ bool RV32::handleTrap(ins_ret *ret, bool isInterrupt)
     return true;
 }
 
+// Sets irq_pending if an enabled interrupt is pending that the current
+// privilege level and mstatus could take. Interrupts delegated to U-mode and
+// the per-source enables of lower levels are left to handleTrap, so the flag
+// may be set for interrupts that end up ignored, but never missing.
+void RV32::updateIrqPending()
+{
+    u32 pending = csr.mip & csr.mie & MIP_ALL;
+    if (csr.privilege == PRIV_MACHINE)
+    {
+        // only undelegated interrupts preempt M-mode, and only with MIE set
+        if ((csr.mstatus & 0x8) == 0)
+            pending = 0;
+        pending &= ~csr.mideleg;
+    }
+    else if (csr.privilege == PRIV_SUPERVISOR && (csr.mstatus & 0x2) == 0)
+    {
+        // those delegated to S-mode wait for SIE
+        pending &= ~csr.mideleg;
+    }
+    irq_pending = pending != 0;
+}
+
+void RV32::raiseInterrupt(u32 mip)
+{
+    csr.mip |= mip;
+    updateIrqPending();
+}
+
 void RV32::handleIrqAndTrap(ins_ret *ret)
 {
     bool trap = ret->trap.en;
@@ -370,62 +587,328 @@ void RV32::handleIrqAndTrap(ins_ret *ret)
 // Memory Functions
 ///////////////////////////////////////
 // little endian, zero extended
-u32 RV32::memGetByte(u32 addr)
+u32 RV32::memRead(u32 addr, u32 size)
+{
+    return vm_data ? vmRead(addr, size) : physRead(addr, size);
+}
+
+void RV32::memWrite(u32 addr, u32 val, u32 size)
+{
+    if (vm_data)
+        vmWrite(addr, val, size);
+    else
+        physWrite(addr, val, size);
+}
+
+u32 RV32::physRead(u32 addr, u32 size)
 {
-    /* printf("TRACE: memGetByte(%d)\n", addr); */
-    assert(addr & 0x80000000);
-    if (dtb != NULL && addr >= 0x1020 && addr <= 0x1fff)
+    const MemRegion *r = map.find(addr);
+    if ((addr & (size - 1)) == 0)
     {
-        printf("DTB read @%04x/%04x\n", addr, addr - 0x1020);
-        return dtb[addr - 0x1020];
+        // regions are 8 byte aligned, an aligned access is entirely in `r`
+        u32 val = 0;
+        switch (r->type)
+        {
+        case REGION_RAM:
+        case REGION_ROM:
+            memcpy(&val, r->host + (addr - r->base), size);
+            return val;
+        case REGION_MMIO:
+            return r->read(r->device, addr - r->base, size);
+        default:
+            return 0;
+        }
     }
 
-    switch (addr)
+    u32 val = 0;
+    for (u32 i = 0; i < size; i++)
     {
-    // CLINT
-    case 0x02000000:
-        return clint.msip ? 1 : 0;
-    case 0x02000001:
-        return 0;
-    case 0x02000002:
-        return 0;
-    case 0x02000003:
+        val |= physRead(addr + i, 1) << (8 * i);
+    }
+    return val;
+}
+
+void RV32::physWrite(u32 addr, u32 val, u32 size)
+{
+    const MemRegion *r = map.find(addr);
+    if ((addr & (size - 1)) == 0)
+    {
+        switch (r->type)
+        {
+        case REGION_RAM:
+            if (icache != NULL)
+                icache->notifyAlignedWrite(addr, size);
+            memcpy(r->host + (addr - r->base), &val, size);
+            return;
+        case REGION_MMIO:
+            r->write(r->device, addr - r->base, val, size);
+            return;
+        default:
+            return;
+        }
+    }
+
+    for (u32 i = 0; i < size; i++)
+    {
+        physWrite(addr + i, (val >> (8 * i)) & 0xFF, 1);
+    }
+}
+
+///////////////////////////////////////
+// Sv32
+///////////////////////////////////////
+// Recomputes what is translated after a change to satp, mstatus or the
+// privilege level. Loads and stores use the privilege in MPP while MPRV is
+// set in M-mode.
+void RV32::updateVm()
+{
+    bool sv32 = (csr.satp & SATP_MODE_SV32) != 0;
+    u32 data_privilege = csr.privilege;
+    if (csr.privilege == PRIV_MACHINE && (csr.mstatus & MSTATUS_MPRV) != 0)
+        data_privilege = (csr.mstatus >> 11) & 0x3;
+
+    vm_fetch = sv32 && csr.privilege != PRIV_MACHINE;
+    vm_data = sv32 && data_privilege != PRIV_MACHINE;
+    direct_size = vm_data ? 0 : mem_size;
+    fast_base = vm_data ? NULL : fastmem;
+
+    u32 asid = ((csr.satp >> SATP_ASID_SHIFT) & SATP_ASID_MASK) << TLB_KEY_ASID_SHIFT;
+    fetch_context = asid | (csr.privilege == PRIV_USER ? TLB_KEY_USER : 0);
+    data_context = asid | (data_privilege == PRIV_USER ? TLB_KEY_USER : 0);
+    // SUM does not apply to U-mode, which keeps TLB_NO_MATCH from being a key
+    if (data_privilege != PRIV_USER && (csr.mstatus & MSTATUS_SUM) != 0)
+        data_context |= TLB_KEY_SUM;
+    if ((csr.mstatus & MSTATUS_MXR) != 0)
+        data_context |= TLB_KEY_MXR;
+
+    vm_space = vm_fetch ? VM_SPACE_FETCH | VM_SPACE_DATA | fetch_context : vm_data ? VM_SPACE_DATA : 0;
+}
+
+void RV32::pageFault(u32 vaddr, MemAccess access)
+{
+    // the first one of a split access is the one reported
+    if (fault.en)
+        return;
+    fault.en = true;
+    fault.irq = false;
+    fault.type = access == ACCESS_FETCH  ? trap_InstructionPageFault
+                 : access == ACCESS_LOAD ? trap_LoadPageFault
+                                         : trap_StorePageFault;
+    fault.value = vaddr;
+}
+
+// Whether a leaf PTE allows an access in `context`
+static bool pteAllows(u32 pte, MemAccess access, u32 context)
+{
+    bool user = (context & TLB_KEY_USER) != 0;
+    if ((pte & PTE_U) != 0)
+    {
+        // S-mode reaches U pages with SUM set, but never runs code from them
+        if (!user && (access == ACCESS_FETCH || (context & TLB_KEY_SUM) == 0))
+            return false;
+    }
+    else if (user)
+    {
+        return false;
+    }
+    switch (access)
+    {
+    case ACCESS_FETCH:
+        return (pte & PTE_X) != 0;
+    case ACCESS_LOAD:
+        return (pte & PTE_R) != 0 || ((context & TLB_KEY_MXR) != 0 && (pte & PTE_X) != 0);
+    default:
+        return (pte & PTE_W) != 0;
+    }
+}
+
+// Walks the page table for an access to `vaddr` and fills `e` with the
+// mapping, setting A (and D for stores) in the PTE. False if it faults.
+bool RV32::walk(u32 vaddr, MemAccess access, TlbEntry *e)
+{
+    u32 context = access == ACCESS_FETCH ? fetch_context : data_context;
+    u32 table = (csr.satp & SATP_PPN_MASK) << MMU_PAGE_SHIFT;
+    for (int level = 1; level >= 0; level--)
+    {
+        u32 pte_addr = table + ((vaddr >> (MMU_PAGE_SHIFT + 10 * level)) & 0x3FF) * 4;
+        u32 pte = physRead(pte_addr, 4);
+        if ((pte & PTE_V) == 0 || ((pte & PTE_R) == 0 && (pte & PTE_W) != 0))
+            return false;
+        u32 ppn = pte >> 10;
+        if ((pte & (PTE_R | PTE_X)) == 0)
+        {
+            // pointer to the next level
+            table = ppn << MMU_PAGE_SHIFT;
+            continue;
+        }
+
+        // a megapage must be aligned to 4MiB
+        if (level == 1 && (ppn & 0x3FF) != 0)
+            return false;
+        if (!pteAllows(pte, access, context))
+            return false;
+        u32 updated = pte | PTE_A | (access == ACCESS_STORE ? PTE_D : 0);
+        if (updated != pte)
+        {
+            pte = updated;
+            physWrite(pte_addr, pte, 4);
+        }
+
+        e->span = level == 1 ? MMU_MEGAPAGE_MASK : MMU_PAGE_MASK;
+        e->vaddr = vaddr & MMU_PAGE_MASK;
+        e->paddr = (ppn << MMU_PAGE_SHIFT) | (vaddr & ~e->span & MMU_PAGE_MASK);
+        e->asid = (csr.satp >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+        e->global = (pte & PTE_G) != 0;
+        const MemRegion *r = map.find(e->paddr);
+        e->host = r->type == REGION_RAM ? r->host + (e->paddr - r->base) : NULL;
+
+        // what else the mapping allows right away in the current contexts;
+        // stores wait for the walk that sets D
+        e->tag[ACCESS_FETCH] = vm_fetch && pteAllows(pte, ACCESS_FETCH, fetch_context)
+                                   ? tlbKey(vaddr, fetch_context) : TLB_NO_MATCH;
+        e->tag[ACCESS_LOAD] = vm_data && pteAllows(pte, ACCESS_LOAD, data_context)
+                                  ? tlbKey(vaddr, data_context) : TLB_NO_MATCH;
+        e->tag[ACCESS_STORE] = vm_data && (pte & PTE_D) != 0 && pteAllows(pte, ACCESS_STORE, data_context)
+                                   ? tlbKey(vaddr, data_context) : TLB_NO_MATCH;
+        return true;
+    }
+    return false;
+}
+
+// The TLB entry mapping `vaddr` for `access`, walking the page table on a
+// miss. NULL, with `fault` set, if the access page faults.
+TlbEntry *RV32::translate(u32 vaddr, MemAccess access)
+{
+    TlbEntry *e = tlb.slot(vaddr);
+    u32 context = access == ACCESS_FETCH ? fetch_context : data_context;
+    if (e->tag[access] == tlbKey(vaddr, context))
+    {
+        tlb.hits++;
+        return e;
+    }
+    tlb.misses++;
+    if (!walk(vaddr, access, e))
+    {
+        // the entry may have been refilled halfway, drop it
+        e->tag[ACCESS_FETCH] = TLB_NO_MATCH;
+        e->tag[ACCESS_LOAD] = TLB_NO_MATCH;
+        e->tag[ACCESS_STORE] = TLB_NO_MATCH;
+        pageFault(vaddr, access);
+        return NULL;
+    }
+    return e;
+}
+
+u32 RV32::vmRead(u32 vaddr, u32 size)
+{
+    u32 offset = vaddr & ~MMU_PAGE_MASK;
+    if (offset + size > MMU_PAGE_SIZE)
+    {
+        // crosses into the next page, which is translated on its own
+        u32 val = 0;
+        for (u32 i = 0; i < size; i++)
+        {
+            val |= vmRead(vaddr + i, 1) << (8 * i);
+        }
+        return val;
+    }
+
+    TlbEntry *e = translate(vaddr, ACCESS_LOAD);
+    if (e == NULL)
         return 0;
-    case 0x02004000:
-        return (clint.mtimecmp_lo >> 0) & 0xFF;
-    case 0x02004001:
-        return (clint.mtimecmp_lo >> 8) & 0xFF;
-    case 0x02004002:
-        return (clint.mtimecmp_lo >> 16) & 0xFF;
-    case 0x02004003:
-        return (clint.mtimecmp_lo >> 24) & 0xFF;
-    case 0x02004004:
-        return (clint.mtimecmp_hi >> 0) & 0xFF;
-    case 0x02004005:
-        return (clint.mtimecmp_hi >> 8) & 0xFF;
-    case 0x02004006:
-        return (clint.mtimecmp_hi >> 16) & 0xFF;
-    case 0x02004007:
-        return (clint.mtimecmp_hi >> 24) & 0xFF;
-    case 0x0200bff8:
-        return (clint.mtime_lo >> 0) & 0xFF;
-    case 0x0200bff9:
-        return (clint.mtime_lo >> 8) & 0xFF;
-    case 0x0200bffa:
-        return (clint.mtime_lo >> 16) & 0xFF;
-    case 0x0200bffb:
-        return (clint.mtime_lo >> 24) & 0xFF;
-    case 0x0200bffc:
-        return (clint.mtime_hi >> 0) & 0xFF;
-    case 0x0200bffd:
-        return (clint.mtime_hi >> 8) & 0xFF;
-    case 0x0200bffe:
-        return (clint.mtime_hi >> 16) & 0xFF;
-    case 0x0200bfff:
-        return (clint.mtime_hi >> 24) & 0xFF;
-
-    // UART (first has rbr_thr_ier_iir, second has lcr_mcr_lsr_scr)
-    case 0x10000000:
+    if (e->host != NULL)
+    {
+        u32 val = 0;
+        memcpy(&val, e->host + offset, size);
+        return val;
+    }
+    return physRead(e->paddr | offset, size);
+}
+
+void RV32::vmWrite(u32 vaddr, u32 val, u32 size)
+{
+    u32 offset = vaddr & ~MMU_PAGE_MASK;
+    if (offset + size > MMU_PAGE_SIZE)
+    {
+        for (u32 i = 0; i < size && !fault.en; i++)
+        {
+            vmWrite(vaddr + i, (val >> (8 * i)) & 0xFF, 1);
+        }
+        return;
+    }
+
+    TlbEntry *e = translate(vaddr, ACCESS_STORE);
+    if (e == NULL)
+        return;
+    if (e->host != NULL && (offset & (size - 1)) == 0)
+    {
+        if (icache != NULL)
+            icache->notifyAlignedWrite(e->paddr | offset, size);
+        memcpy(e->host + offset, &val, size);
+        return;
+    }
+    physWrite(e->paddr | offset, val, size);
+}
+
+static u32 mmioClintRead(void *device, u32 offset, u32 size)
+{
+    return ((RV32 *)device)->clintRead(offset, size);
+}
+
+static void mmioClintWrite(void *device, u32 offset, u32 val, u32 size)
+{
+    ((RV32 *)device)->clintWrite(offset, val, size);
+}
+
+static u32 mmioUartRead(void *device, u32 offset, u32 size)
+{
+    return ((RV32 *)device)->uartRead(offset, size);
+}
+
+static void mmioUartWrite(void *device, u32 offset, u32 val, u32 size)
+{
+    ((RV32 *)device)->uartWrite(offset, val, size);
+}
+
+void RV32::initMemoryMap()
+{
+    map.init();
+    map.addRam("ram", RAM_BASE, mem_size, mem);
+    if (dtb != NULL)
+        map.addRom("dtb", DTB_BASE, DTB_SIZE, dtb);
+    map.addMmio("clint", CLINT_BASE, CLINT_SIZE, this, mmioClintRead, mmioClintWrite);
+    map.addMmio("uart", UART_BASE, UART_SIZE, this, mmioUartRead, mmioUartWrite);
+}
+
+///////////////////////////////////////
+// UART Functions
+///////////////////////////////////////
+// Byte registers (RBR/THR, IER, IIR, LCR, MCR, LSR, SCR); wider accesses
+// cover the neighbouring ones
+u32 RV32::uartRead(u32 offset, u32 size)
+{
+    u32 val = 0;
+    for (u32 i = 0; i < size; i++)
+    {
+        val |= uartReadByte(offset + i) << (8 * i);
+    }
+    return val;
+}
+
+void RV32::uartWrite(u32 offset, u32 val, u32 size)
+{
+    for (u32 i = 0; i < size; i++)
+    {
+        uartWriteByte(offset + i, (val >> (8 * i)) & 0xFF);
+    }
+}
+
+// (first has rbr_thr_ier_iir, second has lcr_mcr_lsr_scr)
+u32 RV32::uartReadByte(u32 offset)
+{
+    switch (offset)
+    {
+    case 0:
         if ((UART_GET2(LCR) >> 7) == 0)
         {
             u32 rbr = UART_GET1(RBR);
@@ -438,210 +921,301 @@ u32 RV32::memGetByte(u32 addr)
         {
             return 0;
         }
-    case 0x10000001:
+    case 1:
         return UART_GET2(LCR) >> 7 == 0 ? UART_GET1(IER) : 0;
-    case 0x10000002:
+    case 2:
         return UART_GET1(IIR);
-    case 0x10000003:
+    case 3:
         return UART_GET2(LCR);
-    case 0x10000004:
+    case 4:
         return UART_GET2(MCR);
-    case 0x10000005:
+    case 5:
         return UART_GET2(LSR);
-    case 0x10000007:
+    case 7:
         return UART_GET2(SCR);
     }
-
-    if ((addr & 0x80000000) == 0)
-    {
-        return 0;
-    }
-    return mem[addr & 0x7FFFFFFF];
+    return 0;
 }
 
-u32 RV32::memGetHalfWord(u32 addr)
+void RV32::uartWriteByte(u32 offset, u32 val)
 {
-    return memGetByte(addr) | ((uint16_t)memGetByte(addr + 1) << 8);
-}
-
-u32 RV32::memGetWord(u32 addr)
-{
-    return memGetByte(addr) |
-           ((uint16_t)memGetByte(addr + 1) << 8) |
-           ((uint16_t)memGetByte(addr + 2) << 16) |
-           ((uint16_t)memGetByte(addr + 3) << 24);
-}
-
-void RV32::memSetByte(u32 addr, u32 val)
-{
-    assert(addr & 0x80000000);
-    switch (addr)
+    switch (offset)
     {
-    // CLINT
-    case 0x02000000:
-        clint.msip = (val & 1) != 0;
-        return;
-    case 0x02000001:
-        return;
-    case 0x02000002:
-        return;
-    case 0x02000003:
-        return;
-
-    case 0x02004000:
-        clint.mtimecmp_lo = (clint.mtimecmp_lo & ~(0xff << 0)) | (val << 0);
-        return;
-    case 0x02004001:
-        clint.mtimecmp_lo = (clint.mtimecmp_lo & ~(0xff << 8)) | (val << 8);
-        return;
-    case 0x02004002:
-        clint.mtimecmp_lo = (clint.mtimecmp_lo & ~(0xff << 16)) | (val << 16);
-        return;
-    case 0x02004003:
-        clint.mtimecmp_lo = (clint.mtimecmp_lo & ~(0xff << 24)) | (val << 24);
-        return;
-    case 0x02004004:
-        clint.mtimecmp_hi = (clint.mtimecmp_hi & ~(0xff << 0)) | (val << 0);
-        return;
-    case 0x02004005:
-        clint.mtimecmp_hi = (clint.mtimecmp_hi & ~(0xff << 8)) | (val << 8);
-        return;
-    case 0x02004006:
-        clint.mtimecmp_hi = (clint.mtimecmp_hi & ~(0xff << 16)) | (val << 16);
-        return;
-    case 0x02004007:
-        clint.mtimecmp_hi = (clint.mtimecmp_hi & ~(0xff << 24)) | (val << 24);
-        return;
-
-    case 0x0200bff8:
-        clint.mtime_lo = (clint.mtime_lo & ~(0xff << 0)) | (val << 0);
-        return;
-    case 0x0200bff9:
-        clint.mtime_lo = (clint.mtime_lo & ~(0xff << 8)) | (val << 8);
-        return;
-    case 0x0200bffa:
-        clint.mtime_lo = (clint.mtime_lo & ~(0xff << 16)) | (val << 16);
-        return;
-    case 0x0200bffb:
-        clint.mtime_lo = (clint.mtime_lo & ~(0xff << 24)) | (val << 24);
-        return;
-    case 0x0200bffc:
-        clint.mtime_hi = (clint.mtime_hi & ~(0xff << 0)) | (val << 0);
-        return;
-    case 0x0200bffd:
-        clint.mtime_hi = (clint.mtime_hi & ~(0xff << 8)) | (val << 8);
-        return;
-    case 0x0200bffe:
-        clint.mtime_hi = (clint.mtime_hi & ~(0xff << 16)) | (val << 16);
-        return;
-    case 0x0200bfff:
-        clint.mtime_hi = (clint.mtime_hi & ~(0xff << 24)) | (val << 24);
-        return;
-
-    // UART (first has rbr_thr_ier_iir, second has lcr_mcr_lsr_scr)
-    case 0x10000000:
+    case 0:
         if ((UART_GET2(LCR) >> 7) == 0)
         {
             UART_SET1(THR, val);
             UART_SET2(LSR, (UART_GET2(LSR) & ~LSR_THR_EMPTY));
             uartUpdateIir();
+            // drains at the next clock value with none of the 0x16 bits set
+            u64 drain = clock;
+            while ((drain & 0x16) != 0)
+            {
+                drain++;
+            }
+            events.schedule(EVENT_UART_TX, drain);
         }
         return;
-    case 0x10000001:
+    case 1:
         if (UART_GET2(LCR) >> 7 == 0)
         {
             if ((UART_GET1(IER) & IER_THREINT_BIT) == 0 &&
                 (val & IER_THREINT_BIT) != 0 &&
                 UART_GET1(THR) == 0)
             {
-                uart.thre_ip = true;
+                uartInterrupt();
             }
             UART_SET1(IER, val);
             uartUpdateIir();
         }
         return;
-    case 0x10000003:
+    case 3:
         UART_SET2(LCR, val);
         return;
-    case 0x10000004:
+    case 4:
         UART_SET2(MCR, val);
         return;
-    case 0x10000007:
+    case 7:
         UART_SET2(SCR, val);
         return;
     }
-
-    if ((addr & 0x80000000) == 0)
-    {
-        return;
-    }
-
-    mem[addr & 0x7FFFFFFF] = val;
 }
 
-void RV32::memSetHalfWord(u32 addr, u32 val)
+void RV32::uartUpdateIir()
 {
-    memSetByte(addr, val & 0xFF);
-    memSetByte(addr + 1, (val >> 8) & 0xFF);
+    bool rx_ip = (UART_GET1(IER) & IER_RXINT_BIT) != 0 && UART_GET1(RBR) != 0;
+    bool thre_ip = (UART_GET1(IER) & IER_THREINT_BIT) != 0 && UART_GET1(THR) == 0;
+    UART_SET1(IIR, (rx_ip ? IIR_RD_AVAILABLE : (thre_ip ? IIR_THR_EMPTY : IIR_NO_INTERRUPT)));
 }
 
-void RV32::memSetWord(u32 addr, u32 val)
+void RV32::uartInterrupt()
 {
-    memSetByte(addr, val & 0xFF);
-    memSetByte(addr + 1, (val >> 8) & 0xFF);
-    memSetByte(addr + 2, (val >> 16) & 0xFF);
-    memSetByte(addr + 3, val >> 24);
+    raiseInterrupt(MIP_SEIP);
 }
 
-///////////////////////////////////////
-// UART Functions
-///////////////////////////////////////
-void RV32::uartUpdateIir()
+void RV32::uartTxEvent()
 {
-    bool rx_ip = (UART_GET1(IER) & IER_RXINT_BIT) != 0 && UART_GET1(RBR) != 0;
-    bool thre_ip = (UART_GET1(IER) & IER_THREINT_BIT) != 0 && UART_GET1(THR) == 0;
-    UART_SET1(IIR, (rx_ip ? IIR_RD_AVAILABLE : (thre_ip ? IIR_THR_EMPTY : IIR_NO_INTERRUPT)));
+    if (UART_GET1(THR) == 0)
+        return;
+
+    printf("%c", (char)UART_GET1(THR));
+    UART_SET1(THR, 0);
+    UART_SET2(LSR, (UART_GET2(LSR) | LSR_THR_EMPTY));
+    uartUpdateIir();
+    if ((UART_GET1(IER) & IER_THREINT_BIT) != 0)
+    {
+        uartInterrupt();
+    }
 }
 
-void RV32::uartTick()
+void RV32::uartRxEvent()
 {
-    bool rx_ip = false;
-
-    if ((clock % 0x38400) == 0 && UART_GET1(RBR) == 0)
+    if (UART_GET1(RBR) == 0 && hostInputWait(0))
     {
-        u32 value = 0; // TODO: Add actual input logic
-        if (value != 0)
+        u8 value = 0;
+        if (read(STDIN_FILENO, &value, 1) != 1)
+        {
+            host_input_eof = true;
+        }
+        else if (value != 0)
         {
             UART_SET1(RBR, value);
             UART_SET2(LSR, (UART_GET2(LSR) | LSR_DATA_AVAILABLE));
             uartUpdateIir();
             if ((UART_GET1(IER) & IER_RXINT_BIT) != 0)
             {
-                rx_ip = true;
+                uartInterrupt();
             }
         }
     }
 
-    u32 thr = UART_GET1(THR);
-    if ((clock & 0x16) == 0 && thr != 0)
+    events.schedule(EVENT_UART_RX, clock + UART_RX_POLL - clock % UART_RX_POLL);
+}
+
+// Waits up to `timeout_ms` for input on stdin, returns whether there is some
+bool RV32::hostInputWait(int timeout_ms)
+{
+    if (host_input_eof)
+    {
+        if (timeout_ms != 0)
+            poll(NULL, 0, timeout_ms);
+        return false;
+    }
+    struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&fd, 1, timeout_ms) > 0;
+}
+
+///////////////////////////////////////
+// WFI
+///////////////////////////////////////
+// Nothing but a device event can raise an interrupt while the hart waits,
+// so the clock jumps straight to the next one. instret does not count the
+// skipped instructions. Receiver polls find nothing while no input is
+// waiting, so with the timer armed the jump goes past them to the next
+// other event, normally the mtimecmp deadline. Otherwise only input can
+// wake the hart: the host sleeps until some arrives or WFI_HOST_SLEEP_MS
+// pass, which keeps an idle guest from spinning through receiver polls.
+//
+// In real-time mode the mtimecmp deadline is in host time, so instead the
+// host sleeps towards it, again for at most WFI_HOST_SLEEP_MS, unless the
+// transmitter still has a byte to drain.
+void RV32::waitForInterrupt()
+{
+    if ((csr.mip & csr.mie) != 0)
+        return;
+
+    bool timer_wakes = (csr.mie & MIP_MTIP) != 0 && clint.mtimecmp_lo != 0 && clint.mtimecmp_hi != 0;
+    if (timer_wakes && !time_locked)
     {
-        printf("%c", (char)thr);
-        UART_SET1(THR, 0);
-        UART_SET2(LSR, (UART_GET2(LSR) | LSR_THR_EMPTY));
-        uartUpdateIir();
-        if ((UART_GET1(IER) & IER_THREINT_BIT) != 0)
+        if (events.armed[EVENT_UART_TX] || UART_GET1(RBR) != 0)
+            return;
+        u64 now = mtime();
+        u64 mtimecmp = ((u64)clint.mtimecmp_hi << 32) | clint.mtimecmp_lo;
+        if (now < mtimecmp)
         {
-            uart.thre_ip = true;
+            u64 left = mtimecmp - now;
+            u64 ms = WFI_HOST_SLEEP_MS;
+            if (left < RV32_TIMEBASE_HZ)
+            {
+                u64 needed = (left * time_divisor * 1000 + RV32_TIMEBASE_HZ - 1) / RV32_TIMEBASE_HZ;
+                if (needed < ms)
+                    ms = needed;
+            }
+            if (hostInputWait((int)ms))
+                events.schedule(EVENT_UART_RX, clock);
         }
+        events.schedule(EVENT_CLINT, clock);
+        return;
     }
 
-    if (uart.thre_ip || rx_ip)
+    u64 wake = events.next;
+    if (!timer_wakes)
+        hostInputWait(WFI_HOST_SLEEP_MS);
+    else if (UART_GET1(RBR) != 0 || !hostInputWait(0))
+        wake = events.nextExcept(EVENT_UART_RX, clock);
+
+    if (wake > clock)
     {
-        uart.interrupting = true;
-        uart.thre_ip = false;
+        instret_offset -= wake - clock;
+        clock = wake;
     }
-    else
+}
+
+///////////////////////////////////////
+// CLINT Functions
+///////////////////////////////////////
+// msip, mtimecmp and mtime, each in an 8 byte slot; the rest reads as zero
+u32 RV32::clintRead(u32 offset, u32 size)
+{
+    u64 reg;
+    switch (offset & ~0x7)
+    {
+    case CLINT_MSIP:
+        reg = clint.msip ? 1 : 0;
+        break;
+    case CLINT_MTIMECMP:
+        reg = ((u64)clint.mtimecmp_hi << 32) | clint.mtimecmp_lo;
+        break;
+    case CLINT_MTIME:
+        reg = mtime();
+        break;
+    default:
+        return 0;
+    }
+    u32 shift = 8 * (offset & 0x7);
+    return (reg >> shift) & (0xFFFFFFFF >> (32 - 8 * size));
+}
+
+void RV32::clintWrite(u32 offset, u32 val, u32 size)
+{
+    u32 shift = 8 * (offset & 0x7);
+    u64 mask = (u64)(0xFFFFFFFF >> (32 - 8 * size)) << shift;
+    u64 bits = ((u64)val << shift) & mask;
+    switch (offset & ~0x7)
+    {
+    case CLINT_MSIP:
+        // only bit 0 of the first byte is implemented
+        if (shift != 0)
+            return;
+        clint.msip = (val & 1) != 0;
+        break;
+    case CLINT_MTIMECMP:
+    {
+        u64 mtimecmp = ((u64)clint.mtimecmp_hi << 32) | clint.mtimecmp_lo;
+        mtimecmp = (mtimecmp & ~mask) | bits;
+        clint.mtimecmp_lo = (u32)mtimecmp;
+        clint.mtimecmp_hi = (u32)(mtimecmp >> 32);
+        break;
+    }
+    case CLINT_MTIME:
+        clint.mtime_offset = ((mtime() & ~mask) | bits) - timeBase();
+        break;
+    default:
+        return;
+    }
+    events.schedule(EVENT_CLINT, clock);
+}
+
+// Raises MSIP and MTIP, then sleeps until mtime reaches mtimecmp. Writes to
+// the CLINT and to MIP run it again right away. In real-time mode the clock
+// does not tell when that is, so it checks every CLINT_REALTIME_POLL ticks.
+void RV32::clintEvent()
+{
+    if (clint.msip)
+    {
+        raiseInterrupt(MIP_MSIP);
+    }
+
+    u64 delay = EVENT_MAX_DELAY;
+    if (clint.mtimecmp_lo != 0 && clint.mtimecmp_hi != 0)
+    {
+        u64 now = mtime();
+        u64 mtimecmp = ((u64)clint.mtimecmp_hi << 32) | clint.mtimecmp_lo;
+        if (now >= mtimecmp)
+        {
+            raiseInterrupt(MIP_MTIP);
+        }
+        else if (!time_locked)
+        {
+            delay = CLINT_REALTIME_POLL;
+        }
+        else
+        {
+            // clock ticks until timeBase() reaches the deadline, none if the
+            // clock would wrap first
+            u64 deadline = mtimecmp - clint.mtime_offset;
+            if (deadline <= (UINT64_MAX - clock) / time_divisor)
+            {
+                u64 due = deadline * time_divisor - clock;
+                if (due < delay)
+                    delay = due;
+            }
+        }
+    }
+    events.schedule(EVENT_CLINT, clock + delay);
+}
+
+///////////////////////////////////////
+// Device Events
+///////////////////////////////////////
+void RV32::runEvents()
+{
+    DeviceEvent e;
+    while ((e = events.pop(clock)) != EVENT_COUNT)
     {
-        uart.interrupting = false;
+        switch (e)
+        {
+        case EVENT_CLINT:
+            clintEvent();
+            break;
+        case EVENT_UART_TX:
+            uartTxEvent();
+            break;
+        case EVENT_UART_RX:
+            uartRxEvent();
+            break;
+        default:
+            break;
+        }
     }
 }
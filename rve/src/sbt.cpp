@@ -0,0 +1,311 @@
+#include "stdio.h"
+#include <algorithm>
+#include <set>
+#include <string>
+#include <stdarg.h>
+#include "emu.h"
+#include "instructions.h"
+
+// rve-sbt: ahead-of-time translator for bare-metal images, see sbt.h.
+// Writes the C++ source of a translation; make aot builds it into the
+// shared object rve and rve-cli load with -a.
+
+static void showHelp()
+{
+    printf("./rve-sbt [elf binary] [output c++ file]\n");
+}
+
+// First instruction of each fused pair, which is what gets translated
+#define fused_first(name, first) INS_##first,
+static const u32 fused_first_op[FUSED_COUNT] = {RV32_FUSIONS(fused_first)};
+#undef fused_first
+
+static std::string format(const char *fmt, ...)
+{
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    return buf;
+}
+
+// x[rd] = value; writes to x0 are dropped
+static std::string write(u32 rd, const std::string &value)
+{
+    if (rd == 0)
+        return "";
+    return format("    x[%u] = %s;\n", rd, value.c_str());
+}
+
+// Appends the statements of the leading instructions of `b` the JIT would
+// translate as well to `body`. Returns how many there are.
+static u32 translateBlock(BasicBlock *b, std::string &body)
+{
+    u32 pc = b->start_pc;
+    u32 i;
+    for (i = 0; i < b->len; pc += b->ops[i].len, i++)
+    {
+        DecodedIns d = b->ops[i];
+        if (d.op >= FUSED_FIRST)
+        {
+            // the second half keeps its own slot
+            d.op = fused_first_op[d.op - FUSED_FIRST];
+        }
+        const FormatR &r = d.ins_FormatR;
+        const FormatI &im = d.ins_FormatI;
+        const FormatS &s = d.ins_FormatS;
+        const FormatB &br = d.ins_FormatB;
+        u32 shamt = (d.ins_word >> 20) & 0x1F;
+        std::string a = format("x[%u]", r.rs1);
+        std::string rs2 = format("x[%u]", r.rs2);
+        std::string addr = format("x[%u] + 0x%08xu", im.rs1, im.imm);
+
+        switch (d.op)
+        {
+        // Upper immediates
+        case INS_lui:
+            body += write(d.ins_FormatU.rd, format("0x%08xu", d.ins_FormatU.imm));
+            break;
+        case INS_auipc:
+            body += write(d.ins_FormatU.rd, format("0x%08xu", pc + d.ins_FormatU.imm));
+            break;
+
+        // Register-immediate
+        case INS_addi:
+            body += write(im.rd, format("x[%u] + 0x%08xu", im.rs1, im.imm));
+            break;
+        case INS_andi:
+            body += write(im.rd, format("x[%u] & 0x%08xu", im.rs1, im.imm));
+            break;
+        case INS_ori:
+            body += write(im.rd, format("x[%u] | 0x%08xu", im.rs1, im.imm));
+            break;
+        case INS_xori:
+            body += write(im.rd, format("x[%u] ^ 0x%08xu", im.rs1, im.imm));
+            break;
+        case INS_slti:
+            body += write(im.rd, format("(s32)x[%u] < (s32)0x%08xu", im.rs1, im.imm));
+            break;
+        case INS_sltiu:
+            body += write(im.rd, format("x[%u] < 0x%08xu", im.rs1, im.imm));
+            break;
+        case INS_slli:
+            body += write(r.rd, format("%s << %u", a.c_str(), shamt));
+            break;
+        case INS_srli:
+            body += write(r.rd, format("%s >> %u", a.c_str(), shamt));
+            break;
+        case INS_srai:
+            body += write(r.rd, format("(u32)((s32)%s >> %u)", a.c_str(), shamt));
+            break;
+
+        // Register-register
+        case INS_add:
+            body += write(r.rd, a + " + " + rs2);
+            break;
+        case INS_sub:
+            body += write(r.rd, a + " - " + rs2);
+            break;
+        case INS_and:
+            body += write(r.rd, a + " & " + rs2);
+            break;
+        case INS_or:
+            body += write(r.rd, a + " | " + rs2);
+            break;
+        case INS_xor:
+            body += write(r.rd, a + " ^ " + rs2);
+            break;
+        case INS_slt:
+            body += write(r.rd, "(s32)" + a + " < (s32)" + rs2);
+            break;
+        case INS_sltu:
+            body += write(r.rd, a + " < " + rs2);
+            break;
+        case INS_sll:
+            body += write(r.rd, a + " << (" + rs2 + " & 31)");
+            break;
+        case INS_srl:
+            body += write(r.rd, a + " >> (" + rs2 + " & 31)");
+            break;
+        case INS_sra:
+            body += write(r.rd, "(u32)((s32)" + a + " >> (" + rs2 + " & 31))");
+            break;
+        case INS_mul:
+            body += write(r.rd, a + " * " + rs2);
+            break;
+        case INS_mulh:
+            body += write(r.rd, "(u32)(((s64)(s32)" + a + " * (s64)(s32)" + rs2 + ") >> 32)");
+            break;
+        case INS_mulhsu:
+            body += write(r.rd, "(u32)(((s64)(s32)" + a + " * (s64)" + rs2 + ") >> 32)");
+            break;
+        case INS_mulhu:
+            body += write(r.rd, "(u32)(((u64)" + a + " * " + rs2 + ") >> 32)");
+            break;
+        case INS_div:
+            body += write(r.rd, "sbtDiv(" + a + ", " + rs2 + ")");
+            break;
+        case INS_divu:
+            body += write(r.rd, "sbtDivu(" + a + ", " + rs2 + ")");
+            break;
+        case INS_rem:
+            body += write(r.rd, "sbtRem(" + a + ", " + rs2 + ")");
+            break;
+        case INS_remu:
+            body += write(r.rd, "sbtRemu(" + a + ", " + rs2 + ")");
+            break;
+
+        // Loads, done for rd == 0 as well for MMIO reads
+        case INS_lb:
+        case INS_lbu:
+        case INS_lh:
+        case INS_lhu:
+        case INS_lw:
+        {
+            u32 size = (d.op == INS_lw) ? 4 : (d.op == INS_lh || d.op == INS_lhu) ? 2 : 1;
+            std::string load = format("sbtLoad(c, %s, %u)", addr.c_str(), size);
+            if (d.op == INS_lb)
+                load = "(u32)(s8)" + load;
+            else if (d.op == INS_lh)
+                load = "(u32)(s16)" + load;
+            body += im.rd == 0 ? "    " + load + ";\n" : write(im.rd, load);
+            break;
+        }
+
+        // Stores
+        case INS_sb:
+        case INS_sh:
+        case INS_sw:
+        {
+            u32 size = d.op == INS_sw ? 4 : d.op == INS_sh ? 2 : 1;
+            body += format("    sbtStore(c, x[%u] + 0x%08xu, x[%u], %u);\n", s.rs1, s.imm, s.rs2, size);
+            break;
+        }
+
+        case INS_fence:
+            break;
+
+        // Block terminators
+        case INS_beq:
+        case INS_bne:
+        case INS_blt:
+        case INS_bge:
+        case INS_bltu:
+        case INS_bgeu:
+        {
+            const char *cond = d.op == INS_beq ? "x[%u] == x[%u]" : d.op == INS_bne ? "x[%u] != x[%u]"
+                             : d.op == INS_blt ? "(s32)x[%u] < (s32)x[%u]" : d.op == INS_bge ? "(s32)x[%u] >= (s32)x[%u]"
+                             : d.op == INS_bltu ? "x[%u] < x[%u]" : "x[%u] >= x[%u]";
+            body += "    *c->pc = " + format(cond, br.rs1, br.rs2) +
+                    format(" ? 0x%08xu : 0x%08xu;\n", b->taken_pc, b->fall_pc);
+            return i + 1;
+        }
+        case INS_jal:
+            body += write(d.ins_FormatJ.rd, format("0x%08xu", pc + d.len));
+            body += format("    *c->pc = 0x%08xu;\n", b->taken_pc);
+            return i + 1;
+        case INS_jalr:
+            // target first, rd may be rs1
+            body += format("    u32 target = (x[%u] + 0x%08xu) & ~1u;\n", im.rs1, im.imm);
+            body += write(im.rd, format("0x%08xu", pc + d.len));
+            body += "    *c->pc = target;\n";
+            return i + 1;
+
+        default:
+            // not translated, the interpreter takes over from here
+            body += format("    *c->pc = 0x%08xu;\n", pc);
+            return i;
+        }
+    }
+
+    // block ended at a page boundary or its size limit
+    body += format("    *c->pc = 0x%08xu;\n", b->fall_pc);
+    return i;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        showHelp();
+        return 1;
+    }
+    const char *elf_file_name = argv[1];
+    const char *out_file_name = argv[2];
+
+    Emulator emu;
+    emu.initializeElf(elf_file_name);
+    ElfCode code;
+    if (!emu.ready_to_run || scanElfCode(elf_file_name, &code) != 0)
+    {
+        printf("ERRO: Could not load %s\n", elf_file_name);
+        return 1;
+    }
+
+    FILE *out = fopen(out_file_name, "w");
+    if (out == NULL)
+    {
+        printf("ERRO: Could not write %s\n", out_file_name);
+        return 1;
+    }
+    fprintf(out, "// Translation of %s made by rve-sbt, see sbt.h\n#include \"sbt.h\"\n\n", elf_file_name);
+
+    auto inCode = [&](u32 pc) {
+        for (const auto &range : code.ranges)
+        {
+            if (pc >= range.first && pc + 2 <= range.second)
+                return true;
+        }
+        return false;
+    };
+
+    // every block reachable from an entry along static successors
+    std::vector<SbtBlock> translated;
+    std::vector<u32> work(code.entries.rbegin(), code.entries.rend());
+    std::set<u32> seen;
+    u32 instructions = 0;
+    while (!work.empty())
+    {
+        u32 pc = work.back();
+        work.pop_back();
+        if ((pc & 0x1) != 0 || !inCode(pc) || !seen.insert(pc).second)
+            continue;
+
+        // the image runs untranslated
+        BasicBlock *b = emu.buildBlock(pc, pc);
+        for (u32 next : {b->fall_pc, b->return_pc, b->taken_pc})
+        {
+            if (next != NO_SUCCESSOR)
+                work.push_back(next);
+        }
+
+        std::string body;
+        u32 count = translateBlock(b, body);
+        if (count == 0)
+            continue;
+        u32 hash = SBT_HASH_SEED;
+        for (u32 i = 0; i < b->len; i++)
+        {
+            hash = sbtHash(hash, b->ops[i].ins_word, b->ops[i].len);
+        }
+        translated.push_back({pc, b->len, count, hash, NULL});
+        instructions += count;
+        fprintf(out, "static void block_%08x(SbtContext *c)\n{\n    u32 *x = c->xreg;\n%s}\n\n", pc, body.c_str());
+    }
+
+    std::sort(translated.begin(), translated.end(), [](const SbtBlock &l, const SbtBlock &r) { return l.pc < r.pc; });
+    fprintf(out, "static const SbtBlock blocks[] = {\n");
+    for (const SbtBlock &t : translated)
+    {
+        fprintf(out, "    {0x%08xu, %u, %u, 0x%08xu, block_%08x},\n", t.pc, t.len, t.translated, t.hash, t.pc);
+    }
+    if (translated.empty())
+        fprintf(out, "    {0, 0, 0, 0, NULL},\n");
+    fprintf(out, "};\n\nextern \"C\" const SbtImage rve_sbt_image = {SBT_ABI_VERSION, %u, blocks};\n",
+            (u32)translated.size());
+    fclose(out);
+
+    printf("INFO: Translated %u instructions in %u blocks to %s\n", instructions, (u32)translated.size(), out_file_name);
+    return 0;
+}